@@ -0,0 +1,97 @@
+/*****************************************************************************
+address.c
+
+Description: Turns a daemon address argument into a socket address. Port
+numbers become IPv4 addresses on the given host, so clients reach the daemon
+over loopback without resolving a host name. Unix and abstract addresses
+skip the TCP stack altogether.
+*****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "address.h"
+
+/*****************************************************************************
+Fills in storage and its length for the address. host, in host byte order,
+is the IPv4 address used with a port number.
+Returns -1 if the address is malformed
+*****************************************************************************/
+int parseAddress(const char *address, uint32_t host, struct sockaddr_storage *storage, socklen_t *length)
+{
+	struct sockaddr_un *unixAddress = (struct sockaddr_un *)storage;
+	struct sockaddr_in *inetAddress = (struct sockaddr_in *)storage;
+	char *end;
+	long port;
+	size_t nameLength;
+
+	memset(storage, '\0', sizeof(*storage));
+	if (!strncmp(address, "unix:", strlen("unix:")))
+		address += strlen("unix:");
+	else if (address[0] != '/' && address[0] != '@')
+	{
+		port = strtol(address, &end, 10);
+		if (*address == '\0' || *end != '\0' || port < 0 || port > 65535)
+			return -1;
+		inetAddress->sin_family = AF_INET;
+		inetAddress->sin_port = htons(port);
+		inetAddress->sin_addr.s_addr = htonl(host);
+		*length = sizeof(struct sockaddr_in);
+		return 0;
+	}
+
+	//abstract names start with a NUL byte and are not NUL terminated
+	nameLength = strlen(address);
+	if (nameLength < 2 || nameLength >= sizeof(unixAddress->sun_path))
+		return -1;
+	unixAddress->sun_family = AF_UNIX;
+	memcpy(unixAddress->sun_path, address, nameLength);
+	if (address[0] == '@')
+	{
+		unixAddress->sun_path[0] = '\0';
+		*length = offsetof(struct sockaddr_un, sun_path) + nameLength;
+	}
+	else
+	{
+		*length = sizeof(struct sockaddr_un);
+	}
+	return 0;
+}
+
+/*****************************************************************************
+Removes a socket file left behind at a Unix address by an earlier run, so
+the address can be bound again. A socket is only stale if connecting to it
+is refused; one a running daemon listens on, and other kinds of file, are
+left alone, so binding fails instead.
+*****************************************************************************/
+void removeStaleSocket(const struct sockaddr_storage *storage)
+{
+	const struct sockaddr_un *unixAddress = (const struct sockaddr_un *)storage;
+	struct stat info;
+	int socketFD;
+	int refused;
+
+	if (storage->ss_family != AF_UNIX || unixAddress->sun_path[0] == '\0')
+		return;
+	if (stat(unixAddress->sun_path, &info) < 0 || !S_ISSOCK(info.st_mode))
+		return;
+
+	//non-blocking, so a daemon with a full backlog cannot stall the check
+	socketFD = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (socketFD < 0)
+		return;
+	refused = connect(socketFD, (const struct sockaddr *)unixAddress, sizeof(struct sockaddr_un)) < 0 && errno == ECONNREFUSED;
+	close(socketFD);
+	if (refused)
+		unlink(unixAddress->sun_path);
+}
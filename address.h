@@ -0,0 +1,19 @@
+/*****************************************************************************
+address.h
+
+Description: Parses the address a daemon listens on and a client connects
+to. An address is either a TCP port number, a Unix socket path written as
+unix:<path> or as an absolute path, or a name in the Linux abstract socket
+namespace written as @<name> (or unix:@<name>).
+*****************************************************************************/
+
+#ifndef ADDRESS_H
+#define ADDRESS_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+int parseAddress(const char *address, uint32_t host, struct sockaddr_storage *storage, socklen_t *length);
+void removeStaleSocket(const struct sockaddr_storage *storage);
+
+#endif
@@ -0,0 +1,640 @@
+/*****************************************************************************
+cipher.c
+
+Description: Scalar and SIMD implementations of the one time pad cipher.
+Each character is mapped to 0..26, the key is added (encrypt) or subtracted
+(decrypt), the modulo 27 is done with a compare and a conditional correction
+instead of a division, and the value is mapped back to a character.
+The SSE2 kernel handles 16 characters per instruction and the AVX2 kernel
+32; the scalar kernel finishes any remainder. The same widths are used to
+check that text only holds characters of the alphabet and to XOR binary
+messages with their key.
+Packing combines neighbouring 5 bit values with multiply-add instructions
+and gathers the 5 significant bytes of every 8 with a byte shuffle, which
+needs SSSE3; unpacking shuffles the bytes holding each value into its own
+16 bit lane and shifts it into place with a multiply.
+*****************************************************************************/
+
+#include <string.h>
+#include <stdint.h>
+
+#include "cipher.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CIPHER_X86
+#endif
+
+typedef void (*cipherKernel)(char *out, const char *message, const char *key, size_t length, int decrypt);
+typedef void (*xorKernel)(char *out, const char *message, const char *key, size_t length);
+typedef size_t (*scanKernel)(const char *text, size_t length);
+typedef size_t (*packKernel)(unsigned char *out, const char *text, size_t length);
+typedef size_t (*unpackKernel)(char *out, const unsigned char *packed, size_t packedLength);
+
+// Kernel sets from narrowest to widest, each named after the instruction set it needs
+enum kernelLevel
+{
+	LEVEL_SCALAR,
+	LEVEL_SSE2,
+	LEVEL_SSSE3,
+	LEVEL_AVX2
+};
+
+static const char *const levelNames[] = {"scalar", "sse2", "ssse3", "avx2"};
+
+static cipherKernel selectedKernel = cipherTransformScalar;
+static xorKernel selectedXor = cipherXorScalar;
+static scanKernel selectedScan = cipherScanScalar;
+static packKernel selectedPack = cipherPackScalar;
+static unpackKernel selectedUnpack = cipherUnpackScalar;
+static const char *selectedKernelName = "scalar";
+
+/*****************************************************************************
+Converts a valid char into the corresponding INT for encryption
+*****************************************************************************/
+int cipherCharToInt(char c)
+{
+	int x;
+
+	if (c == ' ')
+		x = MAXCIPHER - 1;
+	else
+		x = c - 'A';
+	return x;
+}
+
+/*****************************************************************************
+Converts a valid int into the corresponding char for encryption
+*****************************************************************************/
+char cipherIntToChar(int x)
+{
+	char c;
+
+	if (x == MAXCIPHER - 1)
+		c = ' ';
+	else
+		c = x + 'A';
+	return c;
+}
+
+/*****************************************************************************
+Reference implementation, one character at a time
+*****************************************************************************/
+void cipherTransformScalar(char *out, const char *message, const char *key, size_t length, int decrypt)
+{
+	size_t i;
+
+	for (i = 0; i < length; i++)
+	{
+		int cipher = cipherCharToInt(message[i]);
+		if (decrypt)
+		{
+			cipher -= cipherCharToInt(key[i]);
+			if (cipher < 0)
+				cipher += MAXCIPHER;
+		}
+		else
+			cipher += cipherCharToInt(key[i]);
+		cipher %= MAXCIPHER;
+		out[i] = cipherIntToChar(cipher);
+	}
+}
+
+/*****************************************************************************
+Reference alphabet check, returns the index of the first character that is
+not a capital letter or space, or length if there is none
+*****************************************************************************/
+size_t cipherScanScalar(const char *text, size_t length)
+{
+	size_t i;
+
+	for (i = 0; i < length; i++)
+	{
+		if ((unsigned char)(text[i] - 'A') > 'Z' - 'A' && text[i] != ' ')
+			return i;
+	}
+	return length;
+}
+
+/*****************************************************************************
+Reference XOR of arbitrary bytes, a word at a time
+*****************************************************************************/
+void cipherXorScalar(char *out, const char *message, const char *key, size_t length)
+{
+	uint64_t m, k;
+	size_t i;
+
+	//memcpy keeps unaligned words legal, compilers turn it into plain loads
+	for (i = 0; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t))
+	{
+		memcpy(&m, message + i, sizeof(m));
+		memcpy(&k, key + i, sizeof(k));
+		m ^= k;
+		memcpy(out + i, &m, sizeof(m));
+	}
+	for (; i < length; i++)
+		out[i] = message[i] ^ key[i];
+}
+
+/*****************************************************************************
+Reference packer, 8 characters to 5 bytes. A slot left over at the end is
+filled with PACK_PAD. out may be text itself.
+Returns the number of bytes written
+*****************************************************************************/
+size_t cipherPackScalar(unsigned char *out, const char *text, size_t length)
+{
+	size_t i, j, count, bytes;
+	size_t written = 0;
+	uint64_t bits;
+
+	for (i = 0; i < length; i += 8)
+	{
+		count = length - i < 8 ? length - i : 8;
+		bits = 0;
+		for (j = 0; j < 8; j++)
+			bits |= (uint64_t)(j < count ? cipherCharToInt(text[i + j]) : PACK_PAD) << (5 * j);
+		bytes = (5 * count + 7) / 8;
+		for (j = 0; j < bytes; j++)
+			out[written++] = bits >> (8 * j);
+	}
+	return written;
+}
+
+/*****************************************************************************
+Reference unpacker
+Returns the number of characters written, or (size_t)-1 if the packed data
+holds a value outside the alphabet
+*****************************************************************************/
+size_t cipherUnpackScalar(char *out, const unsigned char *packed, size_t packedLength)
+{
+	size_t slots = packedLength * 8 / 5;
+	size_t i, j, count, bytes;
+	size_t written = 0;
+	uint64_t bits;
+	int x;
+
+	for (i = 0; written < slots; i += 5)
+	{
+		bytes = packedLength - i < 5 ? packedLength - i : 5;
+		bits = 0;
+		for (j = 0; j < bytes; j++)
+			bits |= (uint64_t)packed[i + j] << (8 * j);
+		count = slots - written < 8 ? slots - written : 8;
+		for (j = 0; j < count; j++)
+		{
+			x = (bits >> (5 * j)) & 31;
+			if (x >= MAXCIPHER)
+				return x == PACK_PAD && written + j == slots - 1 ? written + j : (size_t)-1;
+			out[written + j] = cipherIntToChar(x);
+		}
+		written += count;
+	}
+	return written;
+}
+
+#ifdef CIPHER_X86
+/*****************************************************************************
+SSE2 kernel, 16 characters per instruction
+*****************************************************************************/
+__attribute__((target("sse2"))) static inline __m128i charsToInts128(__m128i c)
+{
+	__m128i isSpace = _mm_cmpeq_epi8(c, _mm_set1_epi8(' '));
+	__m128i x = _mm_sub_epi8(c, _mm_set1_epi8('A'));
+	return _mm_or_si128(_mm_andnot_si128(isSpace, x), _mm_and_si128(isSpace, _mm_set1_epi8(MAXCIPHER - 1)));
+}
+
+__attribute__((target("sse2"))) static inline __m128i intsToChars128(__m128i x)
+{
+	__m128i isSpace = _mm_cmpeq_epi8(x, _mm_set1_epi8(MAXCIPHER - 1));
+	__m128i c = _mm_add_epi8(x, _mm_set1_epi8('A'));
+	return _mm_or_si128(_mm_andnot_si128(isSpace, c), _mm_and_si128(isSpace, _mm_set1_epi8(' ')));
+}
+
+__attribute__((target("sse2"))) static void cipherTransformSSE2(char *out, const char *message, const char *key, size_t length, int decrypt)
+{
+	const __m128i modulus = _mm_set1_epi8(MAXCIPHER);
+	const __m128i maxValue = _mm_set1_epi8(MAXCIPHER - 1);
+	const __m128i zero = _mm_setzero_si128();
+	size_t i;
+
+	for (i = 0; i + 16 <= length; i += 16)
+	{
+		__m128i m = charsToInts128(_mm_loadu_si128((const __m128i *)(message + i)));
+		__m128i k = charsToInts128(_mm_loadu_si128((const __m128i *)(key + i)));
+		__m128i x;
+
+		//values stay within -26..52 so signed byte compares are safe
+		if (decrypt)
+		{
+			x = _mm_sub_epi8(m, k);
+			x = _mm_add_epi8(x, _mm_and_si128(_mm_cmpgt_epi8(zero, x), modulus));
+		}
+		else
+		{
+			x = _mm_add_epi8(m, k);
+			x = _mm_sub_epi8(x, _mm_and_si128(_mm_cmpgt_epi8(x, maxValue), modulus));
+		}
+		_mm_storeu_si128((__m128i *)(out + i), intsToChars128(x));
+	}
+	cipherTransformScalar(out + i, message + i, key + i, length - i, decrypt);
+}
+
+__attribute__((target("sse2"))) static void cipherXorSSE2(char *out, const char *message, const char *key, size_t length)
+{
+	size_t i;
+
+	for (i = 0; i + 16 <= length; i += 16)
+	{
+		__m128i m = _mm_loadu_si128((const __m128i *)(message + i));
+		__m128i k = _mm_loadu_si128((const __m128i *)(key + i));
+		_mm_storeu_si128((__m128i *)(out + i), _mm_xor_si128(m, k));
+	}
+	cipherXorScalar(out + i, message + i, key + i, length - i);
+}
+
+__attribute__((target("sse2"))) static size_t cipherScanSSE2(const char *text, size_t length)
+{
+	const __m128i lastLetter = _mm_set1_epi8('Z' - 'A');
+	size_t i;
+	int mask;
+
+	for (i = 0; i + 16 <= length; i += 16)
+	{
+		__m128i c = _mm_loadu_si128((const __m128i *)(text + i));
+		__m128i x = _mm_sub_epi8(c, _mm_set1_epi8('A'));
+
+		//a letter is any byte whose unsigned distance from 'A' is at most 25
+		__m128i letter = _mm_cmpeq_epi8(_mm_min_epu8(x, lastLetter), x);
+		__m128i space = _mm_cmpeq_epi8(c, _mm_set1_epi8(' '));
+		mask = _mm_movemask_epi8(_mm_or_si128(letter, space));
+		if (mask != 0xFFFF)
+			return i + __builtin_ctz(~mask);
+	}
+	return i + cipherScanScalar(text + i, length - i);
+}
+
+/*****************************************************************************
+AVX2 kernel, 32 characters per instruction
+*****************************************************************************/
+__attribute__((target("avx2"))) static inline __m256i charsToInts256(__m256i c)
+{
+	__m256i isSpace = _mm256_cmpeq_epi8(c, _mm256_set1_epi8(' '));
+	__m256i x = _mm256_sub_epi8(c, _mm256_set1_epi8('A'));
+	return _mm256_blendv_epi8(x, _mm256_set1_epi8(MAXCIPHER - 1), isSpace);
+}
+
+__attribute__((target("avx2"))) static inline __m256i intsToChars256(__m256i x)
+{
+	__m256i isSpace = _mm256_cmpeq_epi8(x, _mm256_set1_epi8(MAXCIPHER - 1));
+	__m256i c = _mm256_add_epi8(x, _mm256_set1_epi8('A'));
+	return _mm256_blendv_epi8(c, _mm256_set1_epi8(' '), isSpace);
+}
+
+__attribute__((target("avx2"))) static void cipherTransformAVX2(char *out, const char *message, const char *key, size_t length, int decrypt)
+{
+	const __m256i modulus = _mm256_set1_epi8(MAXCIPHER);
+	const __m256i maxValue = _mm256_set1_epi8(MAXCIPHER - 1);
+	const __m256i zero = _mm256_setzero_si256();
+	size_t i;
+
+	for (i = 0; i + 32 <= length; i += 32)
+	{
+		__m256i m = charsToInts256(_mm256_loadu_si256((const __m256i *)(message + i)));
+		__m256i k = charsToInts256(_mm256_loadu_si256((const __m256i *)(key + i)));
+		__m256i x;
+
+		if (decrypt)
+		{
+			x = _mm256_sub_epi8(m, k);
+			x = _mm256_add_epi8(x, _mm256_and_si256(_mm256_cmpgt_epi8(zero, x), modulus));
+		}
+		else
+		{
+			x = _mm256_add_epi8(m, k);
+			x = _mm256_sub_epi8(x, _mm256_and_si256(_mm256_cmpgt_epi8(x, maxValue), modulus));
+		}
+		_mm256_storeu_si256((__m256i *)(out + i), intsToChars256(x));
+	}
+	//the SSE2 kernel uses legacy encodings, which stall while the upper
+	//halves of the ymm registers are dirty
+	_mm256_zeroupper();
+	cipherTransformSSE2(out + i, message + i, key + i, length - i, decrypt);
+}
+
+__attribute__((target("avx2"))) static void cipherXorAVX2(char *out, const char *message, const char *key, size_t length)
+{
+	size_t i;
+
+	//two vectors per step keep both load ports busy
+	for (i = 0; i + 64 <= length; i += 64)
+	{
+		__m256i m0 = _mm256_loadu_si256((const __m256i *)(message + i));
+		__m256i m1 = _mm256_loadu_si256((const __m256i *)(message + i + 32));
+		__m256i k0 = _mm256_loadu_si256((const __m256i *)(key + i));
+		__m256i k1 = _mm256_loadu_si256((const __m256i *)(key + i + 32));
+		_mm256_storeu_si256((__m256i *)(out + i), _mm256_xor_si256(m0, k0));
+		_mm256_storeu_si256((__m256i *)(out + i + 32), _mm256_xor_si256(m1, k1));
+	}
+	_mm256_zeroupper();
+	cipherXorSSE2(out + i, message + i, key + i, length - i);
+}
+
+__attribute__((target("avx2"))) static size_t cipherScanAVX2(const char *text, size_t length)
+{
+	const __m256i lastLetter = _mm256_set1_epi8('Z' - 'A');
+	size_t i;
+	unsigned int mask;
+
+	for (i = 0; i + 32 <= length; i += 32)
+	{
+		__m256i c = _mm256_loadu_si256((const __m256i *)(text + i));
+		__m256i x = _mm256_sub_epi8(c, _mm256_set1_epi8('A'));
+		__m256i letter = _mm256_cmpeq_epi8(_mm256_min_epu8(x, lastLetter), x);
+		__m256i space = _mm256_cmpeq_epi8(c, _mm256_set1_epi8(' '));
+		mask = _mm256_movemask_epi8(_mm256_or_si256(letter, space));
+		if (mask != 0xFFFFFFFF)
+			return i + __builtin_ctz(~mask);
+	}
+	//the SSE2 kernel uses legacy encodings, which stall while the upper
+	//halves of the ymm registers are dirty
+	_mm256_zeroupper();
+	return i + cipherScanSSE2(text + i, length - i);
+}
+
+/*****************************************************************************
+SSSE3 packer, 16 characters to 10 bytes per step. Each step stores 16
+bytes, so it stops while another step's worth of output remains and never
+writes past the packed length. Working forwards, the stores never reach
+text that is still to be read, so out may be text itself.
+*****************************************************************************/
+__attribute__((target("ssse3"))) static inline __m128i packStep128(__m128i values)
+{
+	const __m128i low20 = _mm_set1_epi64x(0xFFFFF);
+
+	//pairs of 5 bit values into 10 bits, pairs of those into 20, and the two
+	//20 bit halves of every 64 bit lane into its low 40 bits
+	__m128i x = _mm_maddubs_epi16(values, _mm_set1_epi16(1 | (32 << 8)));
+	x = _mm_madd_epi16(x, _mm_set1_epi32(1 | (1024 << 16)));
+	x = _mm_or_si128(_mm_and_si128(x, low20), _mm_andnot_si128(low20, _mm_srli_epi64(x, 12)));
+	return _mm_shuffle_epi8(x, _mm_setr_epi8(0, 1, 2, 3, 4, 8, 9, 10, 11, 12, -1, -1, -1, -1, -1, -1));
+}
+
+__attribute__((target("ssse3"))) static size_t cipherPackSSSE3(unsigned char *out, const char *text, size_t length)
+{
+	size_t i, written = 0;
+
+	for (i = 0; i + 32 <= length; i += 16, written += 10)
+		_mm_storeu_si128((__m128i *)(out + written), packStep128(charsToInts128(_mm_loadu_si128((const __m128i *)(text + i)))));
+	return written + cipherPackScalar(out + written, text + i, length - i);
+}
+
+/*****************************************************************************
+SSSE3 unpacker, 10 bytes to 16 characters per step. Value j of a 5 byte
+group starts at bit 5j; the two bytes around it are shuffled into a 16 bit
+lane, the multiply moves its top bit to bit 15 and the shift brings it down.
+Steps stop while at least 6 bytes remain, so the last group, which may hold
+the pad, is always left to the scalar code.
+*****************************************************************************/
+__attribute__((target("ssse3"))) static inline __m128i unpackStep128(__m128i bytes)
+{
+	const __m128i scale = _mm_setr_epi16(1 << 11, 1 << 6, 1 << 9, 1 << 4, 1 << 7, 1 << 10, 1 << 5, 1 << 8);
+	__m128i first = _mm_shuffle_epi8(bytes, _mm_setr_epi8(0, 1, 0, 1, 1, 2, 1, 2, 2, 3, 3, 4, 3, 4, 4, -1));
+	__m128i second = _mm_shuffle_epi8(bytes, _mm_setr_epi8(5, 6, 5, 6, 6, 7, 6, 7, 7, 8, 8, 9, 8, 9, 9, -1));
+
+	first = _mm_srli_epi16(_mm_mullo_epi16(first, scale), 11);
+	second = _mm_srli_epi16(_mm_mullo_epi16(second, scale), 11);
+	return _mm_packus_epi16(first, second);
+}
+
+__attribute__((target("ssse3"))) static size_t cipherUnpackSSSE3(char *out, const unsigned char *packed, size_t packedLength)
+{
+	const __m128i maxValue = _mm_set1_epi8(MAXCIPHER - 1);
+	size_t i, written = 0, rest;
+	__m128i values;
+
+	for (i = 0; i + 16 <= packedLength; i += 10, written += 16)
+	{
+		values = unpackStep128(_mm_loadu_si128((const __m128i *)(packed + i)));
+		if (_mm_movemask_epi8(_mm_cmpgt_epi8(values, maxValue)))
+			return (size_t)-1;
+		_mm_storeu_si128((__m128i *)(out + written), intsToChars128(values));
+	}
+	rest = cipherUnpackScalar(out + written, packed + i, packedLength - i);
+	return rest == (size_t)-1 ? rest : written + rest;
+}
+
+/*****************************************************************************
+AVX2 packer and unpacker, the SSSE3 steps on both 128 bit lanes at once
+*****************************************************************************/
+__attribute__((target("avx2"))) static size_t cipherPackAVX2(unsigned char *out, const char *text, size_t length)
+{
+	const __m256i low20 = _mm256_set1_epi64x(0xFFFFF);
+	const __m256i gather = _mm256_setr_epi8(0, 1, 2, 3, 4, 8, 9, 10, 11, 12, -1, -1, -1, -1, -1, -1,
+		0, 1, 2, 3, 4, 8, 9, 10, 11, 12, -1, -1, -1, -1, -1, -1);
+	size_t i, written = 0;
+	__m256i x;
+
+	//each step writes 26 bytes for 20, so leave room for the next one
+	for (i = 0; i + 48 <= length; i += 32, written += 20)
+	{
+		x = charsToInts256(_mm256_loadu_si256((const __m256i *)(text + i)));
+		x = _mm256_maddubs_epi16(x, _mm256_set1_epi16(1 | (32 << 8)));
+		x = _mm256_madd_epi16(x, _mm256_set1_epi32(1 | (1024 << 16)));
+		x = _mm256_or_si256(_mm256_and_si256(x, low20), _mm256_andnot_si256(low20, _mm256_srli_epi64(x, 12)));
+		x = _mm256_shuffle_epi8(x, gather);
+		_mm_storeu_si128((__m128i *)(out + written), _mm256_castsi256_si128(x));
+		_mm_storeu_si128((__m128i *)(out + written + 10), _mm256_extracti128_si256(x, 1));
+	}
+	_mm256_zeroupper();
+	return written + cipherPackSSSE3(out + written, text + i, length - i);
+}
+
+__attribute__((target("avx2"))) static size_t cipherUnpackAVX2(char *out, const unsigned char *packed, size_t packedLength)
+{
+	const __m256i scale = _mm256_setr_epi16(1 << 11, 1 << 6, 1 << 9, 1 << 4, 1 << 7, 1 << 10, 1 << 5, 1 << 8,
+		1 << 11, 1 << 6, 1 << 9, 1 << 4, 1 << 7, 1 << 10, 1 << 5, 1 << 8);
+	const __m256i firstGroup = _mm256_setr_epi8(0, 1, 0, 1, 1, 2, 1, 2, 2, 3, 3, 4, 3, 4, 4, -1,
+		0, 1, 0, 1, 1, 2, 1, 2, 2, 3, 3, 4, 3, 4, 4, -1);
+	const __m256i secondGroup = _mm256_setr_epi8(5, 6, 5, 6, 6, 7, 6, 7, 7, 8, 8, 9, 8, 9, 9, -1,
+		5, 6, 5, 6, 6, 7, 6, 7, 7, 8, 8, 9, 8, 9, 9, -1);
+	const __m256i maxValue = _mm256_set1_epi8(MAXCIPHER - 1);
+	size_t i, written = 0, rest;
+	__m256i bytes, first, second, values;
+
+	//the lanes hold bytes i..i+9 and i+10..i+19, and 6 bytes must remain
+	for (i = 0; i + 26 <= packedLength; i += 20, written += 32)
+	{
+		bytes = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(packed + i))),
+			_mm_loadu_si128((const __m128i *)(packed + i + 10)), 1);
+		first = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_shuffle_epi8(bytes, firstGroup), scale), 11);
+		second = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_shuffle_epi8(bytes, secondGroup), scale), 11);
+		values = _mm256_packus_epi16(first, second);
+		if (_mm256_movemask_epi8(_mm256_cmpgt_epi8(values, maxValue)))
+		{
+			_mm256_zeroupper();
+			return (size_t)-1;
+		}
+		_mm256_storeu_si256((__m256i *)(out + written), intsToChars256(values));
+	}
+	_mm256_zeroupper();
+	rest = cipherUnpackSSSE3(out + written, packed + i, packedLength - i);
+	return rest == (size_t)-1 ? rest : written + rest;
+}
+
+#endif
+
+/*****************************************************************************
+Returns 1 if this CPU can run the given kernel level
+*****************************************************************************/
+static int levelSupported(int level)
+{
+#ifdef CIPHER_X86
+	__builtin_cpu_init();
+	if (level == LEVEL_AVX2)
+		return __builtin_cpu_supports("avx2");
+	if (level == LEVEL_SSSE3)
+		return __builtin_cpu_supports("ssse3");
+	if (level == LEVEL_SSE2)
+		return __builtin_cpu_supports("sse2");
+#endif
+	return level == LEVEL_SCALAR;
+}
+
+/*****************************************************************************
+Points every cipher function at the kernels of the given level. Each level
+keeps the kernels of the one below it that it has no wider version of.
+*****************************************************************************/
+static void useLevel(int level)
+{
+	selectedKernel = cipherTransformScalar;
+	selectedXor = cipherXorScalar;
+	selectedScan = cipherScanScalar;
+	selectedPack = cipherPackScalar;
+	selectedUnpack = cipherUnpackScalar;
+#ifdef CIPHER_X86
+	if (level >= LEVEL_SSE2)
+	{
+		selectedKernel = cipherTransformSSE2;
+		selectedXor = cipherXorSSE2;
+		selectedScan = cipherScanSSE2;
+	}
+	if (level >= LEVEL_SSSE3)
+	{
+		selectedPack = cipherPackSSSE3;
+		selectedUnpack = cipherUnpackSSSE3;
+	}
+	if (level >= LEVEL_AVX2)
+	{
+		selectedKernel = cipherTransformAVX2;
+		selectedXor = cipherXorAVX2;
+		selectedScan = cipherScanAVX2;
+		selectedPack = cipherPackAVX2;
+		selectedUnpack = cipherUnpackAVX2;
+	}
+#endif
+	selectedKernelName = levelNames[level];
+}
+
+/*****************************************************************************
+Picks the widest kernel this CPU supports before main() runs
+*****************************************************************************/
+__attribute__((constructor)) static void cipherSelectKernel()
+{
+	int level = LEVEL_AVX2;
+
+	while (!levelSupported(level))
+		level--;
+	useLevel(level);
+}
+
+/*****************************************************************************
+Switches to the named kernel level: "scalar", "sse2", "ssse3" (SSE2 with the
+SSSE3 packing kernels) or "avx2". Lets tests check every kernel the CPU
+supports against the scalar code; not safe while other threads transform.
+Returns 0, or -1 if the name is unknown or the CPU cannot run the kernel
+*****************************************************************************/
+int cipherUseKernel(const char *name)
+{
+	int level;
+
+	for (level = LEVEL_SCALAR; level <= LEVEL_AVX2; level++)
+	{
+		if (!strcmp(name, levelNames[level]))
+		{
+			if (!levelSupported(level))
+				return -1;
+			useLevel(level);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/*****************************************************************************
+Adds the key to the message, writing length characters to out
+*****************************************************************************/
+void cipherEncrypt(char *out, const char *message, const char *key, size_t length)
+{
+	selectedKernel(out, message, key, length, 0);
+}
+
+/*****************************************************************************
+Subtracts the key from the message, writing length characters to out
+*****************************************************************************/
+void cipherDecrypt(char *out, const char *message, const char *key, size_t length)
+{
+	selectedKernel(out, message, key, length, 1);
+}
+
+/*****************************************************************************
+XORs length bytes of the message with the key, for binary messages.
+Encrypting and decrypting are the same operation.
+*****************************************************************************/
+void cipherXor(char *out, const char *message, const char *key, size_t length)
+{
+	selectedXor(out, message, key, length);
+}
+
+/*****************************************************************************
+Returns the index of the first character of text outside the alphabet, or
+length if every character is valid
+*****************************************************************************/
+size_t cipherScanText(const char *text, size_t length)
+{
+	return selectedScan(text, length);
+}
+
+/*****************************************************************************
+Returns how many bytes length characters take once packed
+*****************************************************************************/
+size_t cipherPackedLength(size_t length)
+{
+	return (length * 5 + 7) / 8;
+}
+
+/*****************************************************************************
+Packs length characters of the alphabet into cipherPackedLength(length)
+bytes of out, which may be text itself
+Returns the number of bytes written
+*****************************************************************************/
+size_t cipherPack(unsigned char *out, const char *text, size_t length)
+{
+	return selectedPack(out, text, length);
+}
+
+/*****************************************************************************
+Unpacks packed data into at most packedLength * 8 / 5 characters of out
+Returns the number of characters, or (size_t)-1 if the data is malformed
+*****************************************************************************/
+size_t cipherUnpack(char *out, const unsigned char *packed, size_t packedLength)
+{
+	return selectedUnpack(out, packed, packedLength);
+}
+
+/*****************************************************************************
+Name of the kernel in use, for diagnostics and benchmarks
+*****************************************************************************/
+const char *cipherKernelName()
+{
+	return selectedKernelName;
+}
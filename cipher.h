@@ -0,0 +1,46 @@
+/*****************************************************************************
+cipher.h
+
+Description: One time pad arithmetic over the 27 character alphabet of
+capital letters plus space. Messages are transformed a whole vector at a
+time; the widest kernel the CPU supports is picked once at startup, and
+tests can switch to any narrower one with cipherUseKernel(). out may
+be the message itself, so a message can be transformed in place.
+Text can also be packed for the wire at 5 bits per character, 8 characters
+to 5 bytes, least significant bits first. Binary messages of arbitrary
+bytes are transformed by XOR with the key instead, which is its own inverse.
+*****************************************************************************/
+
+#ifndef CIPHER_H
+#define CIPHER_H
+
+#include <stddef.h>
+
+#define MAXCIPHER 27
+
+// 5 bit code filling the unused last slot of a packed message
+#define PACK_PAD 31
+
+int cipherCharToInt(char c);
+char cipherIntToChar(int x);
+
+void cipherEncrypt(char *out, const char *message, const char *key, size_t length);
+void cipherDecrypt(char *out, const char *message, const char *key, size_t length);
+
+void cipherXor(char *out, const char *message, const char *key, size_t length);
+
+size_t cipherScanText(const char *text, size_t length);
+
+size_t cipherPackedLength(size_t length);
+size_t cipherPack(unsigned char *out, const char *text, size_t length);
+size_t cipherUnpack(char *out, const unsigned char *packed, size_t packedLength);
+
+void cipherTransformScalar(char *out, const char *message, const char *key, size_t length, int decrypt);
+void cipherXorScalar(char *out, const char *message, const char *key, size_t length);
+size_t cipherScanScalar(const char *text, size_t length);
+size_t cipherPackScalar(unsigned char *out, const char *text, size_t length);
+size_t cipherUnpackScalar(char *out, const unsigned char *packed, size_t packedLength);
+const char *cipherKernelName();
+int cipherUseKernel(const char *name);
+
+#endif
@@ -0,0 +1,319 @@
+/*****************************************************************************
+cipher_test.c
+
+Description: Checks every kernel the CPU supports against the scalar
+reference code in cipher.c: the SSE2 transform, XOR and scan kernels, the
+SSSE3 packing kernels and the AVX2 kernels. Every message and key character
+pair is encrypted and decrypted, then every length up to a few thousand
+characters is run at unaligned offsets, so the vector loops, their tails
+and the remainder code are all exercised, both into a separate buffer and in
+place.
+Packing, unpacking, alphabet scans and XOR are checked the same way.
+One ok or FAILED line is printed per kernel.
+Exits 0 if every kernel agreed with the reference, 1 otherwise.
+
+Intended Usage:
+cipher_test
+*****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "cipher.h"
+
+// Longest message tried, and how far the buffers are shifted from alignment
+#define MAXLENGTH 4200
+#define MAXOFFSET 3
+
+// Bytes past the end of every output that no kernel may write
+#define GUARD 64
+#define GUARD_BYTE 0x5A
+
+/*****************************************************************************
+Global Variables + Function Prototypes
+*****************************************************************************/
+void error(const char *msg) { fprintf(stderr, "%s", msg); exit(1); } // Error function used for reporting issues
+
+static const char *kernels[] = {"scalar", "sse2", "ssse3", "avx2"};
+
+static int failures = 0;
+
+/*****************************************************************************
+Counts a mismatch, and reports the first few
+*****************************************************************************/
+static void fail(const char *test, size_t length, size_t offset)
+{
+	failures++;
+	if (failures <= 20)
+		fprintf(stderr, "%s: mismatch at length %zu, offset %zu\n", test, length, offset);
+}
+
+/*****************************************************************************
+xorshift64* generator, much cheaper than rand() for the millions of
+characters the tests fill in
+*****************************************************************************/
+static uint64_t nextRandom()
+{
+	static uint64_t state = 1;
+
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return state * 0x2545F4914F6CDD1DULL;
+}
+
+/*****************************************************************************
+Fills a buffer with random characters of the alphabet
+*****************************************************************************/
+static void randomText(char *text, size_t length)
+{
+	size_t i;
+
+	for (i = 0; i < length; i++)
+		text[i] = cipherIntToChar((nextRandom() >> 32) % MAXCIPHER);
+}
+
+/*****************************************************************************
+Fills a buffer with random bytes
+*****************************************************************************/
+static void randomBytes(char *data, size_t length)
+{
+	size_t i;
+
+	for (i = 0; i < length; i++)
+		data[i] = nextRandom() >> 32;
+}
+
+/*****************************************************************************
+Returns 1 if the guard bytes after length bytes of out are untouched
+*****************************************************************************/
+static int guardIntact(const char *out, size_t length)
+{
+	size_t i;
+
+	for (i = 0; i < GUARD; i++)
+	{
+		if ((unsigned char)out[length + i] != GUARD_BYTE)
+			return 0;
+	}
+	return 1;
+}
+
+/*****************************************************************************
+Encrypts and decrypts every pair of message and key characters and checks
+the reference code against the arithmetic, then the kernels against it
+*****************************************************************************/
+static void testPairs()
+{
+	char message[MAXCIPHER * MAXCIPHER], key[MAXCIPHER * MAXCIPHER];
+	char expected[2][MAXCIPHER * MAXCIPHER], out[MAXCIPHER * MAXCIPHER];
+	size_t length = MAXCIPHER * MAXCIPHER;
+	int m, k, decrypt;
+
+	for (m = 0; m < MAXCIPHER; m++)
+	{
+		for (k = 0; k < MAXCIPHER; k++)
+		{
+			message[m * MAXCIPHER + k] = cipherIntToChar(m);
+			key[m * MAXCIPHER + k] = cipherIntToChar(k);
+			expected[0][m * MAXCIPHER + k] = cipherIntToChar((m + k) % MAXCIPHER);
+			expected[1][m * MAXCIPHER + k] = cipherIntToChar((m - k + MAXCIPHER) % MAXCIPHER);
+		}
+	}
+
+	for (decrypt = 0; decrypt < 2; decrypt++)
+	{
+		cipherTransformScalar(out, message, key, length, decrypt);
+		if (memcmp(out, expected[decrypt], length))
+			fail("scalar pairs", length, 0);
+		if (decrypt)
+			cipherDecrypt(out, message, key, length);
+		else
+			cipherEncrypt(out, message, key, length);
+		if (memcmp(out, expected[decrypt], length))
+			fail(decrypt ? "decrypt pairs" : "encrypt pairs", length, 0);
+	}
+}
+
+/*****************************************************************************
+Runs the encrypt and decrypt kernels over every length and offset, into a
+separate buffer and in place
+*****************************************************************************/
+static void testTransform(char *message, char *key, char *out, char *expected)
+{
+	size_t length, offset;
+	int decrypt;
+
+	for (length = 0; length <= MAXLENGTH; length++)
+	{
+		for (offset = 0; offset <= MAXOFFSET; offset++)
+		{
+			randomText(message + offset, length);
+			randomText(key + MAXOFFSET - offset, length);
+			for (decrypt = 0; decrypt < 2; decrypt++)
+			{
+				cipherTransformScalar(expected, message + offset, key + MAXOFFSET - offset, length, decrypt);
+
+				memset(out, GUARD_BYTE, MAXLENGTH + MAXOFFSET + GUARD);
+				if (decrypt)
+					cipherDecrypt(out + offset, message + offset, key + MAXOFFSET - offset, length);
+				else
+					cipherEncrypt(out + offset, message + offset, key + MAXOFFSET - offset, length);
+				if (memcmp(out + offset, expected, length) || !guardIntact(out + offset, length))
+					fail(decrypt ? "decrypt" : "encrypt", length, offset);
+
+				memcpy(out + offset, message + offset, length);
+				if (decrypt)
+					cipherDecrypt(out + offset, out + offset, key + MAXOFFSET - offset, length);
+				else
+					cipherEncrypt(out + offset, out + offset, key + MAXOFFSET - offset, length);
+				if (memcmp(out + offset, expected, length))
+					fail(decrypt ? "decrypt in place" : "encrypt in place", length, offset);
+			}
+		}
+	}
+}
+
+/*****************************************************************************
+Runs the XOR kernel over every length and offset on random bytes
+*****************************************************************************/
+static void testXor(char *message, char *key, char *out, char *expected)
+{
+	size_t length, offset;
+
+	for (length = 0; length <= MAXLENGTH; length++)
+	{
+		for (offset = 0; offset <= MAXOFFSET; offset++)
+		{
+			randomBytes(message + offset, length);
+			randomBytes(key + MAXOFFSET - offset, length);
+			cipherXorScalar(expected, message + offset, key + MAXOFFSET - offset, length);
+
+			memset(out, GUARD_BYTE, MAXLENGTH + MAXOFFSET + GUARD);
+			cipherXor(out + offset, message + offset, key + MAXOFFSET - offset, length);
+			if (memcmp(out + offset, expected, length) || !guardIntact(out + offset, length))
+				fail("xor", length, offset);
+
+			memcpy(out + offset, message + offset, length);
+			cipherXor(out + offset, out + offset, key + MAXOFFSET - offset, length);
+			if (memcmp(out + offset, expected, length))
+				fail("xor in place", length, offset);
+		}
+	}
+}
+
+/*****************************************************************************
+Packs and unpacks every length at every offset, checks the kernels against
+the reference and that unpacking gives the text back. Packing in place, as
+the daemon does, and corrupt packed data are tried as well.
+*****************************************************************************/
+static void testPacking(char *text, char *out, char *expected)
+{
+	unsigned char *packed = (unsigned char *)out;
+	size_t length, offset, packedLength, count;
+
+	for (length = 0; length <= MAXLENGTH; length++)
+	{
+		for (offset = 0; offset <= MAXOFFSET; offset++)
+		{
+			randomText(text + offset, length);
+			packedLength = cipherPackScalar((unsigned char *)expected, text + offset, length);
+			if (packedLength != cipherPackedLength(length))
+				fail("pack length", length, offset);
+
+			memset(out, GUARD_BYTE, MAXLENGTH + MAXOFFSET + GUARD);
+			count = cipherPack(packed + offset, text + offset, length);
+			if (count != packedLength || memcmp(packed + offset, expected, packedLength)
+				|| !guardIntact(out + offset, packedLength))
+				fail("pack", length, offset);
+
+			memset(out, GUARD_BYTE, MAXLENGTH + MAXOFFSET + GUARD);
+			count = cipherUnpack(out + offset, (unsigned char *)expected, packedLength);
+			if (count != length || memcmp(out + offset, text + offset, length)
+				|| !guardIntact(out + offset, packedLength * 8 / 5))
+				fail("unpack", length, offset);
+			if (cipherUnpackScalar(out + offset, (unsigned char *)expected, packedLength) != length)
+				fail("scalar unpack", length, offset);
+
+			memcpy(out + offset, text + offset, length);
+			count = cipherPack(packed + offset, out + offset, length);
+			if (count != packedLength || memcmp(packed + offset, expected, packedLength))
+				fail("pack in place", length, offset);
+
+			//a value past the alphabet in the first slot is rejected by both
+			if (packedLength > 0)
+			{
+				expected[0] = (expected[0] & ~31) | (MAXCIPHER + 1);
+				if (cipherUnpack(out, (unsigned char *)expected, packedLength) != (size_t)-1
+					|| cipherUnpackScalar(out, (unsigned char *)expected, packedLength) != (size_t)-1)
+					fail("unpack corrupt", length, offset);
+			}
+		}
+	}
+}
+
+/*****************************************************************************
+Scans texts of many lengths with one character outside the alphabet at
+many positions, and with none
+*****************************************************************************/
+static void testScan(char *text)
+{
+	size_t length, position;
+
+	for (length = 0; length <= MAXLENGTH; length += length < 300 ? 1 : 37)
+	{
+		randomText(text + 1, length);
+		if (cipherScanText(text + 1, length) != length || cipherScanScalar(text + 1, length) != length)
+			fail("scan", length, 1);
+		for (position = 0; position < length; position += length < 300 ? 1 : 13)
+		{
+			text[1 + position] = position % 2 ? 'a' : '@';
+			if (cipherScanText(text + 1, length) != position || cipherScanScalar(text + 1, length) != position)
+				fail("scan invalid", length, position);
+			text[1 + position] = 'A';
+		}
+	}
+}
+
+/*****************************************************************************
+Main Driver
+*****************************************************************************/
+int main()
+{
+	size_t size = MAXLENGTH + MAXOFFSET + GUARD;
+	char *message = malloc(size);
+	char *key = malloc(size);
+	char *out = malloc(size);
+	char *expected = malloc(size);
+	int totalFailures = 0;
+	size_t i;
+
+	if (message == NULL || key == NULL || out == NULL || expected == NULL)
+		error("ERROR allocating buffers\n");
+
+	for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+	{
+		if (cipherUseKernel(kernels[i]) < 0)
+		{
+			printf("%-8s not supported by this CPU\n", kernels[i]);
+			continue;
+		}
+		failures = 0;
+		testPairs();
+		testTransform(message, key, out, expected);
+		testXor(message, key, out, expected);
+		testPacking(message, out, expected);
+		testScan(message);
+		printf("%-8s %s\n", kernels[i], failures ? "FAILED" : "ok");
+		totalFailures += failures;
+	}
+
+	free(message);
+	free(key);
+	free(out);
+	free(expected);
+	return totalFailures ? 1 : 0;
+}
@@ -0,0 +1,1220 @@
+/*****************************************************************************
+client.c
+
+Description: Shared client side of the OTP protocol. Connects to a daemon on
+localhost, negotiates the newest protocol version both sides understand,
+and sends a text and key to be transformed, either whole or streamed in
+chunks straight from the files. Whole files are memory mapped and sent
+directly from the mapping. Keys may also be uploaded to the daemon once
+and referred to by ID afterwards. Over a Unix socket the text and key are
+placed in a shared memory segment instead, which the daemon transforms in
+place. Files of newline separated records can be sent as batches, many
+records to a request. A large file can be striped over several connections
+to one or more daemons, each range written to its place in the output as
+it comes back. Text can be packed at 5 bits a character on the wire, and
+in binary mode whole files of arbitrary bytes are XORed with the key.
+runClient() is the whole command line client; encrypt_client and
+decrypt_client only pass in their names.
+*****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "protocol.h"
+#include "cipher.h"
+#include "client.h"
+#include "address.h"
+
+// stdout buffer, results larger than this are written straight through
+#define OUTPUTBUFFER (1 << 20)
+
+// Most records sent in one BATCH frame
+#define BATCHRECORDS (1 << 16)
+
+// Largest range of a striped file sent in one request
+#define STRIPEMAX (16 << 20)
+
+// Most daemon addresses a striped client spreads its connections over
+#define MAXADDRESSES 64
+
+/*****************************************************************************
+A file being transformed over several connections. Ranges are claimed in
+order from nextRange by the connection threads; each thread connects to the
+next address in turn. The key is either mapped or stored on the daemons.
+*****************************************************************************/
+struct stripeJob
+{
+	const char *clientName;
+	char **addresses;
+	int addressCount;
+	int nextAddress;
+	const struct textFile *text;
+	const struct textFile *key;
+	uint64_t keyID;
+	uint64_t keyOffset;
+	size_t stripe;
+	size_t rangeCount;
+	size_t nextRange;
+
+	//results are written to output at base if it is seekable, otherwise
+	//kept in results until every range is done
+	int output;
+	off_t base;
+	char **results;
+};
+
+void error(const char *msg);
+
+int packedWire = 0;
+int binaryMode = 0;
+
+/*****************************************************************************
+Returns the handshake suffix for the version 2 mode in use, and the status
+a daemon answers it with
+*****************************************************************************/
+static const char *versionSuffix()
+{
+	return binaryMode ? VERSION_SUFFIX_BINARY : packedWire ? VERSION_SUFFIX_PACKED : VERSION_SUFFIX;
+}
+
+static const char *versionAccept()
+{
+	return binaryMode ? ACCEPT_BINARY : packedWire ? ACCEPT_PACKED : ACCEPT_V2;
+}
+
+/*****************************************************************************
+Returns 1 if text is packed on version 2 connections
+*****************************************************************************/
+static int packing()
+{
+	return packedWire && !binaryMode;
+}
+
+/*****************************************************************************
+Packs the characters of a payload for a packed connection, leaving the
+entry table of a BATCH as it is
+Returns the packed copy, its length in *packedLength
+*****************************************************************************/
+static char *packPayload(int op, const char *payload, size_t length, size_t *packedLength)
+{
+	size_t table = op == OP_BATCH ? BATCH_COUNT_SIZE + decodeUint64((const unsigned char *)payload) * BATCH_ENTRY_SIZE : 0;
+	char *packed = malloc(table + cipherPackedLength(length - table) + 1);
+
+	if (packed == NULL)
+		error("CLIENT: ERROR allocating packed buffer\n");
+	memcpy(packed, payload, table);
+	*packedLength = table + cipherPack((unsigned char *)packed + table, payload + table, length - table);
+	return packed;
+}
+
+/*****************************************************************************
+Receives a RESULT frame, unpacking it on a packed connection
+Returns the NUL terminated result, its length in *length if length is set
+*****************************************************************************/
+static char *receiveResult(int socketFD, uint64_t *length)
+{
+	uint64_t packedLength;
+	char *packed, *result;
+	size_t resultLength;
+
+	if (!packing())
+		return receiveFrameOp(socketFD, OP_RESULT, length);
+
+	packed = receiveFrameOp(socketFD, OP_RESULT, &packedLength);
+	result = malloc(packedLength * 8 / 5 + 1);
+	if (result == NULL)
+		error("CLIENT: ERROR allocating result buffer\n");
+	resultLength = cipherUnpack(result, (unsigned char *)packed, packedLength);
+	if (resultLength == (size_t)-1)
+		error("CLIENT: ERROR received a malformed packed result\n");
+	result[resultLength] = '\0';
+	if (length != NULL)
+		*length = resultLength;
+	free(packed);
+	return result;
+}
+
+/*****************************************************************************
+Creates a connection to a daemon on a localhost port, a Unix socket path or
+an abstract socket name. Ports are reached over the loopback address
+directly, without a host name lookup.
+Returns an error if there is an issue
+*****************************************************************************/
+int createSocket(const char *address)
+{
+	int socketFD;
+	struct sockaddr_storage serverAddress;
+	socklen_t addressLength;
+
+	// Set up the server address struct
+	if (parseAddress(address, INADDR_LOOPBACK, &serverAddress, &addressLength) < 0)
+		error("CLIENT: ERROR invalid daemon address\n");
+
+	// Set up the socket
+	socketFD = socket(serverAddress.ss_family, SOCK_STREAM, 0);
+	if (socketFD < 0) error("CLIENT: ERROR opening socket\n");
+
+	// Connect to server
+	if (connect(socketFD, (struct sockaddr*)&serverAddress, addressLength) < 0) // Connect socket to address
+		error("CLIENT: ERROR connecting\n");
+
+	return socketFD;
+}
+
+/*****************************************************************************
+Sends the handshake for the given client name on a new connection
+Returns the daemon's response
+*****************************************************************************/
+static char *sendHandshake(int socketFD, const char *handshake)
+{
+	sendMessage(socketFD, handshake, strlen(handshake));
+	return receiveMessage(socketFD);
+}
+
+/*****************************************************************************
+Connects to the daemon and sends clientName to confirm this is the right
+server. *version is the newest protocol version to offer; version 2 framing
+is tried first if allowed and daemons that only know the original handshake
+reject it, so the client reconnects with version 1. Packed text or binary
+mode is offered with version 2 when selected; binary mode has no version 1
+fallback.
+Returns the connected socket, or -1 if the daemon rejects the client
+*****************************************************************************/
+int connectToDaemon(const char *address, const char *clientName, int *version)
+{
+	int socketFD;
+	char handshake[64];
+	char *status;
+
+	if (*version == FRAME_VERSION)
+	{
+		snprintf(handshake, sizeof(handshake), "%s%s", clientName, versionSuffix());
+		socketFD = createSocket(address);
+		status = sendHandshake(socketFD, handshake);
+		if (!strcmp(status, versionAccept()))
+		{
+			free(status);
+			return socketFD;
+		}
+		free(status);
+		close(socketFD);
+	}
+	if (binaryMode)
+		return -1;
+
+	socketFD = createSocket(address);
+	status = sendHandshake(socketFD, clientName);
+	if (!strcmp(status, "ACCEPT"))
+	{
+		free(status);
+		*version = 1;
+		return socketFD;
+	}
+	free(status);
+	close(socketFD);
+	return -1;
+}
+
+/*****************************************************************************
+Sends a TEXT or BATCH frame and a KEY or KEYREF frame in a single write with
+ACKs turned off and reads back the result, so the request costs one round
+trip. If *socketFD is not connected yet, a new connection is opened and the
+version 2 handshake goes out in the same write. The connection is left open
+in *socketFD for further requests. When packing, the text and key are
+packed first, and only a daemon that accepts packed text is used.
+Returns the transformed text, or NULL if the daemon did not accept the mode
+*****************************************************************************/
+static char *pipelineRequest(int *socketFD, const char *address, const char *clientName, int textOp, const char *text, size_t textLength, int keyOp, const void *key, size_t keyLength)
+{
+	const char *accept = versionAccept();
+	char handshake[64];
+	char status[sizeof(ACCEPT_PACKED)];
+	int handshakeLength, statusLength;
+	unsigned char textHeader[FRAME_HEADER_SIZE], keyHeader[FRAME_HEADER_SIZE];
+	struct iovec vec[6];
+	char *packedText = NULL, *packedKey = NULL;
+	char *result = NULL;
+	int failed;
+
+	if (packing())
+	{
+		text = packedText = packPayload(textOp, text, textLength, &textLength);
+		if (keyOp == OP_KEY)
+			key = packedKey = packPayload(keyOp, key, keyLength, &keyLength);
+	}
+
+	handshakeLength = snprintf(handshake, sizeof(handshake), "%s%s", clientName, versionSuffix());
+	encodeFrameHeader(textHeader, textOp, FLAG_NOACK, textLength);
+	encodeFrameHeader(keyHeader, keyOp, FLAG_NOACK, keyLength);
+	vec[0].iov_base = &handshakeLength;
+	vec[0].iov_len = sizeof(int);
+	vec[1].iov_base = handshake;
+	vec[1].iov_len = handshakeLength;
+	vec[2].iov_base = textHeader;
+	vec[2].iov_len = FRAME_HEADER_SIZE;
+	//the text and key are sent straight from their file mappings
+	vec[3].iov_base = (char *)text;
+	vec[3].iov_len = textLength;
+	vec[4].iov_base = keyHeader;
+	vec[4].iov_len = FRAME_HEADER_SIZE;
+	vec[5].iov_base = (void *)key;
+	vec[5].iov_len = keyLength;
+
+	//an open connection has already been through the handshake
+	if (*socketFD >= 0)
+	{
+		if (sendVector(*socketFD, vec + 2, 4) < 0)
+			error("CLIENT: ERROR writing to socket\n");
+		result = receiveResult(*socketFD, NULL);
+	}
+	else
+	{
+		//a daemon that rejects the handshake may reset the connection before the
+		//request is written or its answer read, neither is fatal here
+		*socketFD = createSocket(address);
+		failed = sendVector(*socketFD, vec, 6) < 0
+			|| recvAll(*socketFD, &statusLength, sizeof(int)) < 0
+			|| statusLength != (int)strlen(accept)
+			|| recvAll(*socketFD, status, statusLength) < 0
+			|| memcmp(status, accept, statusLength);
+		if (failed)
+		{
+			close(*socketFD);
+			*socketFD = -1;
+		}
+		else
+		{
+			result = receiveResult(*socketFD, NULL);
+		}
+	}
+	free(packedText);
+	free(packedKey);
+	return result;
+}
+
+/*****************************************************************************
+Pipelined request with the key sent along, see pipelineRequest()
+*****************************************************************************/
+char *pipelineTransform(int *socketFD, const char *address, const char *clientName, const struct textFile *text, const struct textFile *key)
+{
+	return pipelineRequest(socketFD, address, clientName, OP_TEXT, text->data, text->length, OP_KEY, key->data, key->length);
+}
+
+/*****************************************************************************
+Pipelined request using part of a key in the daemon's key store
+*****************************************************************************/
+char *pipelineTransformRef(int *socketFD, const char *address, const char *clientName, const struct textFile *text, uint64_t id, uint64_t offset)
+{
+	unsigned char reference[KEYREF_SIZE];
+
+	encodeUint64(reference, id);
+	encodeUint64(reference + 8, offset);
+	return pipelineRequest(socketFD, address, clientName, OP_TEXT, text->data, text->length, OP_KEYREF, reference, KEYREF_SIZE);
+}
+
+/*****************************************************************************
+Pipelined BATCH request, see protocol.h for its layout. The key is sent
+along if key is set, otherwise the stored key id is used from offset on.
+Returns the transformed records back to back, or NULL if the daemon did not
+accept version 2
+*****************************************************************************/
+char *pipelineBatch(int *socketFD, const char *address, const char *clientName, const char *batch, size_t batchLength, const char *key, size_t keyLength, uint64_t id, uint64_t offset)
+{
+	unsigned char reference[KEYREF_SIZE];
+
+	if (key != NULL)
+		return pipelineRequest(socketFD, address, clientName, OP_BATCH, batch, batchLength, OP_KEY, key, keyLength);
+	encodeUint64(reference, id);
+	encodeUint64(reference + 8, offset);
+	return pipelineRequest(socketFD, address, clientName, OP_BATCH, batch, batchLength, OP_KEYREF, reference, KEYREF_SIZE);
+}
+
+/*****************************************************************************
+Prepares an empty segment, memory is only allocated for the first request
+*****************************************************************************/
+void initSegment(struct sharedSegment *segment)
+{
+	segment->fd = -1;
+	segment->data = NULL;
+	segment->size = 0;
+}
+
+/*****************************************************************************
+Releases a segment
+*****************************************************************************/
+void freeSegment(struct sharedSegment *segment)
+{
+	if (segment->data != NULL)
+		munmap(segment->data, segment->size);
+	if (segment->fd >= 0)
+		close(segment->fd);
+	initSegment(segment);
+}
+
+/*****************************************************************************
+Makes the segment at least size bytes. The memfd only ever grows, and is
+sealed against shrinking so the daemon can map it safely.
+*****************************************************************************/
+static void growSegment(struct sharedSegment *segment, size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	if (segment->fd < 0)
+	{
+		segment->fd = memfd_create("otp_segment", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+		if (segment->fd < 0 || fcntl(segment->fd, F_ADD_SEALS, F_SEAL_SHRINK) < 0)
+			error("CLIENT: ERROR creating shared memory\n");
+	}
+	if (segment->data != NULL)
+		munmap(segment->data, segment->size);
+
+	size = (size + page - 1) / page * page;
+	if (ftruncate(segment->fd, size) < 0)
+		error("CLIENT: ERROR sizing shared memory\n");
+	segment->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, segment->fd, 0);
+	if (segment->data == MAP_FAILED)
+		error("CLIENT: ERROR mapping shared memory\n");
+	segment->size = size;
+}
+
+/*****************************************************************************
+Transforms text with key through the shared segment on a version 2
+connection over a Unix socket. The segment is laid out as the text, a NUL
+and the key, and the daemon writes the result over the text. Whenever the
+segment grows it is passed to the daemon again, in the same write as the
+request.
+Returns the NUL terminated result, which lives in the segment until the
+next request
+*****************************************************************************/
+const char *sharedTransform(int socketFD, struct sharedSegment *segment, const struct textFile *text, const struct textFile *key)
+{
+	size_t length = text->length;
+	unsigned char mapHeader[FRAME_HEADER_SIZE], requestHeader[FRAME_HEADER_SIZE];
+	unsigned char request[SHM_REQUEST_SIZE];
+	struct iovec vec[3];
+	struct msghdr msg;
+	struct cmsghdr *control;
+	union
+	{
+		char buffer[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} controlBuffer;
+	ssize_t sent;
+	int remap = 0;
+	int index = 0;
+	int i;
+
+	if (segment->size < 2 * length + 1)
+	{
+		growSegment(segment, 2 * length + 1);
+		remap = 1;
+	}
+	memcpy(segment->data, text->data, length);
+	segment->data[length] = '\0';
+	memcpy(segment->data + length + 1, key->data, length);
+
+	//transform in place, the result replaces the text
+	encodeUint64(request, 0);
+	encodeUint64(request + 8, length + 1);
+	encodeUint64(request + 16, 0);
+	encodeUint64(request + 24, length);
+	encodeFrameHeader(mapHeader, OP_SHM_MAP, 0, 0);
+	encodeFrameHeader(requestHeader, OP_SHM_REQUEST, 0, SHM_REQUEST_SIZE);
+	if (remap)
+	{
+		vec[index].iov_base = mapHeader;
+		vec[index++].iov_len = FRAME_HEADER_SIZE;
+	}
+	vec[index].iov_base = requestHeader;
+	vec[index++].iov_len = FRAME_HEADER_SIZE;
+	vec[index].iov_base = request;
+	vec[index++].iov_len = SHM_REQUEST_SIZE;
+
+	//the descriptor travels with the first byte of the SHM_MAP frame
+	memset(&msg, '\0', sizeof(msg));
+	msg.msg_iov = vec;
+	msg.msg_iovlen = index;
+	if (remap)
+	{
+		msg.msg_control = controlBuffer.buffer;
+		msg.msg_controllen = sizeof(controlBuffer.buffer);
+		control = CMSG_FIRSTHDR(&msg);
+		control->cmsg_level = SOL_SOCKET;
+		control->cmsg_type = SCM_RIGHTS;
+		control->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(control), &segment->fd, sizeof(int));
+	}
+	do
+		sent = sendmsg(socketFD, &msg, MSG_NOSIGNAL);
+	while (sent < 0 && errno == EINTR);
+	if (sent < 0)
+		error("CLIENT: ERROR writing to socket\n");
+
+	//finish a short write, the descriptor has already gone with the first byte
+	for (i = 0; i < index && sent >= (ssize_t)vec[i].iov_len; i++)
+		sent -= vec[i].iov_len;
+	if (i < index)
+	{
+		vec[i].iov_base = (char *)vec[i].iov_base + sent;
+		vec[i].iov_len -= sent;
+		if (sendVector(socketFD, vec + i, index - i) < 0)
+			error("CLIENT: ERROR writing to socket\n");
+	}
+
+	if (remap)
+		free(receiveFrameOp(socketFD, OP_ACK, NULL));
+	free(receiveFrameOp(socketFD, OP_SHM_DONE, NULL));
+	return segment->data;
+}
+
+/*****************************************************************************
+Uploads a key to the daemon's key store over a version 2 connection
+Returns the ID later requests use to refer to it
+*****************************************************************************/
+uint64_t uploadKey(int socketFD, const struct textFile *key)
+{
+	char *reply;
+	char *packed;
+	size_t packedLength;
+	uint64_t length;
+	uint64_t id;
+
+	if (packing())
+	{
+		packed = packPayload(OP_KEY_UPLOAD, key->data, key->length, &packedLength);
+		sendFrame(socketFD, OP_KEY_UPLOAD, 0, packed, packedLength);
+		free(packed);
+	}
+	else
+	{
+		sendFrame(socketFD, OP_KEY_UPLOAD, 0, key->data, key->length);
+	}
+	reply = receiveFrameOp(socketFD, OP_KEY_ID, &length);
+	if (length != sizeof(uint64_t))
+		error("CLIENT: ERROR received a malformed key ID\n");
+	id = decodeUint64((unsigned char *)reply);
+	free(reply);
+	return id;
+}
+
+/*****************************************************************************
+Parses a key argument of the form @<hex id>[+offset], naming a key in the
+daemon's key store instead of a key file
+Returns 0 if the argument is a file name
+*****************************************************************************/
+int parseKeyRef(const char *argument, uint64_t *id, uint64_t *offset)
+{
+	char *end;
+
+	if (argument[0] != '@')
+		return 0;
+	*id = strtoull(argument + 1, &end, 16);
+	*offset = 0;
+	if (end != argument + 1 && *end == '+')
+		*offset = strtoull(end + 1, &end, 10);
+	if (end == argument + 1 || *end != '\0')
+		error("CLIENT: ERROR bad key reference\n");
+	return 1;
+}
+
+/*****************************************************************************
+Sends text and key with the negotiated framing and returns the daemon's
+transformed text. Each message is confirmed with an ACK. The key must be at
+least as long as the text.
+*****************************************************************************/
+char *requestTransform(int socketFD, int version, const struct textFile *text, const struct textFile *key)
+{
+	const char *textData = text->data, *keyData = key->data;
+	size_t textLength = text->length, keyLength = key->length;
+	char *packedText = NULL, *packedKey = NULL;
+	char *result;
+
+	if (version != FRAME_VERSION)
+	{
+		sendData(socketFD, text->data, text->length);
+		sendData(socketFD, key->data, key->length);
+		return receiveData(socketFD);
+	}
+
+	if (packing())
+	{
+		textData = packedText = packPayload(OP_TEXT, textData, textLength, &textLength);
+		keyData = packedKey = packPayload(OP_KEY, keyData, keyLength, &keyLength);
+	}
+	sendFrame(socketFD, OP_TEXT, 0, textData, textLength);
+	free(receiveFrameOp(socketFD, OP_ACK, NULL));
+	sendFrame(socketFD, OP_KEY, 0, keyData, keyLength);
+	free(receiveFrameOp(socketFD, OP_ACK, NULL));
+	result = receiveResult(socketFD, NULL);
+	sendFrame(socketFD, OP_ACK, 0, NULL, 0);
+	free(packedText);
+	free(packedKey);
+	return result;
+}
+
+/*****************************************************************************
+Checks a block of file data only holds capital letters and spaces, any byte
+goes in binary mode
+*****************************************************************************/
+static void verifyChars(const char *data, size_t length, const char *filename)
+{
+	if (!binaryMode && cipherScanText(data, length) < length)
+	{
+		fprintf(stderr, "Bad character encountered in file %s\n", filename);
+		exit(2);
+	}
+}
+
+/*****************************************************************************
+Reads up to length characters of the first line of a file, or of the whole
+file in binary mode
+Returns how many were read, and sets *done once the line has ended
+*****************************************************************************/
+static size_t readLine(FILE *input, char *buffer, size_t length, int *done)
+{
+	size_t count = fread(buffer, 1, length, input);
+	char *newline = binaryMode ? NULL : memchr(buffer, '\n', count);
+
+	if (newline != NULL)
+		count = newline - buffer;
+	if (count < length)
+		*done = 1;
+	return count;
+}
+
+/*****************************************************************************
+Streams textFile and keyFile to the daemon in CHUNK frames and writes each
+transformed chunk to stdout as it comes back, so memory use stays at one
+chunk no matter how large the files are. Requires version 2 framing.
+*****************************************************************************/
+void streamTransform(int socketFD, char *textFile, char *keyFile)
+{
+	char *chunk = malloc(2 * STREAMCHUNK);
+	char *result;
+	size_t textCount, keyCount, chunkLength;
+	uint64_t length;
+	int textDone = 0, keyDone = 0;
+	FILE *text = fopen(textFile, "r");
+	FILE *key = fopen(keyFile, "r");
+
+	if (chunk == NULL)
+		error("CLIENT: ERROR allocating stream buffer\n");
+	if (text == NULL || key == NULL)
+		error("CLIENT: ERROR opening input file\n");
+
+	while (!textDone)
+	{
+		//the chunk carries the text followed by the same number of key characters
+		textCount = readLine(text, chunk, STREAMCHUNK, &textDone);
+		verifyChars(chunk, textCount, textFile);
+		keyCount = keyDone ? 0 : readLine(key, chunk + textCount, textCount, &keyDone);
+		verifyChars(chunk + textCount, keyCount, keyFile);
+		if (keyCount < textCount)
+			error("Key is too short for selected text\n");
+		if (textCount == 0)
+			break;
+
+		//a packed chunk is packed in place, text and key together
+		chunkLength = 2 * textCount;
+		if (packing())
+			chunkLength = cipherPack((unsigned char *)chunk, chunk, chunkLength);
+		sendFrame(socketFD, OP_CHUNK, 0, chunk, chunkLength);
+		result = receiveResult(socketFD, &length);
+		fwrite(result, 1, length, stdout);
+		free(result);
+	}
+
+	sendFrame(socketFD, OP_END, 0, NULL, 0);
+	free(receiveFrameOp(socketFD, OP_END, NULL));
+	if (!binaryMode)
+		printf("\n");
+
+	fclose(text);
+	fclose(key);
+	free(chunk);
+}
+
+/*****************************************************************************
+Reads all of a file that cannot be mapped, such as a pipe, into memory
+*****************************************************************************/
+static void readTextFile(struct textFile *file, int fd, const char *filename)
+{
+	size_t size = 1 << 16;
+	ssize_t count;
+	char *data = malloc(size);
+
+	file->length = 0;
+	while (data != NULL)
+	{
+		if (file->length == size)
+			data = realloc(data, size *= 2);
+		if (data == NULL)
+			break;
+		count = read(fd, data + file->length, size - file->length);
+		if (count < 0 && errno == EINTR)
+			continue;
+		if (count < 0)
+		{
+			fprintf(stderr, "CLIENT: ERROR reading file %s\n", filename);
+			exit(2);
+		}
+		if (count == 0)
+			break;
+		file->length += count;
+	}
+	if (data == NULL)
+		error("CLIENT: ERROR allocating file buffer\n");
+	file->data = data;
+}
+
+/*****************************************************************************
+Maps a whole file, or reads it if it cannot be mapped
+*****************************************************************************/
+static void loadFile(struct textFile *file, const char *filename)
+{
+	struct stat info;
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0)
+	{
+		fprintf(stderr, "CLIENT: ERROR opening file %s\n", filename);
+		exit(2);
+	}
+
+	file->map = NULL;
+	file->mapLength = 0;
+	if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0)
+	{
+		file->map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (file->map == MAP_FAILED)
+			file->map = NULL;
+	}
+	if (file->map != NULL)
+	{
+		madvise(file->map, info.st_size, MADV_SEQUENTIAL);
+		file->mapLength = info.st_size;
+		file->data = file->map;
+		file->length = info.st_size;
+	}
+	else
+	{
+		readTextFile(file, fd, filename);
+	}
+	close(fd);
+}
+
+/*****************************************************************************
+Maps a text or key file and finds the end of its first line, checking in
+the same vectorized pass that it only holds capital letters and spaces. In
+binary mode the whole file is used as it is.
+*****************************************************************************/
+void openTextFile(struct textFile *file, const char *filename)
+{
+	size_t end;
+
+	loadFile(file, filename);
+	if (binaryMode)
+		return;
+
+	//only the first line is used, anything else before it is a bad character
+	end = cipherScanText(file->data, file->length);
+	if (end < file->length && file->data[end] != '\n')
+	{
+		fprintf(stderr, "Bad character encountered in file %s\n", filename);
+		exit(2);
+	}
+	file->length = end;
+}
+
+/*****************************************************************************
+Releases a file opened with openTextFile()
+*****************************************************************************/
+void closeTextFile(struct textFile *file)
+{
+	if (file->map != NULL)
+		munmap(file->map, file->mapLength);
+	else
+		free((char *)file->data);
+}
+
+/*****************************************************************************
+Writes a transformed text through the stdout buffer, followed by a newline
+unless it is binary
+*****************************************************************************/
+static void writeResult(const char *result, size_t length)
+{
+	fwrite(result, 1, length, stdout);
+	if (!binaryMode)
+		putchar('\n');
+}
+
+/*****************************************************************************
+Reports that the daemon could not be reached or rejected this client
+*****************************************************************************/
+static void connectFailed(const char *clientName, const char *address)
+{
+	if (strspn(address, "0123456789") == strlen(address))
+		fprintf(stderr, "CLIENT: ERROR: Can't connect to %s_D on localhost port %s.\n", clientName, address);
+	else
+		fprintf(stderr, "CLIENT: ERROR: Can't connect to %s_D on %s.\n", clientName, address);
+	exit(2);
+}
+
+/*****************************************************************************
+Writes the whole buffer to fd at the given file offset
+*****************************************************************************/
+static void writeAllAt(int fd, const char *buffer, size_t length, off_t offset)
+{
+	ssize_t written;
+
+	while (length > 0)
+	{
+		written = pwrite(fd, buffer, length, offset);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written < 0)
+			error("CLIENT: ERROR writing output\n");
+		buffer += written;
+		offset += written;
+		length -= written;
+	}
+}
+
+/*****************************************************************************
+Connection thread of a striped transform, claims ranges until none are left.
+Daemons that only speak version 1 get a new connection for every range.
+*****************************************************************************/
+static void *stripeMain(void *arg)
+{
+	struct stripeJob *job = arg;
+	const char *address = job->addresses[__atomic_fetch_add(&job->nextAddress, 1, __ATOMIC_RELAXED) % job->addressCount];
+	struct textFile text, key;
+	int socketFD = -1;
+	int version = FRAME_VERSION;
+	size_t range, offset;
+	char *result;
+
+	memset(&text, '\0', sizeof(text));
+	memset(&key, '\0', sizeof(key));
+	while ((range = __atomic_fetch_add(&job->nextRange, 1, __ATOMIC_RELAXED)) < job->rangeCount)
+	{
+		offset = range * job->stripe;
+		text.data = job->text->data + offset;
+		text.length = job->text->length - offset < job->stripe ? job->text->length - offset : job->stripe;
+
+		result = NULL;
+		if (job->key == NULL)
+		{
+			result = pipelineTransformRef(&socketFD, address, job->clientName, &text, job->keyID, job->keyOffset + offset);
+			if (result == NULL)
+				connectFailed(job->clientName, address);
+		}
+		else
+		{
+			key.data = job->key->data + offset;
+			key.length = text.length;
+			if (version == FRAME_VERSION)
+				result = pipelineTransform(&socketFD, address, job->clientName, &text, &key);
+			if (result == NULL)
+			{
+				version = 1;
+				socketFD = connectToDaemon(address, job->clientName, &version);
+				if (socketFD < 0)
+					connectFailed(job->clientName, address);
+				result = requestTransform(socketFD, version, &text, &key);
+				close(socketFD);
+				socketFD = -1;
+			}
+		}
+
+		if (job->output >= 0)
+		{
+			writeAllAt(job->output, result, text.length, job->base + offset);
+			free(result);
+		}
+		else
+		{
+			job->results[range] = result;
+		}
+	}
+
+	if (socketFD >= 0)
+		close(socketFD);
+	return NULL;
+}
+
+/*****************************************************************************
+Transforms text over up to connections parallel connections spread across
+the given daemon addresses, and prints the result and its newline. key is
+NULL to use the stored key keyID from keyOffset on. When stdout is a
+regular file every range is written straight to its place in it.
+*****************************************************************************/
+static void stripeTransform(const char *clientName, char **addresses, int addressCount, int connections, const struct textFile *text, const struct textFile *key, uint64_t keyID, uint64_t keyOffset)
+{
+	struct stripeJob job;
+	struct stat info;
+	pthread_t *threads;
+	int flags;
+	size_t i;
+
+	job.clientName = clientName;
+	job.addresses = addresses;
+	job.addressCount = addressCount;
+	job.nextAddress = 0;
+	job.text = text;
+	job.key = key;
+	job.keyID = keyID;
+	job.keyOffset = keyOffset;
+	job.stripe = (text->length + connections - 1) / connections;
+	if (job.stripe > STRIPEMAX)
+		job.stripe = STRIPEMAX;
+	if (job.stripe == 0)
+		job.stripe = 1;
+	job.rangeCount = (text->length + job.stripe - 1) / job.stripe;
+	job.nextRange = 0;
+	if ((size_t)connections > job.rangeCount)
+		connections = job.rangeCount;
+
+	//pwrite() ignores the offset on files opened for appending
+	fflush(stdout);
+	job.output = -1;
+	job.results = NULL;
+	flags = fcntl(STDOUT_FILENO, F_GETFL);
+	if (fstat(STDOUT_FILENO, &info) == 0 && S_ISREG(info.st_mode) && flags >= 0 && !(flags & O_APPEND)
+		&& (job.base = lseek(STDOUT_FILENO, 0, SEEK_CUR)) >= 0)
+	{
+		job.output = STDOUT_FILENO;
+		if (ftruncate(STDOUT_FILENO, job.base + text->length + !binaryMode) < 0)
+			error("CLIENT: ERROR sizing output file\n");
+	}
+	else
+	{
+		job.results = calloc(job.rangeCount + 1, sizeof(char *));
+		if (job.results == NULL)
+			error("CLIENT: ERROR allocating result buffer\n");
+	}
+
+	threads = malloc(sizeof(pthread_t) * (connections + 1));
+	if (threads == NULL)
+		error("CLIENT: ERROR allocating threads\n");
+	for (i = 0; i < (size_t)connections; i++)
+	{
+		if (pthread_create(&threads[i], NULL, stripeMain, &job))
+			error("CLIENT: ERROR creating connection thread\n");
+	}
+	for (i = 0; i < (size_t)connections; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	//leave the offset after the newline, as if the result had been written in order
+	if (job.output >= 0)
+	{
+		if (!binaryMode)
+			writeAllAt(STDOUT_FILENO, "\n", 1, job.base + text->length);
+		lseek(STDOUT_FILENO, job.base + text->length + !binaryMode, SEEK_SET);
+		return;
+	}
+	for (i = 0; i < job.rangeCount; i++)
+	{
+		fwrite(job.results[i], 1, i + 1 < job.rangeCount ? job.stripe : text->length - i * job.stripe, stdout);
+		free(job.results[i]);
+	}
+	if (!binaryMode)
+		putchar('\n');
+	free(job.results);
+}
+
+/*****************************************************************************
+Transforms every line of recordFile as a separate record and prints the
+results one per line. Records use consecutive parts of the key, and are
+sent BATCHRECORDS at a time, each batch with just the part of the key its
+records use. Requires version 2 framing.
+*****************************************************************************/
+static void batchTransform(int *socketFD, const char *address, const char *clientName, const char *textName, const char *recordFile, const char *keyArgument)
+{
+	struct textFile records, key;
+	const char *first, *next, *end, *newline;
+	size_t *lengths = malloc(BATCHRECORDS * sizeof(size_t));
+	char *batch = NULL;
+	size_t batchSize = 0;
+	size_t count, bytes, needed, done, i;
+	uint64_t id = 0, keyOffset = 0;
+	int keyRef = parseKeyRef(keyArgument, &id, &keyOffset);
+	char *entry, *result;
+
+	if (lengths == NULL)
+		error("CLIENT: ERROR allocating batch buffer\n");
+	loadFile(&records, recordFile);
+	if (!keyRef)
+		openTextFile(&key, keyArgument);
+
+	next = records.data;
+	end = records.data + records.length;
+	while (next < end)
+	{
+		//collect the next records, a missing final newline ends the last one
+		first = next;
+		for (count = 0, bytes = 0; count < BATCHRECORDS && next < end; count++)
+		{
+			newline = memchr(next, '\n', end - next);
+			lengths[count] = (newline != NULL ? newline : end) - next;
+			verifyChars(next, lengths[count], recordFile);
+			bytes += lengths[count];
+			next += lengths[count] + 1;
+		}
+		if (!keyRef && bytes > key.length - keyOffset)
+		{
+			fprintf(stderr, "Key is too short for selected %s", textName);
+			exit(2);
+		}
+
+		needed = BATCH_COUNT_SIZE + count * BATCH_ENTRY_SIZE + bytes;
+		if (needed > batchSize)
+		{
+			batch = realloc(batch, needed);
+			if (batch == NULL)
+				error("CLIENT: ERROR allocating batch buffer\n");
+			batchSize = needed;
+		}
+		//each record's key offset counts from the start of this batch's part of the key
+		encodeUint64((unsigned char *)batch, count);
+		entry = batch + BATCH_COUNT_SIZE;
+		for (i = 0, done = 0; i < count; i++, entry += BATCH_ENTRY_SIZE)
+		{
+			encodeUint64((unsigned char *)entry, done);
+			encodeUint64((unsigned char *)entry + 8, lengths[i]);
+			memcpy(batch + BATCH_COUNT_SIZE + count * BATCH_ENTRY_SIZE + done, first, lengths[i]);
+			done += lengths[i];
+			first += lengths[i] + 1;
+		}
+
+		result = pipelineBatch(socketFD, address, clientName, batch, needed,
+			keyRef ? NULL : key.data + keyOffset, bytes, id, keyOffset);
+		if (result == NULL)
+			connectFailed(clientName, address);
+		keyOffset += bytes;
+
+		for (i = 0, done = 0; i < count; i++)
+		{
+			fwrite(result + done, 1, lengths[i], stdout);
+			putchar('\n');
+			done += lengths[i];
+		}
+		free(result);
+	}
+
+	if (!keyRef)
+		closeTextFile(&key);
+	closeTextFile(&records);
+	free(batch);
+	free(lengths);
+}
+
+/*****************************************************************************
+Runs a client presenting clientName. Each text and key pair on the command
+line is a separate request whose result is printed on its own line; version
+2 daemons serve them all on one connection. With -u the arguments are key
+files to upload instead, and their IDs are printed. With -b the text is a
+file of records, one per line, sent to the daemon in batches. With -j, or
+several comma separated daemon addresses, each file is striped over that
+many connections. With -z text is packed on the wire, with -x the files are
+binary and XORed with their keys.
+*****************************************************************************/
+int runClient(int argc, char *argv[], const char *clientName, const char *textName)
+{
+	int socketFD = -1;
+	const char *address;
+	int version = FRAME_VERSION;
+	int stream = 0;
+	int upload = 0;
+	int batch = 0;
+	int connections = 0;
+	char *addresses[MAXADDRESSES];
+	int addressCount;
+	char *next;
+	int option;
+	int i;
+	uint64_t id, offset;
+	struct textFile text, key;
+	struct sharedSegment segment;
+	struct sockaddr_storage daemonAddress;
+	socklen_t addressLength;
+	int local;
+	char *result;
+
+	//check usage & args, -s streams the files in chunks instead of reading them whole
+	while ((option = getopt(argc, argv, "subzxj:")) != -1)
+	{
+		if (option == 's')
+			stream = 1;
+		else if (option == 'z')
+			packedWire = 1;
+		else if (option == 'x')
+			binaryMode = 1;
+		else if (option == 'j')
+			connections = atoi(optarg);
+		else if (option == 'u')
+			upload = 1;
+		else if (option == 'b')
+			batch = 1;
+		else
+			optind = argc;
+	}
+	if ((packedWire && binaryMode) || (upload ? argc - optind < 2 : batch ? argc - optind != 3 : argc - optind < 3 || (argc - optind) % 2 == 0 || connections < 0))
+	{
+		fprintf(stderr, "USAGE: %s [-s] [-z | -x] [-j connections] %s key [%s key ...] address[,address ...]\n", argv[0], textName, textName);
+		fprintf(stderr, "       %s [-z | -x] -b records key address\n", argv[0]);
+		fprintf(stderr, "       %s [-z | -x] -u key [key ...] address\n", argv[0]);
+		exit(0);
+	}
+	setvbuf(stdout, NULL, _IOFBF, OUTPUTBUFFER);
+
+	//several daemons can share a striped file, everything else goes to the first
+	addressCount = 0;
+	for (next = strtok(argv[argc - 1], ","); next != NULL && addressCount < MAXADDRESSES; next = strtok(NULL, ","))
+		addresses[addressCount++] = next;
+	if (addressCount == 0)
+		connectFailed(clientName, argv[argc - 1]);
+	address = addresses[0];
+	if (connections == 0)
+		connections = addressCount;
+
+	//a daemon on a Unix socket can share memory with the client
+	local = parseAddress(address, INADDR_LOOPBACK, &daemonAddress, &addressLength) == 0 && daemonAddress.ss_family == AF_UNIX;
+	initSegment(&segment);
+
+	//store each key on the daemon and print its ID
+	if (upload)
+	{
+		socketFD = connectToDaemon(address, clientName, &version);
+		if (socketFD < 0 || version != FRAME_VERSION)
+			connectFailed(clientName, address);
+		for (i = optind; i < argc - 1; i++)
+		{
+			openTextFile(&key, argv[i]);
+			printf("%016llx\n", (unsigned long long)uploadKey(socketFD, &key));
+			closeTextFile(&key);
+		}
+		close(socketFD);
+		return 0;
+	}
+
+	//transform each line of the file as its own record
+	if (batch)
+	{
+		batchTransform(&socketFD, address, clientName, textName, argv[optind], argv[optind + 1]);
+		if (socketFD >= 0)
+			close(socketFD);
+		return 0;
+	}
+
+	for (i = optind; i < argc - 1; i += 2)
+	{
+		//a stored key only needs its ID and offset sent, the daemon checks its length
+		if (parseKeyRef(argv[i + 1], &id, &offset))
+		{
+			openTextFile(&text, argv[i]);
+			if (connections > 1 && !stream)
+			{
+				stripeTransform(clientName, addresses, addressCount, connections, &text, NULL, id, offset);
+				closeTextFile(&text);
+				continue;
+			}
+			result = version == FRAME_VERSION ? pipelineTransformRef(&socketFD, address, clientName, &text, id, offset) : NULL;
+			if (result == NULL)
+				connectFailed(clientName, address);
+			writeResult(result, text.length);
+			closeTextFile(&text);
+			free(result);
+			continue;
+		}
+
+		//stream the files through the daemon if it speaks version 2
+		if (stream && version == FRAME_VERSION)
+		{
+			if (socketFD < 0)
+				socketFD = connectToDaemon(address, clientName, &version);
+			if (socketFD >= 0 && version == FRAME_VERSION)
+			{
+				streamTransform(socketFD, argv[i], argv[i + 1]);
+				continue;
+			}
+		}
+
+		//map the files
+		openTextFile(&text, argv[i]);
+		openTextFile(&key, argv[i + 1]);
+		if (text.length > key.length)
+		{
+			fprintf(stderr, "Key is too short for selected %s", textName);
+			exit(2);
+		}
+		//only the part of the key the text uses is sent, so a long key file
+		//does not count against the daemon's message size limit
+		key.length = text.length;
+
+		//split the file over several connections, each sending its own range
+		if (connections > 1 && !stream)
+		{
+			stripeTransform(clientName, addresses, addressCount, connections, &text, &key, 0, 0);
+			closeTextFile(&text);
+			closeTextFile(&key);
+			continue;
+		}
+
+		//a local daemon transforms the files in shared memory, without copying them through the socket
+		if (local && !stream && version == FRAME_VERSION)
+		{
+			if (socketFD < 0)
+				socketFD = connectToDaemon(address, clientName, &version);
+			if (socketFD >= 0 && version == FRAME_VERSION)
+			{
+				writeResult(sharedTransform(socketFD, &segment, &text, &key), text.length);
+				closeTextFile(&text);
+				closeTextFile(&key);
+				continue;
+			}
+		}
+
+		//send text and key at once, receive the transformed text
+		result = NULL;
+		if (!stream && version == FRAME_VERSION)
+			result = pipelineTransform(&socketFD, address, clientName, &text, &key);
+		if (result == NULL)
+		{
+			//the daemon only speaks version 1, send one message at a time over a new connection
+			if (socketFD < 0)
+			{
+				version = 1;
+				socketFD = connectToDaemon(address, clientName, &version);
+			}
+			if (socketFD < 0)
+				connectFailed(clientName, address);
+			result = requestTransform(socketFD, version, &text, &key);
+			close(socketFD);
+			socketFD = -1;
+		}
+		writeResult(result, text.length);
+
+		//free resources
+		closeTextFile(&text);
+		closeTextFile(&key);
+		free(result);
+	}
+
+	if (socketFD >= 0)
+		close(socketFD);
+	freeSegment(&segment);
+	return 0;
+}
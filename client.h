@@ -0,0 +1,60 @@
+/*****************************************************************************
+client.h
+
+Description: Connection and request logic shared by encrypt_client and
+decrypt_client. The clients only differ in the name they present to the
+daemon during the handshake.
+*****************************************************************************/
+
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*****************************************************************************
+First line of a text or key file, mapped or read into memory
+*****************************************************************************/
+struct textFile
+{
+	const char *data;
+	size_t length;
+	void *map;
+	size_t mapLength;
+};
+
+/*****************************************************************************
+Shared memory segment handed to a daemon on a Unix socket. It holds one
+request at a time and grows when a larger one comes along.
+*****************************************************************************/
+struct sharedSegment
+{
+	int fd;
+	char *data;
+	size_t size;
+};
+
+//set to offer packed text to version 2 daemons, see protocol.h
+extern int packedWire;
+
+//set to send files as arbitrary bytes transformed by XOR, which overrides
+//packedWire and requires a version 2 daemon
+extern int binaryMode;
+
+int createSocket(const char *address);
+void openTextFile(struct textFile *file, const char *filename);
+void closeTextFile(struct textFile *file);
+int connectToDaemon(const char *address, const char *clientName, int *version);
+char *requestTransform(int socketFD, int version, const struct textFile *text, const struct textFile *key);
+char *pipelineTransform(int *socketFD, const char *address, const char *clientName, const struct textFile *text, const struct textFile *key);
+char *pipelineTransformRef(int *socketFD, const char *address, const char *clientName, const struct textFile *text, uint64_t id, uint64_t offset);
+char *pipelineBatch(int *socketFD, const char *address, const char *clientName, const char *batch, size_t batchLength, const char *key, size_t keyLength, uint64_t id, uint64_t offset);
+uint64_t uploadKey(int socketFD, const struct textFile *key);
+void initSegment(struct sharedSegment *segment);
+void freeSegment(struct sharedSegment *segment);
+const char *sharedTransform(int socketFD, struct sharedSegment *segment, const struct textFile *text, const struct textFile *key);
+int parseKeyRef(const char *argument, uint64_t *id, uint64_t *offset);
+int runClient(int argc, char *argv[], const char *clientName, const char *textName);
+void streamTransform(int socketFD, char *textFile, char *keyFile);
+
+#endif
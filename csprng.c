@@ -0,0 +1,226 @@
+/*****************************************************************************
+csprng.c
+
+Description: ChaCha20 in its original form, with a 64 bit block counter and
+a 64 bit nonce that selects the stream. Key characters are drawn from the
+output with rejection sampling: bytes below 243, the largest multiple of 27
+that fits in a byte, map evenly onto the alphabet and the rest are skipped,
+so every character is equally likely.
+Eight consecutive blocks are computed together, one per vector lane; like
+the cipher, an AVX2 build of that routine is picked at startup if the CPU
+supports it.
+*****************************************************************************/
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <sys/random.h>
+
+#include "csprng.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CSPRNG_X86
+#endif
+
+#define ROUNDS 20
+#define LANES (CSPRNG_BUFFER_SIZE / CSPRNG_BLOCK_SIZE)
+
+#define ALPHABET "ABCDEFGHIJKLMNOPQRSTUVWXYZ "
+
+//accepted bytes map to their character, the 13 rejected ones to 0
+static const char byteToChar[256] = ALPHABET ALPHABET ALPHABET ALPHABET ALPHABET ALPHABET ALPHABET ALPHABET ALPHABET;
+
+#define ROTATE(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define QUARTERROUND(a, b, c, d) \
+	for (l = 0; l < LANES; l++) \
+	{ \
+		x[a][l] += x[b][l]; x[d][l] ^= x[a][l]; x[d][l] = ROTATE(x[d][l], 16); \
+		x[c][l] += x[d][l]; x[b][l] ^= x[c][l]; x[b][l] = ROTATE(x[b][l], 12); \
+		x[a][l] += x[b][l]; x[d][l] ^= x[a][l]; x[d][l] = ROTATE(x[d][l], 8); \
+		x[c][l] += x[d][l]; x[b][l] ^= x[c][l]; x[b][l] = ROTATE(x[b][l], 7); \
+	}
+
+typedef void (*blockKernel)(uint32_t *state, unsigned char *out);
+
+/*****************************************************************************
+Fills seed with CSPRNG_SEED_SIZE bytes from the kernel
+Returns -1 on error
+*****************************************************************************/
+int csprngSeed(unsigned char *seed)
+{
+	size_t filled = 0;
+	ssize_t count;
+
+	while (filled < CSPRNG_SEED_SIZE)
+	{
+		count = getrandom(seed + filled, CSPRNG_SEED_SIZE - filled, 0);
+		if (count < 0 && errno == EINTR)
+			continue;
+		if (count < 0)
+			return -1;
+		filled += count;
+	}
+	return 0;
+}
+
+/*****************************************************************************
+Sets up a generator from a 32 byte seed. Generators with the same seed and
+different stream numbers produce independent output.
+*****************************************************************************/
+void csprngInit(struct csprng *rng, const unsigned char *seed, uint64_t stream)
+{
+	int i;
+
+	//"expand 32-byte k"
+	rng->state[0] = 0x61707865;
+	rng->state[1] = 0x3320646e;
+	rng->state[2] = 0x79622d32;
+	rng->state[3] = 0x6b206574;
+	for (i = 0; i < 8; i++)
+		rng->state[4 + i] = (uint32_t)seed[4 * i] | (uint32_t)seed[4 * i + 1] << 8 | (uint32_t)seed[4 * i + 2] << 16 | (uint32_t)seed[4 * i + 3] << 24;
+	rng->state[12] = 0;
+	rng->state[13] = 0;
+	rng->state[14] = (uint32_t)stream;
+	rng->state[15] = (uint32_t)(stream >> 32);
+	rng->used = CSPRNG_BUFFER_SIZE;
+}
+
+/*****************************************************************************
+Computes the next LANES blocks and advances the counter past them. Each
+round works on the same word of every block at once, which the compiler
+turns into vector instructions.
+*****************************************************************************/
+static inline __attribute__((always_inline)) void chachaBlocks(uint32_t *state, unsigned char *out)
+{
+	uint32_t x[16][LANES];
+	uint32_t input[16][LANES];
+	uint64_t counter = (uint64_t)state[13] << 32 | state[12];
+	int i, l;
+
+	for (i = 0; i < 16; i++)
+	{
+		for (l = 0; l < LANES; l++)
+			input[i][l] = state[i];
+	}
+	for (l = 0; l < LANES; l++)
+	{
+		input[12][l] = (uint32_t)(counter + l);
+		input[13][l] = (uint32_t)((counter + l) >> 32);
+	}
+	memcpy(x, input, sizeof(x));
+
+	for (i = 0; i < ROUNDS; i += 2)
+	{
+		QUARTERROUND(0, 4, 8, 12);
+		QUARTERROUND(1, 5, 9, 13);
+		QUARTERROUND(2, 6, 10, 14);
+		QUARTERROUND(3, 7, 11, 15);
+		QUARTERROUND(0, 5, 10, 15);
+		QUARTERROUND(1, 6, 11, 12);
+		QUARTERROUND(2, 7, 8, 13);
+		QUARTERROUND(3, 4, 9, 14);
+	}
+
+	//serialize each block little endian, one after another
+	for (l = 0; l < LANES; l++)
+	{
+		for (i = 0; i < 16; i++)
+		{
+			uint32_t word = x[i][l] + input[i][l];
+			out[CSPRNG_BLOCK_SIZE * l + 4 * i] = word;
+			out[CSPRNG_BLOCK_SIZE * l + 4 * i + 1] = word >> 8;
+			out[CSPRNG_BLOCK_SIZE * l + 4 * i + 2] = word >> 16;
+			out[CSPRNG_BLOCK_SIZE * l + 4 * i + 3] = word >> 24;
+		}
+	}
+
+	counter += LANES;
+	state[12] = (uint32_t)counter;
+	state[13] = (uint32_t)(counter >> 32);
+}
+
+static void chachaBlocksGeneric(uint32_t *state, unsigned char *out)
+{
+	chachaBlocks(state, out);
+}
+
+static blockKernel selectedBlocks = chachaBlocksGeneric;
+
+#ifdef CSPRNG_X86
+__attribute__((target("avx2"))) static void chachaBlocksAVX2(uint32_t *state, unsigned char *out)
+{
+	chachaBlocks(state, out);
+}
+
+/*****************************************************************************
+Uses the AVX2 build when the CPU supports it
+*****************************************************************************/
+__attribute__((constructor)) static void csprngSelectKernel()
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		selectedBlocks = chachaBlocksAVX2;
+}
+#endif
+
+/*****************************************************************************
+Writes length random bytes to out
+*****************************************************************************/
+void csprngBytes(struct csprng *rng, unsigned char *out, size_t length)
+{
+	size_t count;
+
+	while (length > 0)
+	{
+		//whole batches of blocks go straight to the caller's buffer
+		if (rng->used == CSPRNG_BUFFER_SIZE && length >= CSPRNG_BUFFER_SIZE)
+		{
+			selectedBlocks(rng->state, out);
+			out += CSPRNG_BUFFER_SIZE;
+			length -= CSPRNG_BUFFER_SIZE;
+			continue;
+		}
+		if (rng->used == CSPRNG_BUFFER_SIZE)
+		{
+			selectedBlocks(rng->state, rng->buffer);
+			rng->used = 0;
+		}
+		count = CSPRNG_BUFFER_SIZE - rng->used;
+		if (count > length)
+			count = length;
+		memcpy(out, rng->buffer + rng->used, count);
+		rng->used += count;
+		out += count;
+		length -= count;
+	}
+}
+
+/*****************************************************************************
+Writes length uniformly distributed capital letters and spaces to out
+*****************************************************************************/
+void csprngKeyChars(struct csprng *rng, char *out, size_t length)
+{
+	unsigned char random[CSPRNG_BUFFER_SIZE * 8];
+	size_t filled = 0;
+	size_t count;
+	size_t i;
+	char c;
+
+	while (filled < length)
+	{
+		//never draw more bytes than characters still needed, so every
+		//accepted byte fits and the loop needs no bounds check; about 95%
+		//are accepted, leaving a short tail for the next pass
+		count = length - filled;
+		if (count > sizeof(random))
+			count = sizeof(random);
+		csprngBytes(rng, random, count);
+
+		for (i = 0; i < count; i++)
+		{
+			c = byteToChar[random[i]];
+			out[filled] = c;
+			filled += c != 0;
+		}
+	}
+}
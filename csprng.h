@@ -0,0 +1,31 @@
+/*****************************************************************************
+csprng.h
+
+Description: ChaCha20 based cryptographically secure random generator, used
+to produce key material. Each generator is seeded from the kernel with
+getrandom() and may be split into independent streams sharing one seed.
+*****************************************************************************/
+
+#ifndef CSPRNG_H
+#define CSPRNG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CSPRNG_SEED_SIZE 32
+#define CSPRNG_BLOCK_SIZE 64
+#define CSPRNG_BUFFER_SIZE (8 * CSPRNG_BLOCK_SIZE)
+
+struct csprng
+{
+	uint32_t state[16];
+	unsigned char buffer[CSPRNG_BUFFER_SIZE];
+	size_t used;
+};
+
+int csprngSeed(unsigned char *seed);
+void csprngInit(struct csprng *rng, const unsigned char *seed, uint64_t stream);
+void csprngBytes(struct csprng *rng, unsigned char *out, size_t length);
+void csprngKeyChars(struct csprng *rng, char *out, size_t length);
+
+#endif
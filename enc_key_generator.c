@@ -4,45 +4,263 @@ Author: Daniel Meirovitch
 Date: May 22 2019
 
 Description: Generates a keyfile with a command-line specified length.
-Key file is printed to stdout and only only uses Capital Letters + Space
+Key file is printed to stdout and only only uses Capital Letters + Space.
+Characters come from a ChaCha20 generator seeded with getrandom(), so every
+run produces a different, unbiased key; output is generated and written in
+large batches.
+When stdout is a regular file the key is split into shards that worker
+threads generate in parallel, each from its own generator stream, and write
+straight to their place in the file with pwrite(). Memory use stays at one
+batch per thread however long the key is.
+With -b the key is keylength raw random bytes without a newline, for the
+clients' binary mode.
 
 Intended Usage:
-keygen <keylength>
+keygen [-b] [-j threads] <keylength>
 *****************************************************************************/
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "csprng.h"
+
+#define KEYBATCH (1 << 20)
+#define KEYSHARD (64ULL << 20)
+
+/*****************************************************************************
+Work shared by the generator threads. Shards are handed out in order from
+nextShard; shard n is generated from stream n of the generator.
+*****************************************************************************/
+struct keyJob
+{
+	unsigned char seed[CSPRNG_SEED_SIZE];
+	unsigned long long keyLength;
+	int raw;
+	off_t base;
+	unsigned long long shardCount;
+	unsigned long long nextShard;
+};
+
+/*****************************************************************************
+Writes the whole buffer to stdout, exits if the output goes away
+*****************************************************************************/
+static void writeAll(const char *buffer, size_t length)
+{
+	ssize_t written;
+
+	while (length > 0)
+	{
+		written = write(STDOUT_FILENO, buffer, length);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written < 0)
+		{
+			perror("Error writing key");
+			exit(1);
+		}
+		buffer += written;
+		length -= written;
+	}
+}
+
+/*****************************************************************************
+Writes the whole buffer to stdout at the given file offset
+*****************************************************************************/
+static void writeAllAt(const char *buffer, size_t length, off_t offset)
+{
+	ssize_t written;
+
+	while (length > 0)
+	{
+		written = pwrite(STDOUT_FILENO, buffer, length, offset);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written < 0)
+		{
+			perror("Error writing key");
+			exit(1);
+		}
+		buffer += written;
+		offset += written;
+		length -= written;
+	}
+}
+
+/*****************************************************************************
+Generator thread, claims shards until none are left
+*****************************************************************************/
+static void *generateShards(void *arg)
+{
+	struct keyJob *job = arg;
+	struct csprng rng;
+	unsigned long long shard;
+	unsigned long long position;
+	unsigned long long end;
+	size_t count;
+
+	char* batch = (char*) malloc(KEYBATCH);
+	if(batch == NULL)
+	{
+		perror("Error allocating key buffer");
+		exit(1);
+	}
+
+	while((shard = __atomic_fetch_add(&job->nextShard, 1, __ATOMIC_RELAXED)) < job->shardCount)
+	{
+		csprngInit(&rng, job->seed, shard);
+		position = shard * KEYSHARD;
+		end = position + KEYSHARD < job->keyLength ? position + KEYSHARD : job->keyLength;
+		for(; position < end; position += count)
+		{
+			count = end - position < KEYBATCH ? end - position : KEYBATCH;
+			if(job->raw)
+				csprngBytes(&rng, (unsigned char*) batch, count);
+			else
+				csprngKeyChars(&rng, batch, count);
+			writeAllAt(batch, count, job->base + position);
+		}
+	}
+
+	memset(&rng, '\0', sizeof(rng));
+	free(batch);
+	return NULL;
+}
+
+/*****************************************************************************
+Generates the key with several threads writing disjoint parts of stdout.
+The file is sized up front, then the offset is left after the newline as if
+the key had been written sequentially.
+*****************************************************************************/
+static void generateParallel(struct keyJob *job, int threads)
+{
+	pthread_t *workers = malloc(sizeof(pthread_t) * threads);
+	unsigned long long fileLength = job->keyLength + !job->raw;
+	int i;
+
+	if(workers == NULL)
+	{
+		perror("Error allocating threads");
+		exit(1);
+	}
+	if(ftruncate(STDOUT_FILENO, job->base + fileLength) < 0)
+	{
+		perror("Error sizing key file");
+		exit(1);
+	}
+	//reserve the blocks where the filesystem allows it, a sparse file works too
+	fallocate(STDOUT_FILENO, 0, job->base, fileLength);
+
+	job->shardCount = (job->keyLength + KEYSHARD - 1) / KEYSHARD;
+	job->nextShard = 0;
+	for(i = 0; i < threads; i++)
+	{
+		if(pthread_create(&workers[i], NULL, generateShards, job))
+		{
+			fprintf(stderr, "Error creating generator thread\n");
+			exit(1);
+		}
+	}
+	for(i = 0; i < threads; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+
+	if(!job->raw)
+		writeAllAt("\n", 1, job->base + job->keyLength);
+	lseek(STDOUT_FILENO, job->base + fileLength, SEEK_SET);
+}
+
+/*****************************************************************************
+Returns 1 if stdout is a regular file that can be written at any offset
+*****************************************************************************/
+static int outputSeekable(off_t *base)
+{
+	struct stat info;
+	int flags = fcntl(STDOUT_FILENO, F_GETFL);
+
+	//pwrite() ignores the offset on files opened for appending
+	if(fstat(STDOUT_FILENO, &info) < 0 || !S_ISREG(info.st_mode) || flags < 0 || (flags & O_APPEND))
+		return 0;
+	*base = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+	return *base >= 0;
+}
 
 int main(int argc, char *argv[])
 {
+	struct keyJob job;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+
+	job.raw = 0;
+	while((opt = getopt(argc, argv, "bj:")) != -1)
+	{
+		if(opt == 'b')
+			job.raw = 1;
+		else if(opt == 'j')
+			threads = atoi(optarg);
+		else
+			threads = 0;
+	}
+
 	//confirm number of arguments
-	if(argc != 2)
+	if(optind != argc - 1 || threads < 1)
 	{
 		printf("Improper number of Command Line Arguments\n");
+		printf("USAGE: %s [-b] [-j threads] keylength\n", argv[0]);
 		exit(1);
 	}
 
-	//set random seed and prepare random string
-	srand(time(0));
-	int keyLength = atoi(argv[1]);
-	char* key = (char*) malloc((keyLength+1)*sizeof(char));
-	memset(key, '\0', sizeof(char)*(keyLength+1));
+	//seed the generator
+	unsigned long long keyLength = strtoull(argv[optind], NULL, 10);
+	if(csprngSeed(job.seed) < 0)
+	{
+		perror("Error seeding random generator");
+		exit(1);
+	}
+	job.keyLength = keyLength;
 
-	//loop through and assign random letters to string
-	for(int i = 0; i < keyLength; i++)
+	//split keys longer than a shard across threads when the output allows it
+	if(threads > 1 && keyLength > KEYSHARD && outputSeekable(&job.base))
 	{
-		char randLetter;
-		int randomInc = rand() % 27;
-		if(randomInc == 26)
-			randLetter = ' ';
-		else
-			randLetter = 'A' + randomInc;
+		generateParallel(&job, threads);
+		memset(job.seed, '\0', sizeof(job.seed));
+		return 0;
+	}
+
+	struct csprng rng;
+	csprngInit(&rng, job.seed, 0);
+	memset(job.seed, '\0', sizeof(job.seed));
 
-		key[i] = randLetter;
+	char* batch = (char*) malloc(KEYBATCH + 1);
+	if(batch == NULL)
+	{
+		perror("Error allocating key buffer");
+		exit(1);
 	}
 
-	printf("%s\n", key);
-	free(key);
-}
\ No newline at end of file
+	//generate and write the key one batch at a time, a zero length key is
+	//just the newline
+	do
+	{
+		size_t count = keyLength < KEYBATCH ? keyLength : KEYBATCH;
+		if(job.raw)
+			csprngBytes(&rng, (unsigned char*) batch, count);
+		else
+			csprngKeyChars(&rng, batch, count);
+		keyLength -= count;
+
+		//the trailing newline goes out with the last batch
+		if(keyLength == 0 && !job.raw)
+			batch[count++] = '\n';
+		writeAll(batch, count);
+	} while(keyLength > 0);
+
+	free(batch);
+	return 0;
+}
@@ -0,0 +1,369 @@
+/*****************************************************************************
+event_loop.c
+
+Description: epoll based event loop for the daemons. The listening socket and
+every accepted connection are registered with a single epoll instance. Each
+connection owns a session state machine which is pumped whenever its socket
+becomes readable or writable. Connections are kept in order of their last
+activity, so idle ones can be expired from the front of the list. A session
+that asks for a delay is parked on a second list until it is due; every
+delay is the same length, so that list is in order too. Large transforms are
+left to the transform pool, which writes to an eventfd registered with the
+same epoll instance once one is done; sessions waiting for it are parked on
+a third list meanwhile, so the loop carries on serving everyone else.
+*****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "event_loop.h"
+
+#define MAXEVENTS 64
+
+void error(const char *msg);
+
+/*****************************************************************************
+A connection tracked by the event loop
+*****************************************************************************/
+struct connection
+{
+	struct session session;
+	unsigned int events;
+	time_t lastActive;
+	struct connection *prev;
+	struct connection *next;
+	//monotonic microseconds at which a parked connection is resumed, else 0
+	int64_t wakeAt;
+	struct connection *nextDelayed;
+	//set while the session waits for the transform pool
+	int transforming;
+	struct connection *nextTransforming;
+};
+
+//connections ordered from least to most recently active
+static struct connection *idleHead = NULL;
+static struct connection *idleTail = NULL;
+
+//parked connections ordered by when they are due
+static struct connection *delayedHead = NULL;
+static struct connection *delayedTail = NULL;
+
+//connections waiting for the transform pool, which signals transformFD
+static struct connection *transformingHead = NULL;
+static int transformFD = -1;
+
+//epoll data of transformFD; the listening socket's is NULL
+static char transformTag;
+
+/*****************************************************************************
+Returns the current monotonic time in seconds
+*****************************************************************************/
+static time_t now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/*****************************************************************************
+Returns the current monotonic time in microseconds
+*****************************************************************************/
+static int64_t nowMicros()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*****************************************************************************
+Removes a connection from the activity list
+*****************************************************************************/
+static void unlinkConnection(struct connection *conn)
+{
+	if (conn->prev != NULL)
+		conn->prev->next = conn->next;
+	else
+		idleHead = conn->next;
+	if (conn->next != NULL)
+		conn->next->prev = conn->prev;
+	else
+		idleTail = conn->prev;
+}
+
+/*****************************************************************************
+Marks a connection as just active by moving it to the back of the list
+*****************************************************************************/
+static void touchConnection(struct connection *conn)
+{
+	if (idleTail != conn)
+	{
+		if (idleHead == conn || conn->prev != NULL)
+			unlinkConnection(conn);
+		conn->prev = idleTail;
+		conn->next = NULL;
+		if (idleTail != NULL)
+			idleTail->next = conn;
+		else
+			idleHead = conn;
+		idleTail = conn;
+	}
+	conn->lastActive = now();
+}
+
+/*****************************************************************************
+Closes a finished connection and releases its state
+*****************************************************************************/
+static void closeConnection(struct connection *conn)
+{
+	unlinkConnection(conn);
+	close(conn->session.fd);
+	sessionFree(&conn->session);
+	free(conn);
+}
+
+/*****************************************************************************
+Parks a connection until its session's delay has passed. It leaves the
+activity list meanwhile, so it cannot be expired while parked.
+*****************************************************************************/
+static void delayConnection(struct connection *conn)
+{
+	unlinkConnection(conn);
+	conn->prev = conn->next = NULL;
+	conn->wakeAt = nowMicros() + conn->session.config->legacyDelay;
+	conn->nextDelayed = NULL;
+	if (delayedTail != NULL)
+		delayedTail->nextDelayed = conn;
+	else
+		delayedHead = conn;
+	delayedTail = conn;
+}
+
+/*****************************************************************************
+Parks a connection until the transform pool has finished its session's job.
+Like a delayed one, it cannot be expired meanwhile.
+*****************************************************************************/
+static void parkTransforming(struct connection *conn)
+{
+	unlinkConnection(conn);
+	conn->prev = conn->next = NULL;
+	conn->transforming = 1;
+	conn->nextTransforming = transformingHead;
+	transformingHead = conn;
+}
+
+/*****************************************************************************
+Pumps a connection's session and updates which events it is waiting for
+*****************************************************************************/
+static void serviceConnection(int epollFD, struct connection *conn)
+{
+	struct epoll_event event;
+	unsigned int wanted;
+
+	touchConnection(conn);
+	switch (sessionPump(&conn->session))
+	{
+	case SESSION_WANT_READ:
+		wanted = EPOLLIN;
+		break;
+	case SESSION_WANT_WRITE:
+		wanted = EPOLLOUT;
+		break;
+	case SESSION_WANT_DELAY:
+		delayConnection(conn);
+		wanted = 0;
+		break;
+	case SESSION_WANT_TRANSFORM:
+		parkTransforming(conn);
+		wanted = 0;
+		break;
+	default:
+		closeConnection(conn);
+		return;
+	}
+
+	if (wanted != conn->events)
+	{
+		event.events = wanted;
+		event.data.ptr = conn;
+		if (epoll_ctl(epollFD, EPOLL_CTL_MOD, conn->session.fd, &event) < 0)
+		{
+			closeConnection(conn);
+			return;
+		}
+		conn->events = wanted;
+	}
+}
+
+/*****************************************************************************
+Accepts every pending connection and registers it with the event loop
+*****************************************************************************/
+static void acceptConnections(int epollFD, int listenSocketFD, const struct sessionConfig *config)
+{
+	struct epoll_event event;
+	struct connection *conn;
+	int establishedConnectionFD;
+
+	while (1)
+	{
+		establishedConnectionFD = accept4(listenSocketFD, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (establishedConnectionFD < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("ERROR on accept");
+			return;
+		}
+
+		conn = malloc(sizeof(struct connection));
+		if (conn == NULL)
+		{
+			close(establishedConnectionFD);
+			continue;
+		}
+		sessionInit(&conn->session, establishedConnectionFD, config);
+		conn->session.transformFD = transformFD;
+		conn->events = EPOLLIN;
+		conn->prev = conn->next = NULL;
+		conn->wakeAt = 0;
+		conn->transforming = 0;
+		touchConnection(conn);
+
+		event.events = conn->events;
+		event.data.ptr = conn;
+		if (epoll_ctl(epollFD, EPOLL_CTL_ADD, establishedConnectionFD, &event) < 0)
+			closeConnection(conn);
+	}
+}
+
+/*****************************************************************************
+Closes every connection that has been idle for the configured timeout
+*****************************************************************************/
+static void expireConnections(const struct sessionConfig *config)
+{
+	time_t cutoff = now() - config->idleTimeout;
+
+	while (idleHead != NULL && idleHead->lastActive <= cutoff)
+		closeConnection(idleHead);
+}
+
+/*****************************************************************************
+Resumes every parked connection that is due
+Returns the milliseconds until the next one is, or -1 if none is parked
+*****************************************************************************/
+static int resumeConnections(int epollFD)
+{
+	struct connection *conn;
+	int64_t current = nowMicros();
+
+	while (delayedHead != NULL && delayedHead->wakeAt <= current)
+	{
+		conn = delayedHead;
+		delayedHead = conn->nextDelayed;
+		if (delayedHead == NULL)
+			delayedTail = NULL;
+		conn->wakeAt = 0;
+		serviceConnection(epollFD, conn);
+	}
+	if (delayedHead == NULL)
+		return -1;
+	return (delayedHead->wakeAt - current + 999) / 1000;
+}
+
+/*****************************************************************************
+Resumes the connections waiting for the transform pool once it has signalled.
+Those whose job is not done yet park themselves again.
+*****************************************************************************/
+static void resumeTransforms(int epollFD)
+{
+	struct connection *conn;
+	struct connection *next;
+	uint64_t count;
+
+	if (read(transformFD, &count, sizeof(count)) < 0)
+		return;
+	conn = transformingHead;
+	transformingHead = NULL;
+	for (; conn != NULL; conn = next)
+	{
+		next = conn->nextTransforming;
+		conn->transforming = 0;
+		serviceConnection(epollFD, conn);
+	}
+}
+
+/*****************************************************************************
+Runs the daemon as a single process multiplexing all clients. Never returns.
+*****************************************************************************/
+void runEventLoop(int listenSocketFD, const struct sessionConfig *config)
+{
+	struct epoll_event event;
+	struct epoll_event events[MAXEVENTS];
+	struct connection *conn;
+	int epollFD;
+	int count;
+	int timeout;
+	int transformsDone;
+	int i;
+
+	epollFD = epoll_create1(EPOLL_CLOEXEC);
+	if (epollFD < 0)
+		error("ERROR creating epoll instance");
+
+	//the listening socket is the only entry without a connection attached
+	fcntl(listenSocketFD, F_SETFL, fcntl(listenSocketFD, F_GETFL) | O_NONBLOCK);
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	if (epoll_ctl(epollFD, EPOLL_CTL_ADD, listenSocketFD, &event) < 0)
+		error("ERROR registering listen socket");
+
+	transformFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	event.events = EPOLLIN;
+	event.data.ptr = &transformTag;
+	if (transformFD < 0 || epoll_ctl(epollFD, EPOLL_CTL_ADD, transformFD, &event) < 0)
+		error("ERROR registering transform eventfd");
+
+	while (1)
+	{
+		//wake up when a parked connection is due, and every second to
+		//expire idle connections
+		timeout = resumeConnections(epollFD);
+		if (config->idleTimeout > 0 && (timeout < 0 || timeout > 1000))
+			timeout = 1000;
+		count = epoll_wait(epollFD, events, MAXEVENTS, timeout);
+		if (count < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			error("ERROR on epoll_wait");
+		}
+
+		transformsDone = 0;
+		for (i = 0; i < count; i++)
+		{
+			conn = events[i].data.ptr;
+			//a parked connection still reports hangups, it is serviced once due
+			if (conn == NULL)
+				acceptConnections(epollFD, listenSocketFD, config);
+			else if (events[i].data.ptr == &transformTag)
+				transformsDone = 1;
+			else if (conn->wakeAt == 0 && !conn->transforming)
+				serviceConnection(epollFD, conn);
+		}
+		//only once the batch is handled, as resuming may close connections in it
+		if (transformsDone)
+			resumeTransforms(epollFD);
+		if (config->idleTimeout > 0)
+			expireConnections(config);
+	}
+}
@@ -0,0 +1,16 @@
+/*****************************************************************************
+event_loop.h
+
+Description: Single process, epoll driven server mode. Multiplexes every
+client connection over non-blocking sockets instead of forking a child per
+connection.
+*****************************************************************************/
+
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "session.h"
+
+void runEventLoop(int listenSocketFD, const struct sessionConfig *config);
+
+#endif
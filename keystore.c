@@ -0,0 +1,285 @@
+/*****************************************************************************
+keystore.c
+
+Description: Keys are saved in the key directory as <id>.key, where the ID
+is drawn from the kernel's random generator when the key is uploaded, so it
+reveals nothing about the key and cannot be worked out from it. An ID is a
+bearer capability: anyone who can reach the daemon and knows it can use the
+key, so it must be kept as secret as the key. Uploading the same key twice
+stores it under two IDs.
+Key files are memory mapped when first referenced and kept in an LRU list;
+once the mapped total passes the cache limit the least recently used keys
+that no request is using are unmapped. The store is shared by every thread
+of a daemon and guarded by a single mutex.
+*****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+
+#include "keystore.h"
+
+#define KEYBUCKETS 256
+
+// Random IDs tried before an upload gives up, they only repeat by accident
+#define ID_ATTEMPTS 8
+
+void error(const char *msg);
+
+static char *storeDirectory = NULL;
+static size_t storeLimit = 0;
+static size_t storeMapped = 0;
+static pthread_mutex_t storeLock = PTHREAD_MUTEX_INITIALIZER;
+
+//mappings ordered from least to most recently used, and indexed by ID
+static struct keyMapping *lruHead = NULL;
+static struct keyMapping *lruTail = NULL;
+static struct keyMapping *buckets[KEYBUCKETS];
+
+/*****************************************************************************
+Enables the store, creating the key directory if needed
+*****************************************************************************/
+void keyStoreInit(const char *directory, size_t cacheLimit)
+{
+	if (mkdir(directory, 0700) < 0 && errno != EEXIST)
+		error("ERROR creating key directory");
+	storeDirectory = strdup(directory);
+	if (storeDirectory == NULL)
+		error("ERROR allocating key store");
+	storeLimit = cacheLimit;
+}
+
+/*****************************************************************************
+Draws a new key ID from the kernel
+Returns -1 if no random bytes are available
+*****************************************************************************/
+static int randomID(uint64_t *id)
+{
+	ssize_t count;
+
+	do
+		count = getrandom(id, sizeof(*id), 0);
+	while (count < 0 && errno == EINTR);
+	return count == sizeof(*id) ? 0 : -1;
+}
+
+/*****************************************************************************
+Builds the file name a key is stored under
+*****************************************************************************/
+static void keyPath(char *path, size_t size, uint64_t id)
+{
+	snprintf(path, size, "%s/%016llx.key", storeDirectory, (unsigned long long)id);
+}
+
+/*****************************************************************************
+Removes a mapping from the LRU list
+*****************************************************************************/
+static void unlinkMapping(struct keyMapping *mapping)
+{
+	if (mapping->prev != NULL)
+		mapping->prev->next = mapping->next;
+	else
+		lruHead = mapping->next;
+	if (mapping->next != NULL)
+		mapping->next->prev = mapping->prev;
+	else
+		lruTail = mapping->prev;
+}
+
+/*****************************************************************************
+Appends a mapping to the most recently used end of the LRU list
+*****************************************************************************/
+static void appendMapping(struct keyMapping *mapping)
+{
+	mapping->prev = lruTail;
+	mapping->next = NULL;
+	if (lruTail != NULL)
+		lruTail->next = mapping;
+	else
+		lruHead = mapping;
+	lruTail = mapping;
+}
+
+/*****************************************************************************
+Unmaps least recently used keys until the cache fits in its limit again
+Keys in use by a request are skipped
+*****************************************************************************/
+static void evictMappings()
+{
+	struct keyMapping *mapping = lruHead;
+	struct keyMapping *next;
+	struct keyMapping **link;
+
+	while (mapping != NULL && storeMapped > storeLimit)
+	{
+		next = mapping->next;
+		if (mapping->refs == 0)
+		{
+			for (link = &buckets[mapping->id % KEYBUCKETS]; *link != mapping; link = &(*link)->hashNext)
+				;
+			*link = mapping->hashNext;
+			unlinkMapping(mapping);
+
+			storeMapped -= mapping->length;
+			if (mapping->length > 0)
+				munmap((void *)mapping->data, mapping->length);
+			free(mapping);
+		}
+		mapping = next;
+	}
+}
+
+/*****************************************************************************
+Maps a key file into memory, returns NULL if there is no such key
+*****************************************************************************/
+static struct keyMapping *mapKey(uint64_t id)
+{
+	char path[4096];
+	struct stat info;
+	struct keyMapping *mapping;
+	void *data = NULL;
+	int fd;
+
+	keyPath(path, sizeof(path), id);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &info) < 0)
+	{
+		close(fd);
+		return NULL;
+	}
+	if (info.st_size > 0)
+	{
+		data = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (data == MAP_FAILED)
+		{
+			close(fd);
+			return NULL;
+		}
+	}
+	close(fd);
+
+	mapping = malloc(sizeof(struct keyMapping));
+	if (mapping == NULL)
+	{
+		if (data != NULL)
+			munmap(data, info.st_size);
+		return NULL;
+	}
+	mapping->id = id;
+	mapping->data = data;
+	mapping->length = info.st_size;
+	mapping->refs = 0;
+	mapping->hashNext = buckets[id % KEYBUCKETS];
+	buckets[id % KEYBUCKETS] = mapping;
+	appendMapping(mapping);
+	storeMapped += mapping->length;
+	return mapping;
+}
+
+/*****************************************************************************
+Looks up a key by ID, mapping it if it is not cached, and pins it until
+keyStoreRelease() is called
+Returns NULL if the store is disabled or the key does not exist
+*****************************************************************************/
+struct keyMapping *keyStoreAcquire(uint64_t id)
+{
+	struct keyMapping *mapping;
+
+	if (storeDirectory == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&storeLock);
+	for (mapping = buckets[id % KEYBUCKETS]; mapping != NULL; mapping = mapping->hashNext)
+	{
+		if (mapping->id == id)
+			break;
+	}
+	if (mapping != NULL)
+	{
+		unlinkMapping(mapping);
+		appendMapping(mapping);
+	}
+	else
+	{
+		mapping = mapKey(id);
+	}
+	if (mapping != NULL)
+		mapping->refs++;
+	pthread_mutex_unlock(&storeLock);
+	return mapping;
+}
+
+/*****************************************************************************
+Unpins a key, then trims the cache if it has grown past its limit
+*****************************************************************************/
+void keyStoreRelease(struct keyMapping *mapping)
+{
+	pthread_mutex_lock(&storeLock);
+	mapping->refs--;
+	evictMappings();
+	pthread_mutex_unlock(&storeLock);
+}
+
+/*****************************************************************************
+Saves an uploaded key under a new random ID
+The file is written under a temporary name and linked into place, so other
+workers never map a partly written key and an existing key is never
+replaced.
+Returns -1 if the key could not be stored
+*****************************************************************************/
+int keyStoreUpload(const char *key, size_t length, uint64_t *id)
+{
+	char path[4096];
+	char temporary[4096];
+	ssize_t written;
+	int fd;
+	int attempt;
+	int stored = -1;
+
+	if (storeDirectory == NULL)
+		return -1;
+
+	snprintf(temporary, sizeof(temporary), "%s/.upload.XXXXXX", storeDirectory);
+	fd = mkstemp(temporary);
+	if (fd < 0)
+		return -1;
+	while (length > 0)
+	{
+		written = write(fd, key, length);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written < 0)
+		{
+			close(fd);
+			unlink(temporary);
+			return -1;
+		}
+		key += written;
+		length -= written;
+	}
+	close(fd);
+
+	//link() fails rather than replacing a key that already has the ID
+	for (attempt = 0; attempt < ID_ATTEMPTS && stored < 0; attempt++)
+	{
+		if (randomID(id) < 0)
+			break;
+		keyPath(path, sizeof(path), *id);
+		stored = link(temporary, path);
+		if (stored < 0 && errno != EEXIST)
+			break;
+	}
+	unlink(temporary);
+	return stored;
+}
@@ -0,0 +1,37 @@
+/*****************************************************************************
+keystore.h
+
+Description: Daemon side store of uploaded keys. A key is uploaded once and
+referred to afterwards by its random 64 bit ID, so clients do not resend the
+key with every request. Whoever knows an ID can use its key.
+*****************************************************************************/
+
+#ifndef KEYSTORE_H
+#define KEYSTORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Megabytes of key material kept mapped by default
+#define DEFAULT_KEY_CACHE 256
+
+/*****************************************************************************
+A memory mapped key file, pinned while refs is above 0
+*****************************************************************************/
+struct keyMapping
+{
+	uint64_t id;
+	const char *data;
+	size_t length;
+	int refs;
+	struct keyMapping *prev;
+	struct keyMapping *next;
+	struct keyMapping *hashNext;
+};
+
+void keyStoreInit(const char *directory, size_t cacheLimit);
+int keyStoreUpload(const char *key, size_t length, uint64_t *id);
+struct keyMapping *keyStoreAcquire(uint64_t id);
+void keyStoreRelease(struct keyMapping *mapping);
+
+#endif
@@ -0,0 +1,413 @@
+/*****************************************************************************
+legacy_test.c
+
+Description: Runs otp_daemon in every server mode and talks to it the way
+the original clients did, which are still in use and cannot be changed.
+Those clients read each ACK with a single recv() of one byte more than an
+ACK, so the daemon must not send anything after an ACK until the client has
+read it. Each mode encrypts and decrypts texts from a few bytes up to
+several hundred KB, and the results are compared with the mod 27 arithmetic.
+The pause the daemon makes before a legacy result is only best effort, so
+every mode is then run again with one busy process per CPU competing with
+the client and daemon, and a longer pause passed with -d.
+Exits 0 if every request succeeded, 1 otherwise.
+
+Intended Usage:
+legacy_test [path to otp_daemon]
+*****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// Legacy peers send sizeof(ack) bytes where ack is a char *
+#define ACKSIZE sizeof(char *)
+#define MAXCIPHER 27
+
+// Times each request is repeated, and seconds a reply may take
+#define REPEATS 3
+#define REPLY_TIMEOUT 5
+
+// Microseconds the daemon pauses before a legacy result while the host is busy
+#define LOADED_DELAY "50000"
+
+/*****************************************************************************
+Global Variables + Function Prototypes
+*****************************************************************************/
+static pid_t daemonPid = -1;
+static pid_t *loadPids = NULL;
+static int loadCount = 0;
+
+static void stopLoad();
+
+void error(const char *msg)
+{
+	fprintf(stderr, "%s", msg);
+	if (daemonPid > 0)
+		kill(daemonPid, SIGTERM);
+	stopLoad();
+	exit(1);
+} // Error function used for reporting issues, stops the daemon and load under test
+
+static const char *modes[] = {"epoll", "uring", "process", "thread", "fork"};
+static const size_t lengths[] = {1, 1000, 65536, 200000, 700001};
+
+/*****************************************************************************
+Returns a loopback TCP port that is free at the time of the call
+*****************************************************************************/
+static int freePort()
+{
+	struct sockaddr_in address;
+	socklen_t size = sizeof(address);
+	int socketFD = socket(AF_INET, SOCK_STREAM, 0);
+
+	memset(&address, '\0', sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (socketFD < 0 || bind(socketFD, (struct sockaddr *)&address, sizeof(address)) < 0
+		|| getsockname(socketFD, (struct sockaddr *)&address, &size) < 0)
+		error("ERROR finding a free port\n");
+	close(socketFD);
+	return ntohs(address.sin_port);
+}
+
+/*****************************************************************************
+Starts one process per CPU that spins until it is killed
+*****************************************************************************/
+static void startLoad()
+{
+	int i;
+
+	loadCount = sysconf(_SC_NPROCESSORS_ONLN);
+	loadPids = malloc(loadCount * sizeof(pid_t));
+	if (loadPids == NULL)
+		error("ERROR allocating load processes\n");
+	for (i = 0; i < loadCount; i++)
+	{
+		loadPids[i] = fork();
+		if (loadPids[i] < 0)
+		{
+			loadCount = i;
+			error("ERROR forking a load process\n");
+		}
+		if (loadPids[i] == 0)
+		{
+			while (1)
+				;
+		}
+	}
+}
+
+/*****************************************************************************
+Kills the load processes, if any are running
+*****************************************************************************/
+static void stopLoad()
+{
+	int i;
+
+	for (i = 0; i < loadCount; i++)
+		kill(loadPids[i], SIGKILL);
+	for (i = 0; i < loadCount; i++)
+		waitpid(loadPids[i], NULL, 0);
+	free(loadPids);
+	loadPids = NULL;
+	loadCount = 0;
+}
+
+/*****************************************************************************
+Starts the daemon in the given mode on port, with the given legacy delay or
+NULL for the daemon's default
+*****************************************************************************/
+static void startDaemon(const char *path, const char *mode, const char *delay, int port)
+{
+	char portString[16];
+
+	snprintf(portString, sizeof(portString), "%d", port);
+	daemonPid = fork();
+	if (daemonPid < 0)
+		error("ERROR forking the daemon\n");
+	if (daemonPid == 0)
+	{
+		if (delay != NULL)
+			execl(path, path, "-m", mode, "-d", delay, portString, (char *)NULL);
+		else
+			execl(path, path, "-m", mode, portString, (char *)NULL);
+		perror("ERROR starting the daemon");
+		_exit(1);
+	}
+}
+
+/*****************************************************************************
+Stops the daemon and waits for it to exit
+*****************************************************************************/
+static void stopDaemon()
+{
+	kill(daemonPid, SIGTERM);
+	waitpid(daemonPid, NULL, 0);
+	daemonPid = -1;
+}
+
+/*****************************************************************************
+Connects to the daemon, retrying while it is still starting up
+*****************************************************************************/
+static int connectDaemon(int port)
+{
+	struct sockaddr_in address;
+	struct timeval timeout = { REPLY_TIMEOUT, 0 };
+	struct timespec retry = { 0, 10 * 1000 * 1000 };
+	int socketFD;
+	int tries;
+
+	memset(&address, '\0', sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons(port);
+
+	for (tries = 0; tries < 300; tries++)
+	{
+		socketFD = socket(AF_INET, SOCK_STREAM, 0);
+		if (socketFD < 0)
+			error("ERROR opening socket\n");
+		if (connect(socketFD, (struct sockaddr *)&address, sizeof(address)) == 0)
+		{
+			//a daemon that stops answering fails the test instead of hanging it
+			setsockopt(socketFD, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+			return socketFD;
+		}
+		close(socketFD);
+		nanosleep(&retry, NULL);
+	}
+	error("ERROR connecting to the daemon\n");
+	return -1;
+}
+
+/*****************************************************************************
+Sends the whole buffer
+*****************************************************************************/
+static void sendAll(int socketFD, const void *buffer, size_t length)
+{
+	ssize_t count;
+
+	while (length > 0)
+	{
+		count = send(socketFD, buffer, length, MSG_NOSIGNAL);
+		if (count < 0)
+			error("ERROR writing to socket\n");
+		buffer = (const char *)buffer + count;
+		length -= count;
+	}
+}
+
+/*****************************************************************************
+Receives exactly length bytes
+Returns 0 if the daemon closed the connection or stopped answering
+*****************************************************************************/
+static int recvAll(int socketFD, void *buffer, size_t length)
+{
+	ssize_t count;
+
+	while (length > 0)
+	{
+		count = recv(socketFD, buffer, length, 0);
+		if (count <= 0)
+			return 0;
+		buffer = (char *)buffer + count;
+		length -= count;
+	}
+	return 1;
+}
+
+/*****************************************************************************
+Sends a message with its INT length prefix in two writes, as the original
+clients did
+*****************************************************************************/
+static void sendLegacyMessage(int socketFD, const char *message, int length)
+{
+	sendAll(socketFD, &length, sizeof(int));
+	sendAll(socketFD, message, length);
+}
+
+/*****************************************************************************
+Receives a message with its INT length prefix
+Returns NULL if it did not arrive in full
+*****************************************************************************/
+static char *receiveLegacyMessage(int socketFD, int *length)
+{
+	char *message;
+
+	if (!recvAll(socketFD, length, sizeof(int)) || *length < 0)
+		return NULL;
+	message = malloc(*length + 1);
+	if (message == NULL)
+		error("ERROR allocating a message\n");
+	if (!recvAll(socketFD, message, *length))
+	{
+		free(message);
+		return NULL;
+	}
+	message[*length] = '\0';
+	return message;
+}
+
+/*****************************************************************************
+Reads an ACK the way the original clients did, with one recv() that may
+return more than the ACK if more is waiting
+Returns 1 if exactly an ACK arrived
+*****************************************************************************/
+static int recvLegacyAck(int socketFD)
+{
+	char response[ACKSIZE + 2];
+
+	memset(response, '\0', sizeof(response));
+	if (recv(socketFD, response, ACKSIZE + 1, 0) <= 0)
+		return 0;
+	return !strcmp(response, "ACK");
+}
+
+/*****************************************************************************
+Runs one request
+Returns 1 if the daemon answered with the expected text
+*****************************************************************************/
+static int legacyRequest(int port, const char *client, const char *text, const char *key,
+	const char *expected, int length)
+{
+	char ack[ACKSIZE] = "ACK";
+	int socketFD = connectDaemon(port);
+	char *status;
+	char *result;
+	int resultLength;
+	int passed = 0;
+
+	sendLegacyMessage(socketFD, client, strlen(client));
+	status = receiveLegacyMessage(socketFD, &resultLength);
+	if (status == NULL || strcmp(status, "ACCEPT"))
+		error("ERROR daemon did not accept the client\n");
+	free(status);
+
+	sendLegacyMessage(socketFD, text, length);
+	if (recvLegacyAck(socketFD))
+	{
+		sendLegacyMessage(socketFD, key, length);
+		if (recvLegacyAck(socketFD))
+		{
+			result = receiveLegacyMessage(socketFD, &resultLength);
+			if (result != NULL)
+			{
+				sendAll(socketFD, ack, ACKSIZE);
+				passed = resultLength == length && !memcmp(result, expected, length);
+			}
+			free(result);
+		}
+	}
+
+	close(socketFD);
+	return passed;
+}
+
+/*****************************************************************************
+Fills a buffer with random characters of the alphabet
+*****************************************************************************/
+static void randomText(char *text, size_t length)
+{
+	size_t i;
+	int x;
+
+	for (i = 0; i < length; i++)
+	{
+		x = rand() % MAXCIPHER;
+		text[i] = x == MAXCIPHER - 1 ? ' ' : 'A' + x;
+	}
+}
+
+/*****************************************************************************
+Encrypts text with key one character at a time
+*****************************************************************************/
+static void encryptText(char *out, const char *text, const char *key, size_t length)
+{
+	size_t i;
+	int x;
+
+	for (i = 0; i < length; i++)
+	{
+		x = ((text[i] == ' ' ? MAXCIPHER - 1 : text[i] - 'A')
+			+ (key[i] == ' ' ? MAXCIPHER - 1 : key[i] - 'A')) % MAXCIPHER;
+		out[i] = x == MAXCIPHER - 1 ? ' ' : 'A' + x;
+	}
+}
+
+/*****************************************************************************
+Encrypts and decrypts every length against the daemon in one mode, with the
+given legacy delay or NULL for the default
+Returns the number of requests that failed
+*****************************************************************************/
+static int testMode(const char *path, const char *mode, const char *delay, char *text, char *key,
+	char *encrypted)
+{
+	int failures = 0;
+	int port;
+	size_t i;
+	int repeat;
+
+	port = freePort();
+	startDaemon(path, mode, delay, port);
+	for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++)
+	{
+		randomText(text, lengths[i]);
+		randomText(key, lengths[i]);
+		encryptText(encrypted, text, key, lengths[i]);
+
+		for (repeat = 0; repeat < REPEATS; repeat++)
+		{
+			if (!legacyRequest(port, "OTP_ENC", text, key, encrypted, lengths[i]))
+				failures++;
+			if (!legacyRequest(port, "OTP_DEC", encrypted, key, text, lengths[i]))
+				failures++;
+		}
+	}
+	stopDaemon();
+
+	printf("%-8s %s%s\n", mode, loadCount > 0 ? "under load " : "", failures ? "FAILED" : "ok");
+	return failures;
+}
+
+/*****************************************************************************
+Main Driver
+*****************************************************************************/
+int main(int argc, char *argv[])
+{
+	const char *path = argc > 1 ? argv[1] : "./otp_daemon";
+	size_t largest = lengths[sizeof(lengths) / sizeof(lengths[0]) - 1];
+	char *text = malloc(largest);
+	char *key = malloc(largest);
+	char *encrypted = malloc(largest);
+	int failures = 0;
+	size_t i;
+
+	if (text == NULL || key == NULL || encrypted == NULL)
+		error("ERROR allocating buffers\n");
+	signal(SIGPIPE, SIG_IGN);
+	srand(1);
+
+	for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+		failures += testMode(path, modes[i], NULL, text, key, encrypted);
+
+	//the daemon's pause has to outlast the client being scheduled out
+	startLoad();
+	for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+		failures += testMode(path, modes[i], LOADED_DELAY, text, key, encrypted);
+	stopLoad();
+
+	free(text);
+	free(key);
+	free(encrypted);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,281 @@
+/*****************************************************************************
+metrics.c
+
+Description: Counters and latency histograms live in one anonymous shared
+mapping created before the daemon starts its workers, so forked children,
+worker processes and threads all update the same numbers with atomic adds.
+Latencies are kept in HDR style buckets: four linear sub-buckets for every
+power of two microseconds, from 1us up to about two minutes. A thread in the
+daemon's main process answers every connection to the metrics socket with
+an HTTP response holding the Prometheus text exposition of the table.
+*****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#include "metrics.h"
+#include "protocol.h"
+#include "address.h"
+
+#define METRIC_BUCKETS 104
+#define METRICS_BUFFER (1 << 16)
+
+void error(const char *msg);
+
+struct metricHistogram
+{
+	uint64_t buckets[METRIC_BUCKETS];
+	uint64_t count;
+	uint64_t sumNanoseconds;
+};
+
+struct metricTable
+{
+	int64_t counters[METRIC_COUNTERS];
+	struct metricHistogram phases[METRIC_PHASES];
+};
+
+static struct metricTable *table = NULL;
+
+static const char *counterNames[METRIC_COUNTERS] = {
+	"otp_connections_total",
+	"otp_clients_accepted_total",
+	"otp_clients_rejected_total",
+	"otp_bytes_received_total",
+	"otp_bytes_sent_total",
+	"otp_requests_total",
+	"otp_request_errors_total",
+	"otp_active_sessions",
+	"otp_workers"
+};
+
+static const char *counterHelp[METRIC_COUNTERS] = {
+	"Connections accepted by the daemon",
+	"Clients whose handshake was accepted",
+	"Clients whose handshake was rejected",
+	"Bytes received from clients",
+	"Bytes sent to clients",
+	"Requests answered",
+	"Requests that failed or connections dropped mid request",
+	"Connections currently being served",
+	"Event loops, worker processes or threads, or forked children currently running"
+};
+
+static const char *phaseNames[METRIC_PHASES] = {"handshake", "receive", "transform", "send"};
+
+/*****************************************************************************
+Allocates the shared table, must run before any worker is started
+*****************************************************************************/
+void metricsInit()
+{
+	table = mmap(NULL, sizeof(struct metricTable), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (table == MAP_FAILED)
+		error("ERROR allocating metrics");
+	memset(table, '\0', sizeof(struct metricTable));
+}
+
+void metricsAdd(int counter, int64_t amount)
+{
+	if (table != NULL)
+		__atomic_fetch_add(&table->counters[counter], amount, __ATOMIC_RELAXED);
+}
+
+/*****************************************************************************
+Returns a monotonic timestamp in nanoseconds, or 0 when metrics are off so
+callers skip the clock entirely
+*****************************************************************************/
+uint64_t metricsNow()
+{
+	struct timespec now;
+
+	if (table == NULL)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*****************************************************************************
+Bucket holding a latency in microseconds, METRIC_BUCKETS if it is beyond the
+last one
+*****************************************************************************/
+static int bucketIndex(uint64_t micros)
+{
+	int exponent;
+	int index;
+
+	if (micros < 4)
+		return micros;
+	exponent = 63 - __builtin_clzll(micros);
+	index = 4 + (exponent - 2) * 4 + ((micros >> (exponent - 2)) & 3);
+	return index < METRIC_BUCKETS ? index : METRIC_BUCKETS;
+}
+
+/*****************************************************************************
+Upper bound of a bucket in microseconds
+*****************************************************************************/
+static uint64_t bucketLimit(int index)
+{
+	if (index < 4)
+		return index + 1;
+	return (uint64_t)(5 + (index - 4) % 4) << ((index - 4) / 4);
+}
+
+/*****************************************************************************
+Records the time since started, a metricsNow() timestamp, for a phase
+*****************************************************************************/
+void metricsRecord(int phase, uint64_t started)
+{
+	struct metricHistogram *histogram;
+	uint64_t elapsed;
+	int index;
+
+	if (table == NULL || started == 0)
+		return;
+	histogram = &table->phases[phase];
+	elapsed = metricsNow() - started;
+	index = bucketIndex(elapsed / 1000);
+	if (index < METRIC_BUCKETS)
+		__atomic_fetch_add(&histogram->buckets[index], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&histogram->sumNanoseconds, elapsed, __ATOMIC_RELAXED);
+}
+
+/*****************************************************************************
+Appends formatted text after the used bytes of buffer, cutting it short once
+the buffer is full
+Returns the new length, at most size - 1
+*****************************************************************************/
+static size_t appendMetrics(char *buffer, size_t size, size_t used, const char *format, ...)
+{
+	va_list args;
+	int count;
+
+	if (used >= size - 1)
+		return used;
+	va_start(args, format);
+	count = vsnprintf(buffer + used, size - used, format, args);
+	va_end(args);
+	if (count < 0)
+		return used;
+	return used + count < size ? used + count : size - 1;
+}
+
+/*****************************************************************************
+Writes the whole table in the Prometheus text format
+Returns the length written
+*****************************************************************************/
+static size_t formatMetrics(char *buffer, size_t size)
+{
+	struct metricHistogram *histogram;
+	uint64_t cumulative;
+	size_t used = 0;
+	int counter, phase, i;
+
+	for (counter = 0; counter < METRIC_COUNTERS; counter++)
+	{
+		used = appendMetrics(buffer, size, used, "# HELP %s %s\n# TYPE %s %s\n%s %lld\n",
+			counterNames[counter], counterHelp[counter], counterNames[counter],
+			counter >= METRIC_ACTIVE_SESSIONS ? "gauge" : "counter",
+			counterNames[counter], (long long)__atomic_load_n(&table->counters[counter], __ATOMIC_RELAXED));
+	}
+
+	used = appendMetrics(buffer, size, used,
+		"# HELP otp_phase_duration_seconds Time spent in each phase of a request\n"
+		"# TYPE otp_phase_duration_seconds histogram\n");
+	for (phase = 0; phase < METRIC_PHASES; phase++)
+	{
+		histogram = &table->phases[phase];
+		cumulative = 0;
+		for (i = 0; i < METRIC_BUCKETS; i++)
+		{
+			cumulative += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+			used = appendMetrics(buffer, size, used, "otp_phase_duration_seconds_bucket{phase=\"%s\",le=\"%g\"} %llu\n",
+				phaseNames[phase], bucketLimit(i) * 1e-6, (unsigned long long)cumulative);
+		}
+		used = appendMetrics(buffer, size, used,
+			"otp_phase_duration_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %llu\n"
+			"otp_phase_duration_seconds_sum{phase=\"%s\"} %.9f\n"
+			"otp_phase_duration_seconds_count{phase=\"%s\"} %llu\n",
+			phaseNames[phase], (unsigned long long)__atomic_load_n(&histogram->count, __ATOMIC_RELAXED),
+			phaseNames[phase], __atomic_load_n(&histogram->sumNanoseconds, __ATOMIC_RELAXED) * 1e-9,
+			phaseNames[phase], (unsigned long long)__atomic_load_n(&histogram->count, __ATOMIC_RELAXED));
+	}
+	return used;
+}
+
+/*****************************************************************************
+Answers every connection with the current metrics, whatever was requested
+*****************************************************************************/
+static void *metricsMain(void *arg)
+{
+	int listenSocketFD = *(int *)arg;
+	char *body = malloc(METRICS_BUFFER);
+	char request[1024];
+	char header[128];
+	struct timeval timeout = { 1, 0 };
+	int connectionFD;
+	int headerLength;
+	size_t bodyLength;
+
+	if (body == NULL)
+		error("ERROR allocating metrics buffer");
+	while (1)
+	{
+		connectionFD = accept(listenSocketFD, NULL, NULL);
+		if (connectionFD < 0)
+			continue;
+
+		//the request line is read so the client sees a clean close, then ignored
+		setsockopt(connectionFD, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		recv(connectionFD, request, sizeof(request), 0);
+
+		bodyLength = formatMetrics(body, METRICS_BUFFER);
+		headerLength = snprintf(header, sizeof(header),
+			"HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", bodyLength);
+		if (sendAll(connectionFD, header, headerLength) == 0)
+			sendAll(connectionFD, body, bodyLength);
+		close(connectionFD);
+	}
+	return NULL;
+}
+
+/*****************************************************************************
+Starts serving metrics on a local port, Unix socket path or abstract name
+*****************************************************************************/
+void metricsServe(const char *address)
+{
+	static int listenSocketFD;
+	struct sockaddr_storage metricsAddress;
+	socklen_t addressLength;
+	pthread_t thread;
+	int reuse = 1;
+
+	//port numbers are only reachable from this machine
+	if (parseAddress(address, INADDR_LOOPBACK, &metricsAddress, &addressLength) < 0)
+		error("ERROR invalid metrics address");
+	removeStaleSocket(&metricsAddress);
+	listenSocketFD = socket(metricsAddress.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listenSocketFD < 0)
+		error("ERROR opening metrics socket");
+
+	//scrapes leave connections in TIME_WAIT, which must not block a restart
+	setsockopt(listenSocketFD, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	if (bind(listenSocketFD, (struct sockaddr *)&metricsAddress, addressLength) < 0)
+		error("ERROR opening metrics socket");
+	listen(listenSocketFD, SOMAXCONN);
+
+	if (pthread_create(&thread, NULL, metricsMain, &listenSocketFD))
+		error("ERROR starting metrics thread");
+	pthread_detach(thread);
+}
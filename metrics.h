@@ -0,0 +1,43 @@
+/*****************************************************************************
+metrics.h
+
+Description: Daemon counters and latency histograms, exposed in the
+Prometheus text format on a separate local port or Unix socket. Recording
+is a no-op until metricsInit() is called.
+*****************************************************************************/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+enum metricCounter
+{
+	METRIC_CONNECTIONS,
+	METRIC_CLIENTS_ACCEPTED,
+	METRIC_CLIENTS_REJECTED,
+	METRIC_BYTES_RECEIVED,
+	METRIC_BYTES_SENT,
+	METRIC_REQUESTS,
+	METRIC_REQUEST_ERRORS,
+	METRIC_ACTIVE_SESSIONS,
+	METRIC_WORKERS,
+	METRIC_COUNTERS
+};
+
+enum metricPhase
+{
+	PHASE_HANDSHAKE,
+	PHASE_RECEIVE,
+	PHASE_TRANSFORM,
+	PHASE_SEND,
+	METRIC_PHASES
+};
+
+void metricsInit();
+void metricsServe(const char *address);
+void metricsAdd(int counter, int64_t amount);
+uint64_t metricsNow();
+void metricsRecord(int phase, uint64_t started);
+
+#endif
@@ -0,0 +1,219 @@
+/*****************************************************************************
+otp.c
+
+Description: Implements libotp on top of the cipher kernels and the
+transform pool the daemons use. Text is checked against the alphabet with
+the vectorized scan before it is transformed, since the kernels assume
+valid input. Large buffers are split over the pool like large requests on
+a daemon. File descriptors are read, transformed and written a chunk at a
+time, so memory use does not depend on the length of the input.
+*****************************************************************************/
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "otp.h"
+#include "cipher.h"
+#include "transform_pool.h"
+
+// Bytes of message and key read from file descriptors at a time
+#define OTP_FD_CHUNK (1 << 20)
+
+typedef void (*otpKernel)(char *out, const char *message, const char *key, size_t length);
+
+/*****************************************************************************
+Returns the transform for an operation, or NULL if there is none
+*****************************************************************************/
+static otpKernel otpFunction(int operation)
+{
+	if (operation == OTP_ENCRYPT)
+		return cipherEncrypt;
+	if (operation == OTP_DECRYPT)
+		return cipherDecrypt;
+	if (operation == OTP_XOR)
+		return cipherXor;
+	return NULL;
+}
+
+/*****************************************************************************
+Checks the message and key of a text operation only hold the alphabet
+*****************************************************************************/
+static int otpValid(int operation, const char *message, const char *key, size_t length)
+{
+	if (operation == OTP_XOR)
+		return 1;
+	return cipherScanText(message, length) == length && cipherScanText(key, length) == length;
+}
+
+/*****************************************************************************
+Sets the number of transform threads, 0 for none, and the size in bytes from
+which a buffer is split among them. Only has an effect before the first
+transform; without it every buffer is transformed on the calling thread.
+*****************************************************************************/
+void otpInit(int threads, size_t threshold)
+{
+	transformPoolInit(threads, threshold);
+}
+
+/*****************************************************************************
+Transforms length characters of message with key into out, which may be
+message itself
+Returns 0, or -1 if the input was rejected
+*****************************************************************************/
+int otpTransform(int operation, char *out, const char *message, const char *key, size_t length)
+{
+	otpKernel transform = otpFunction(operation);
+
+	if (transform == NULL || !otpValid(operation, message, key, length))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	parallelTransform(transform, out, message, key, length);
+	return 0;
+}
+
+/*****************************************************************************
+Transforms every buffer of a batch in order
+Returns the number of buffers transformed. If it is less than count, the
+next buffer was rejected and it and the rest are left untouched.
+*****************************************************************************/
+size_t otpTransformBatch(int operation, const struct otpBuffer *buffers, size_t count)
+{
+	otpKernel transform = otpFunction(operation);
+	size_t i;
+
+	if (transform == NULL)
+	{
+		errno = EINVAL;
+		return 0;
+	}
+	for (i = 0; i < count; i++)
+	{
+		if (!otpValid(operation, buffers[i].message, buffers[i].key, buffers[i].length))
+		{
+			errno = EINVAL;
+			return i;
+		}
+		parallelTransform(transform, buffers[i].out, buffers[i].message, buffers[i].key, buffers[i].length);
+	}
+	return count;
+}
+
+/*****************************************************************************
+Reads until length bytes have arrived or the input ends
+Returns the number of bytes read, or -1 on error
+*****************************************************************************/
+static ssize_t readFull(int fd, char *buffer, size_t length)
+{
+	size_t done = 0;
+	ssize_t count;
+
+	while (done < length)
+	{
+		count = read(fd, buffer + done, length - done);
+		if (count < 0 && errno == EINTR)
+			continue;
+		if (count < 0)
+			return -1;
+		if (count == 0)
+			break;
+		done += count;
+	}
+	return done;
+}
+
+/*****************************************************************************
+Writes the whole buffer
+Returns 0, or -1 on error
+*****************************************************************************/
+static int writeFull(int fd, const char *buffer, size_t length)
+{
+	ssize_t written;
+
+	while (length > 0)
+	{
+		written = write(fd, buffer, length);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written < 0)
+			return -1;
+		buffer += written;
+		length -= written;
+	}
+	return 0;
+}
+
+/*****************************************************************************
+Transforms messageFD with keyFD and writes the result to outFD. Like the
+clients, text operations use the first line of the message, and write it
+without its newline; XOR uses everything up to the end of the input.
+Returns the number of bytes written, or -1 on error
+*****************************************************************************/
+int64_t otpTransformFD(int operation, int outFD, int messageFD, int keyFD)
+{
+	otpKernel transform = otpFunction(operation);
+	char *message = malloc(OTP_FD_CHUNK);
+	char *key = malloc(OTP_FD_CHUNK);
+	char *newline;
+	ssize_t count, keyCount;
+	int64_t total = 0;
+	int done = 0;
+
+	if (transform == NULL || message == NULL || key == NULL)
+	{
+		errno = transform == NULL ? EINVAL : ENOMEM;
+		total = -1;
+	}
+
+	while (!done && total >= 0)
+	{
+		count = readFull(messageFD, message, OTP_FD_CHUNK);
+		if (count < 0)
+		{
+			total = -1;
+			break;
+		}
+		newline = operation == OTP_XOR ? NULL : memchr(message, '\n', count);
+		if (newline != NULL)
+			count = newline - message;
+		done = newline != NULL || count < OTP_FD_CHUNK;
+
+		keyCount = readFull(keyFD, key, count);
+		if (keyCount < 0)
+		{
+			total = -1;
+			break;
+		}
+		//a key that ends early, or a newline in it, leaves it too short
+		if (keyCount < count || !otpValid(operation, message, key, count))
+		{
+			errno = EINVAL;
+			total = -1;
+			break;
+		}
+
+		parallelTransform(transform, message, message, key, count);
+		if (writeFull(outFD, message, count) < 0)
+		{
+			total = -1;
+			break;
+		}
+		total += count;
+	}
+
+	free(message);
+	free(key);
+	return total;
+}
+
+/*****************************************************************************
+Name of the cipher kernel in use
+*****************************************************************************/
+const char *otpKernelName()
+{
+	return cipherKernelName();
+}
@@ -0,0 +1,49 @@
+/*****************************************************************************
+otp.h
+
+Description: In-process one time pad library, libotp. Programs on the
+daemon's host can encrypt and decrypt buffers, batches of buffers and file
+descriptors directly, without a socket round trip, using the same kernels
+and transform pool as the daemons.
+Functions return -1, or stop short, and set errno to EINVAL when the
+operation is unknown, text holds a character outside the alphabet or the
+key is too short; file descriptor errors leave errno from read() or write().
+libotp.so is built with hidden visibility and exports only the functions
+marked OTP_EXPORT, so the cipher and pool internals it is built from cannot
+clash with a program's own symbols.
+*****************************************************************************/
+
+#ifndef OTP_H
+#define OTP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define OTP_EXPORT __attribute__((visibility("default")))
+
+enum otpOperation
+{
+	OTP_ENCRYPT,
+	OTP_DECRYPT,
+	//binary mode, arbitrary bytes XORed with the key both ways
+	OTP_XOR
+};
+
+/*****************************************************************************
+One buffer of a batch. out may be the message itself.
+*****************************************************************************/
+struct otpBuffer
+{
+	char *out;
+	const char *message;
+	const char *key;
+	size_t length;
+};
+
+OTP_EXPORT void otpInit(int threads, size_t threshold);
+OTP_EXPORT int otpTransform(int operation, char *out, const char *message, const char *key, size_t length);
+OTP_EXPORT size_t otpTransformBatch(int operation, const struct otpBuffer *buffers, size_t count);
+OTP_EXPORT int64_t otpTransformFD(int operation, int outFD, int messageFD, int keyFD);
+OTP_EXPORT const char *otpKernelName();
+
+#endif
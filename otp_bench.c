@@ -0,0 +1,350 @@
+/*****************************************************************************
+otp_bench.c
+
+Description: Load generator for the daemons. For every combination of
+message size and concurrency it opens one connection per simulated client,
+sends back to back pipelined version 2 requests for a fixed time and
+reports requests/s, MB/s and latency percentiles as CSV or JSON. With -S
+clients of a daemon on a Unix socket send requests through shared memory,
+with -z they pack text on the wire.
+
+Intended Usage:
+otp_bench [-c client name] [-s sizes] [-n concurrencies] [-d seconds] [-f csv|json] [-S] [-z] address
+
+Sizes take K, M or G suffixes, e.g. -s 16,1K,1M,1G -n 1,8,64
+*****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "protocol.h"
+#include "client.h"
+
+#define MAXRUNS 32
+
+/*****************************************************************************
+Global Variables + Function Prototypes
+*****************************************************************************/
+void error(const char *msg) { fprintf(stderr, msg); exit(2); } // Error function used for reporting issues
+
+int debug = 0;
+
+/*****************************************************************************
+One measurement: every client sends the same text and key
+*****************************************************************************/
+struct benchRun
+{
+	const char *address;
+	const char *clientName;
+	struct textFile text;
+	struct textFile key;
+	double duration;
+	int shared;
+	pthread_barrier_t start;
+};
+
+/*****************************************************************************
+What one client thread measured
+*****************************************************************************/
+struct benchClient
+{
+	struct benchRun *run;
+	double *latencies;
+	size_t count;
+	size_t capacity;
+	double started;
+	double finished;
+};
+
+/*****************************************************************************
+Returns a monotonic timestamp in seconds
+*****************************************************************************/
+static double now()
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+/*****************************************************************************
+Sends one request and checks the whole result came back
+*****************************************************************************/
+static void sendRequest(struct benchRun *run, int *socketFD, struct sharedSegment *segment)
+{
+	int version = FRAME_VERSION;
+	char *result;
+
+	if (run->shared)
+	{
+		if (*socketFD < 0)
+			*socketFD = connectToDaemon(run->address, run->clientName, &version);
+		if (*socketFD < 0 || version != FRAME_VERSION)
+			error("BENCH: ERROR daemon does not accept this client or protocol version 2\n");
+		sharedTransform(*socketFD, segment, &run->text, &run->key);
+		return;
+	}
+
+	result = pipelineTransform(socketFD, run->address, run->clientName, &run->text, &run->key);
+	if (result == NULL)
+		error("BENCH: ERROR daemon does not accept this client or protocol version 2\n");
+	free(result);
+}
+
+/*****************************************************************************
+Client thread, connects with one unmeasured request, then sends requests
+until its time is up and records the latency of each
+*****************************************************************************/
+static void *clientMain(void *arg)
+{
+	struct benchClient *client = arg;
+	struct benchRun *run = client->run;
+	struct sharedSegment segment;
+	int socketFD = -1;
+	double sent;
+	double deadline;
+
+	initSegment(&segment);
+	sendRequest(run, &socketFD, &segment);
+	pthread_barrier_wait(&run->start);
+
+	client->started = now();
+	deadline = client->started + run->duration;
+	do
+	{
+		sent = now();
+		sendRequest(run, &socketFD, &segment);
+		client->finished = now();
+
+		if (client->count == client->capacity)
+		{
+			client->capacity = client->capacity ? client->capacity * 2 : 1024;
+			client->latencies = realloc(client->latencies, client->capacity * sizeof(double));
+			if (client->latencies == NULL)
+				error("BENCH: ERROR allocating latency samples\n");
+		}
+		client->latencies[client->count++] = client->finished - sent;
+	} while (client->finished < deadline);
+
+	close(socketFD);
+	freeSegment(&segment);
+	return NULL;
+}
+
+static int compareDoubles(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/*****************************************************************************
+Returns the nearest rank percentile of sorted samples, in microseconds
+*****************************************************************************/
+static double percentile(const double *sorted, size_t count, double fraction)
+{
+	size_t rank = (size_t)(fraction * count + 0.999999);
+	if (rank < 1)
+		rank = 1;
+	return sorted[rank - 1] * 1e6;
+}
+
+/*****************************************************************************
+Parses a size such as 16, 64K, 1M or 1G
+*****************************************************************************/
+static size_t parseSize(const char *text)
+{
+	char *end;
+	size_t size = strtoull(text, &end, 10);
+
+	if (*end == 'K' || *end == 'k')
+		size <<= 10;
+	else if (*end == 'M' || *end == 'm')
+		size <<= 20;
+	else if (*end == 'G' || *end == 'g')
+		size <<= 30;
+	return size;
+}
+
+/*****************************************************************************
+Splits a comma separated list of sizes, returns how many were found
+*****************************************************************************/
+static int parseList(char *list, size_t *values)
+{
+	int count = 0;
+	char *item;
+
+	for (item = strtok(list, ","); item != NULL && count < MAXRUNS; item = strtok(NULL, ","))
+		values[count++] = parseSize(item);
+	return count;
+}
+
+/*****************************************************************************
+Fills a buffer with random uppercase letters and spaces
+*****************************************************************************/
+static char *randomText(size_t length)
+{
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+	char *text = malloc(length + 1);
+	size_t i;
+
+	if (text == NULL)
+		error("BENCH: ERROR allocating message\n");
+	for (i = 0; i < length; i++)
+		text[i] = alphabet[rand() % 27];
+	text[length] = '\0';
+	return text;
+}
+
+/*****************************************************************************
+Runs one size and concurrency combination and prints its line of results
+*****************************************************************************/
+static void measure(struct benchRun *run, int concurrency, int json, int first)
+{
+	struct benchClient *clients = calloc(concurrency, sizeof(struct benchClient));
+	pthread_t *threads = malloc(concurrency * sizeof(pthread_t));
+	double *samples;
+	size_t total = 0;
+	double started, finished, elapsed;
+	double p50, p99, p999;
+	int i;
+
+	if (clients == NULL || threads == NULL)
+		error("BENCH: ERROR allocating clients\n");
+	pthread_barrier_init(&run->start, NULL, concurrency);
+	for (i = 0; i < concurrency; i++)
+	{
+		clients[i].run = run;
+		if (pthread_create(&threads[i], NULL, clientMain, &clients[i]))
+			error("BENCH: ERROR creating client thread\n");
+	}
+	for (i = 0; i < concurrency; i++)
+		pthread_join(threads[i], NULL);
+	pthread_barrier_destroy(&run->start);
+
+	//the run lasts from the first client starting to the last one finishing
+	started = clients[0].started;
+	finished = clients[0].finished;
+	for (i = 0; i < concurrency; i++)
+	{
+		total += clients[i].count;
+		if (clients[i].started < started)
+			started = clients[i].started;
+		if (clients[i].finished > finished)
+			finished = clients[i].finished;
+	}
+	elapsed = finished - started;
+
+	samples = malloc(total * sizeof(double));
+	if (samples == NULL)
+		error("BENCH: ERROR allocating latency samples\n");
+	total = 0;
+	for (i = 0; i < concurrency; i++)
+	{
+		memcpy(samples + total, clients[i].latencies, clients[i].count * sizeof(double));
+		total += clients[i].count;
+		free(clients[i].latencies);
+	}
+	qsort(samples, total, sizeof(double), compareDoubles);
+	p50 = percentile(samples, total, 0.50);
+	p99 = percentile(samples, total, 0.99);
+	p999 = percentile(samples, total, 0.999);
+
+	if (json)
+		printf("%s\n  {\"size\": %zu, \"concurrency\": %d, \"requests\": %zu, \"seconds\": %.3f, "
+			"\"requests_per_sec\": %.1f, \"mb_per_sec\": %.2f, \"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f}",
+			first ? "" : ",", run->text.length, concurrency, total, elapsed,
+			total / elapsed, total * run->text.length / elapsed / 1e6, p50, p99, p999);
+	else
+		printf("%zu,%d,%zu,%.3f,%.1f,%.2f,%.1f,%.1f,%.1f\n", run->text.length, concurrency, total, elapsed,
+			total / elapsed, total * run->text.length / elapsed / 1e6, p50, p99, p999);
+	fflush(stdout);
+
+	free(samples);
+	free(threads);
+	free(clients);
+}
+
+/*****************************************************************************
+Main Driver for program
+*****************************************************************************/
+int main(int argc, char *argv[])
+{
+	struct benchRun run;
+	char defaultSizes[] = "16,1K,64K,1M,16M";
+	char defaultConcurrency[] = "1,4,16,64";
+	char *sizeList = defaultSizes;
+	char *concurrencyList = defaultConcurrency;
+	size_t sizes[MAXRUNS], concurrency[MAXRUNS];
+	int sizeCount, concurrencyCount;
+	int json = 0;
+	int badUsage = 0;
+	int first = 1;
+	int opt;
+	int i, j;
+
+	memset(&run, '\0', sizeof(run));
+	run.clientName = "OTP_ENC";
+	run.duration = 2;
+	while ((opt = getopt(argc, argv, "c:s:n:d:f:Sz")) != -1)
+	{
+		if (opt == 'c')
+			run.clientName = optarg;
+		else if (opt == 's')
+			sizeList = optarg;
+		else if (opt == 'n')
+			concurrencyList = optarg;
+		else if (opt == 'd')
+			run.duration = atof(optarg);
+		else if (opt == 'f' && (!strcmp(optarg, "csv") || !strcmp(optarg, "json")))
+			json = !strcmp(optarg, "json");
+		else if (opt == 'S')
+			run.shared = 1;
+		else if (opt == 'z')
+			packedWire = 1;
+		else
+			badUsage = 1;
+	}
+	sizeCount = parseList(sizeList, sizes);
+	concurrencyCount = parseList(concurrencyList, concurrency);
+	for (i = 0; i < concurrencyCount; i++)
+	{
+		if (concurrency[i] < 1)
+			badUsage = 1;
+	}
+	if (badUsage || sizeCount == 0 || concurrencyCount == 0 || run.duration <= 0 || optind != argc - 1)
+	{
+		fprintf(stderr, "USAGE: %s [-c client name] [-s sizes] [-n concurrencies] [-d seconds] [-f csv|json] [-S] [-z] address\n", argv[0]);
+		exit(1);
+	}
+	run.address = argv[optind];
+
+	if (json)
+		printf("[");
+	else
+		printf("size,concurrency,requests,seconds,requests_per_sec,mb_per_sec,p50_us,p99_us,p999_us\n");
+
+	for (i = 0; i < sizeCount; i++)
+	{
+		//the same message is sent by every client, any key works for either direction
+		run.text.data = randomText(sizes[i]);
+		run.text.length = sizes[i];
+		run.key.data = randomText(sizes[i]);
+		run.key.length = sizes[i];
+		for (j = 0; j < concurrencyCount; j++)
+		{
+			measure(&run, concurrency[j], json, first);
+			first = 0;
+		}
+		free((char *)run.text.data);
+		free((char *)run.key.data);
+	}
+
+	if (json)
+		printf("\n]\n");
+	return 0;
+}
@@ -0,0 +1,43 @@
+/*****************************************************************************
+otp_daemon.c
+
+Description: Runs as a single server daemon for both clients. The handshake
+name picks the operation for the connection: OTP_ENC clients have their
+plaintext encrypted and OTP_DEC clients have their ciphertext decrypted.
+Replaces running encrypt_daemon and decrypt_daemon side by side, with one
+listening socket and one set of workers.
+
+The server modes and options are shared with the other daemons, see server.c.
+*****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cipher.h"
+#include "server.h"
+
+/*****************************************************************************
+Global Variables + Function Prototypes
+*****************************************************************************/
+void error(const char *msg)
+{
+	perror(msg);
+	exit(1);
+} // Error function used for reporting issues
+
+int debug = 0;
+
+static const struct sessionService services[] = {
+	{"OTP_ENC", cipherEncrypt},
+	{"OTP_DEC", cipherDecrypt}
+};
+
+/*****************************************************************************
+Main Driver
+*****************************************************************************/
+int main(int argc, char *argv[])
+{
+	runDaemon(argc, argv, services, sizeof(services) / sizeof(services[0]));
+	return 0;
+}
@@ -0,0 +1,432 @@
+/*****************************************************************************
+otp_microbench.c
+
+Description: Microbenchmarks for the hot loops shared by the clients and
+daemons, run in isolation from the network: the cipher and XOR kernels,
+the character conversions, alphabet validation, packing text for the wire,
+batches through libotp, loading a text file and sending messages and
+frames over a socketpair.
+Every benchmark runs at several sizes and reports ns/byte and cycles/byte
+as CSV. Cycles are TSC ticks, and are reported as 0 where no cycle counter
+is available.
+
+Intended Usage:
+otp_microbench [-s sizes] [-t seconds per measurement]
+*****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "protocol.h"
+#include "cipher.h"
+#include "client.h"
+#include "csprng.h"
+#include "otp.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define readCycles() __rdtsc()
+#else
+#define readCycles() 0
+#endif
+
+#define MAXSIZES 32
+
+/*****************************************************************************
+Global Variables + Function Prototypes
+*****************************************************************************/
+void error(const char *msg) { fprintf(stderr, msg); exit(2); } // Error function used for reporting issues
+
+int debug = 0;
+
+/*****************************************************************************
+Buffers shared by every benchmark, large enough for the biggest size
+*****************************************************************************/
+struct benchData
+{
+	char *text;
+	char *key;
+	char *out;
+	unsigned char *packed;
+	int sockets[2];
+	char fileName[64];
+	size_t size;
+	size_t iterations;
+	size_t sink;
+};
+
+typedef void (*benchFunction)(struct benchData *data);
+
+struct benchmark
+{
+	const char *name;
+	benchFunction run;
+};
+
+static double now()
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static void benchEncrypt(struct benchData *data)
+{
+	size_t i;
+	for (i = 0; i < data->iterations; i++)
+		cipherEncrypt(data->out, data->text, data->key, data->size);
+}
+
+static void benchDecrypt(struct benchData *data)
+{
+	size_t i;
+	for (i = 0; i < data->iterations; i++)
+		cipherDecrypt(data->out, data->text, data->key, data->size);
+}
+
+static void benchEncryptScalar(struct benchData *data)
+{
+	size_t i;
+	for (i = 0; i < data->iterations; i++)
+		cipherTransformScalar(data->out, data->text, data->key, data->size, 0);
+}
+
+static void benchXor(struct benchData *data)
+{
+	size_t i;
+	for (i = 0; i < data->iterations; i++)
+		cipherXor(data->out, data->text, data->key, data->size);
+}
+
+static void benchXorScalar(struct benchData *data)
+{
+	size_t i;
+	for (i = 0; i < data->iterations; i++)
+		cipherXorScalar(data->out, data->text, data->key, data->size);
+}
+
+/*****************************************************************************
+Encrypts the text as a libotp batch of 64 byte records, validation included
+*****************************************************************************/
+static void benchOtpBatch(struct benchData *data)
+{
+	size_t count = (data->size + 63) / 64;
+	struct otpBuffer *buffers = malloc(count * sizeof(struct otpBuffer));
+	size_t i, offset;
+
+	if (buffers == NULL)
+		error("MICROBENCH: ERROR allocating batch\n");
+	for (i = 0, offset = 0; i < count; i++, offset += 64)
+	{
+		buffers[i].out = data->out + offset;
+		buffers[i].message = data->text + offset;
+		buffers[i].key = data->key + offset;
+		buffers[i].length = data->size - offset < 64 ? data->size - offset : 64;
+	}
+	for (i = 0; i < data->iterations; i++)
+		data->sink += otpTransformBatch(OTP_ENCRYPT, buffers, count);
+	free(buffers);
+}
+
+/*****************************************************************************
+Maps every character to its number and back, as the original cipher did
+*****************************************************************************/
+static void benchCharConversion(struct benchData *data)
+{
+	size_t i, j;
+	for (i = 0; i < data->iterations; i++)
+	{
+		for (j = 0; j < data->size; j++)
+			data->out[j] = cipherIntToChar(cipherCharToInt(data->text[j]));
+	}
+}
+
+static void benchScan(struct benchData *data)
+{
+	size_t i;
+	for (i = 0; i < data->iterations; i++)
+		data->sink += cipherScanText(data->text, data->size);
+}
+
+static void benchScanScalar(struct benchData *data)
+{
+	size_t i;
+	for (i = 0; i < data->iterations; i++)
+		data->sink += cipherScanScalar(data->text, data->size);
+}
+
+static void benchPack(struct benchData *data)
+{
+	size_t i;
+	for (i = 0; i < data->iterations; i++)
+		data->sink += cipherPack(data->packed, data->text, data->size);
+}
+
+static void benchPackScalar(struct benchData *data)
+{
+	size_t i;
+	for (i = 0; i < data->iterations; i++)
+		data->sink += cipherPackScalar(data->packed, data->text, data->size);
+}
+
+/*****************************************************************************
+Unpacks the text packed by the pack benchmarks, which run first
+*****************************************************************************/
+static void benchUnpack(struct benchData *data)
+{
+	size_t i;
+	for (i = 0; i < data->iterations; i++)
+		data->sink += cipherUnpack(data->out, data->packed, cipherPackedLength(data->size));
+}
+
+static void benchUnpackScalar(struct benchData *data)
+{
+	size_t i;
+	for (i = 0; i < data->iterations; i++)
+		data->sink += cipherUnpackScalar(data->out, data->packed, cipherPackedLength(data->size));
+}
+
+/*****************************************************************************
+Opens, validates and releases a text file, which stays in the page cache
+*****************************************************************************/
+static void benchOpenTextFile(struct benchData *data)
+{
+	struct textFile file;
+	size_t i;
+
+	for (i = 0; i < data->iterations; i++)
+	{
+		openTextFile(&file, data->fileName);
+		data->sink += file.length;
+		closeTextFile(&file);
+	}
+}
+
+static void benchKeyChars(struct benchData *data)
+{
+	struct csprng rng;
+	unsigned char seed[CSPRNG_SEED_SIZE] = {0};
+	size_t i;
+
+	csprngInit(&rng, seed, 0);
+	for (i = 0; i < data->iterations; i++)
+		csprngKeyChars(&rng, data->out, data->size);
+}
+
+/*****************************************************************************
+Peer for the socket benchmarks, sends every message of a measurement from
+its own thread so neither side waits on a full socket buffer
+*****************************************************************************/
+static void *sendMessages(void *arg)
+{
+	struct benchData *data = arg;
+	size_t i;
+	for (i = 0; i < data->iterations; i++)
+		sendMessage(data->sockets[1], data->text, data->size);
+	return NULL;
+}
+
+static void *sendFrames(void *arg)
+{
+	struct benchData *data = arg;
+	size_t i;
+	for (i = 0; i < data->iterations; i++)
+		sendFrame(data->sockets[1], OP_TEXT, 0, data->text, data->size);
+	return NULL;
+}
+
+/*****************************************************************************
+Receives iterations messages while the peer thread runs the given sender
+*****************************************************************************/
+static void receiveAll(struct benchData *data, void *(*sender)(void *), int framed)
+{
+	struct frameHeader header;
+	pthread_t peer;
+	size_t i;
+
+	if (pthread_create(&peer, NULL, sender, data))
+		error("MICROBENCH: ERROR creating sender thread\n");
+	for (i = 0; i < data->iterations; i++)
+	{
+		if (framed)
+			free(receiveFrame(data->sockets[0], &header));
+		else
+			free(receiveMessage(data->sockets[0]));
+	}
+	pthread_join(peer, NULL);
+}
+
+static void benchMessages(struct benchData *data)
+{
+	receiveAll(data, sendMessages, 0);
+}
+
+static void benchFrames(struct benchData *data)
+{
+	receiveAll(data, sendFrames, 1);
+}
+
+static const struct benchmark benchmarks[] = {
+	{"cipherEncrypt", benchEncrypt},
+	{"cipherDecrypt", benchDecrypt},
+	{"cipherTransformScalar", benchEncryptScalar},
+	{"cipherXor", benchXor},
+	{"cipherXorScalar", benchXorScalar},
+	{"otpTransformBatch", benchOtpBatch},
+	{"cipherCharToInt+cipherIntToChar", benchCharConversion},
+	{"cipherScanText", benchScan},
+	{"cipherScanScalar", benchScanScalar},
+	{"cipherPack", benchPack},
+	{"cipherPackScalar", benchPackScalar},
+	{"cipherUnpack", benchUnpack},
+	{"cipherUnpackScalar", benchUnpackScalar},
+	{"openTextFile", benchOpenTextFile},
+	{"csprngKeyChars", benchKeyChars},
+	{"sendMessage+receiveMessage", benchMessages},
+	{"sendFrame+receiveFrame", benchFrames}
+};
+
+/*****************************************************************************
+Writes the text followed by a newline to a temporary file for the file
+benchmark
+*****************************************************************************/
+static void writeTextFile(struct benchData *data)
+{
+	FILE *file;
+	int fd;
+
+	strcpy(data->fileName, "/tmp/otp_microbench_XXXXXX");
+	fd = mkstemp(data->fileName);
+	file = fd < 0 ? NULL : fdopen(fd, "w");
+	if (file == NULL || fwrite(data->text, 1, data->size, file) != data->size || fputc('\n', file) == EOF || fclose(file) == EOF)
+		error("MICROBENCH: ERROR writing temporary file\n");
+}
+
+/*****************************************************************************
+Runs a benchmark with doubling iteration counts until one run lasts long
+enough to time, then prints its cost per byte
+*****************************************************************************/
+static void measure(const struct benchmark *bench, struct benchData *data, double minTime)
+{
+	double started, elapsed;
+	uint64_t cycles;
+	double bytes;
+
+	data->iterations = 1;
+	while (1)
+	{
+		cycles = readCycles();
+		started = now();
+		bench->run(data);
+		elapsed = now() - started;
+		cycles = readCycles() - cycles;
+		if (elapsed >= minTime)
+			break;
+		data->iterations *= 2;
+	}
+
+	bytes = (double)data->iterations * data->size;
+	printf("%s,%s,%zu,%zu,%.4f,%.4f\n", bench->name, cipherKernelName(), data->size, data->iterations,
+		elapsed * 1e9 / bytes, cycles / bytes);
+	fflush(stdout);
+}
+
+/*****************************************************************************
+Parses a comma separated list of sizes such as 64,4K,1M
+*****************************************************************************/
+static int parseSizes(char *list, size_t *sizes)
+{
+	int count = 0;
+	char *item, *end;
+
+	for (item = strtok(list, ","); item != NULL && count < MAXSIZES; item = strtok(NULL, ","))
+	{
+		sizes[count] = strtoull(item, &end, 10);
+		if (*end == 'K' || *end == 'k')
+			sizes[count] <<= 10;
+		else if (*end == 'M' || *end == 'm')
+			sizes[count] <<= 20;
+		if (sizes[count] > 0)
+			count++;
+	}
+	return count;
+}
+
+/*****************************************************************************
+Main Driver for program
+*****************************************************************************/
+int main(int argc, char *argv[])
+{
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+	struct benchData data;
+	char defaultSizes[] = "64,4K,256K,16M";
+	char *sizeList = defaultSizes;
+	size_t sizes[MAXSIZES];
+	size_t largest = 0;
+	int sizeCount;
+	double minTime = 0.2;
+	int opt;
+	size_t i;
+	int b, s;
+
+	while ((opt = getopt(argc, argv, "s:t:")) != -1)
+	{
+		if (opt == 's')
+			sizeList = optarg;
+		else if (opt == 't')
+			minTime = atof(optarg);
+		else
+			minTime = 0;
+	}
+	sizeCount = parseSizes(sizeList, sizes);
+	if (sizeCount == 0 || minTime <= 0 || optind != argc)
+	{
+		fprintf(stderr, "USAGE: %s [-s sizes] [-t seconds per measurement]\n", argv[0]);
+		exit(1);
+	}
+	for (s = 0; s < sizeCount; s++)
+	{
+		if (sizes[s] > largest)
+			largest = sizes[s];
+	}
+
+	memset(&data, '\0', sizeof(data));
+	data.text = malloc(largest);
+	data.key = malloc(largest);
+	data.out = malloc(largest);
+	data.packed = malloc(cipherPackedLength(largest));
+	if (data.text == NULL || data.key == NULL || data.out == NULL || data.packed == NULL)
+		error("MICROBENCH: ERROR allocating buffers\n");
+	for (i = 0; i < largest; i++)
+	{
+		data.text[i] = alphabet[rand() % MAXCIPHER];
+		data.key[i] = alphabet[rand() % MAXCIPHER];
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, data.sockets) < 0)
+		error("MICROBENCH: ERROR creating socketpair\n");
+
+	printf("benchmark,kernel,size,iterations,ns_per_byte,cycles_per_byte\n");
+	for (s = 0; s < sizeCount; s++)
+	{
+		data.size = sizes[s];
+		writeTextFile(&data);
+		for (b = 0; b < (int)(sizeof(benchmarks) / sizeof(benchmarks[0])); b++)
+			measure(&benchmarks[b], &data, minTime);
+		unlink(data.fileName);
+	}
+
+	close(data.sockets[0]);
+	close(data.sockets[1]);
+	free(data.text);
+	free(data.key);
+	free(data.out);
+	free(data.packed);
+	return 0;
+}
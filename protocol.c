@@ -0,0 +1,313 @@
+/*****************************************************************************
+protocol.c
+
+Description: Blocking send/receive helpers for both wire formats, plus the
+frame header encoding used by the daemon's session state machine. Socket
+errors are reported through the program's error() function.
+*****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "protocol.h"
+
+void error(const char *msg);
+
+/*****************************************************************************
+Writes a 64 bit value into buffer in big endian order
+*****************************************************************************/
+void encodeUint64(unsigned char *buffer, uint64_t value)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		buffer[i] = value >> (56 - 8 * i);
+}
+
+/*****************************************************************************
+Reads a big endian 64 bit value from buffer
+*****************************************************************************/
+uint64_t decodeUint64(const unsigned char *buffer)
+{
+	uint64_t value = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		value = value << 8 | buffer[i];
+	return value;
+}
+
+/*****************************************************************************
+Writes the 16 byte big endian frame header into buffer
+*****************************************************************************/
+void encodeFrameHeader(unsigned char *buffer, int op, int flags, uint64_t length)
+{
+	buffer[0] = FRAME_MAGIC >> 24;
+	buffer[1] = (FRAME_MAGIC >> 16) & 0xFF;
+	buffer[2] = (FRAME_MAGIC >> 8) & 0xFF;
+	buffer[3] = FRAME_MAGIC & 0xFF;
+	buffer[4] = FRAME_VERSION;
+	buffer[5] = op;
+	buffer[6] = flags >> 8;
+	buffer[7] = flags & 0xFF;
+	encodeUint64(buffer + 8, length);
+}
+
+/*****************************************************************************
+Reads a frame header, returns -1 if it is not a version 2 frame
+*****************************************************************************/
+int decodeFrameHeader(const unsigned char *buffer, struct frameHeader *header)
+{
+	header->magic = (uint32_t)buffer[0] << 24 | (uint32_t)buffer[1] << 16 | (uint32_t)buffer[2] << 8 | buffer[3];
+	header->version = buffer[4];
+	header->op = buffer[5];
+	header->flags = (uint16_t)(buffer[6] << 8 | buffer[7]);
+	header->length = decodeUint64(buffer + 8);
+
+	if (header->magic != FRAME_MAGIC || header->version != FRAME_VERSION)
+		return -1;
+	return 0;
+}
+
+/*****************************************************************************
+Sends the whole buffer, looping over partial writes
+Returns -1 on error
+*****************************************************************************/
+int sendAll(int socketFD, const void *buffer, size_t length)
+{
+	ssize_t charsWritten;
+
+	while (length > 0)
+	{
+		charsWritten = send(socketFD, buffer, length, MSG_NOSIGNAL);
+		if (charsWritten < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buffer = (const char *)buffer + charsWritten;
+		length -= charsWritten;
+	}
+	return 0;
+}
+
+/*****************************************************************************
+Receives exactly length bytes straight into buffer
+Returns -1 on error or if the connection closes first
+*****************************************************************************/
+int recvAll(int socketFD, void *buffer, size_t length)
+{
+	ssize_t charsRead;
+
+	while (length > 0)
+	{
+		charsRead = recv(socketFD, buffer, length, MSG_WAITALL);
+		if (charsRead < 0 && errno == EINTR)
+			continue;
+		if (charsRead <= 0)
+			return -1;
+		buffer = (char *)buffer + charsRead;
+		length -= charsRead;
+	}
+	return 0;
+}
+
+/*****************************************************************************
+Receives response from socket, confirms response is an ACK
+*****************************************************************************/
+void recvAck(int socketFD)
+{
+	char *ack = "ACK";
+	char response[ACKSIZE + 1];
+
+	//read exactly one ACK, the peer may send its next message right after
+	memset(response, '\0', sizeof(response));
+	if (recvAll(socketFD, response, ACKSIZE) < 0)
+		error("ERROR reading from socket\n");
+	if (debug)
+		fprintf(stderr, "I received this from the socket: \"%s\"\n", response);
+	if (strcmp(response, ack))
+		error("ERROR Did not receive ACK when expected\n");
+}
+
+/*****************************************************************************
+Sends an ACK on the connected socket, indicates successful receipt of packet
+*****************************************************************************/
+void sendAck(int socketFD)
+{
+	char ack[ACKSIZE] = "ACK";
+	if (sendAll(socketFD, ack, ACKSIZE) < 0)
+		error("ERROR writing to socket\n");
+}
+
+/*****************************************************************************
+Receives a length prefixed message directly into a buffer of that size
+Reports any error
+*****************************************************************************/
+char *receiveMessage(int socketFD)
+{
+	char *message;
+	int messageSize;
+
+	//read in the length of the incoming message
+	if (recvAll(socketFD, &messageSize, sizeof(int)) < 0)
+		error("ERROR reading from socket\n");
+	if (debug)
+		fprintf(stderr, "I received this from the socket: \"%d\"\n", messageSize);
+	if (messageSize < 0)
+		error("ERROR invalid message length\n");
+
+	//allocate a buffer big enough for incoming message and fill it in place
+	message = malloc((sizeof(char) * messageSize) + 1);
+	if (message == NULL)
+		error("ERROR allocating message buffer\n");
+	if (recvAll(socketFD, message, messageSize) < 0)
+		error("ERROR reading from socket\n");
+	message[messageSize] = '\0';
+
+	if (debug)
+		fprintf(stderr, "I received this from the socket: \"%s\"\n", message);
+	return message;
+}
+
+/*****************************************************************************
+Sends the specified message with its INT length prefix
+Reports any error
+*****************************************************************************/
+void sendMessage(int socketFD, const char *message, int messageSize)
+{
+	//send the length of the actual message first as INT, then the message
+	if (sendAll(socketFD, &messageSize, sizeof(int)) < 0 || sendAll(socketFD, message, messageSize) < 0)
+		error("ERROR writing to socket\n");
+}
+
+/*****************************************************************************
+Receives a specified message and sends ack to confirm
+*****************************************************************************/
+char *receiveData(int socketFD)
+{
+	char *data = receiveMessage(socketFD);
+	sendAck(socketFD);
+	return data;
+}
+
+/*****************************************************************************
+Sends a specified message and confirms receipt of entire message
+*****************************************************************************/
+void sendData(int socketFD, const char *message, int length)
+{
+	sendMessage(socketFD, message, length);
+	recvAck(socketFD);
+}
+
+/*****************************************************************************
+Sends every buffer in vec with as few sendmsg calls as possible, looping
+over partial writes. The iovecs are consumed as they are sent.
+Returns -1 on error
+*****************************************************************************/
+int sendVector(int socketFD, struct iovec *vec, int count)
+{
+	struct msghdr msg;
+	ssize_t charsWritten;
+	int index = 0;
+
+	memset(&msg, '\0', sizeof(msg));
+	while (index < count)
+	{
+		msg.msg_iov = &vec[index];
+		msg.msg_iovlen = count - index;
+		charsWritten = sendmsg(socketFD, &msg, MSG_NOSIGNAL);
+		if (charsWritten < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		//skip past whatever was written
+		while (index < count && charsWritten >= (ssize_t)vec[index].iov_len)
+			charsWritten -= vec[index++].iov_len;
+		if (index < count)
+		{
+			vec[index].iov_base = (char *)vec[index].iov_base + charsWritten;
+			vec[index].iov_len -= charsWritten;
+		}
+	}
+	return 0;
+}
+
+/*****************************************************************************
+Sends a version 2 frame, header and payload in one writev
+Reports any error
+*****************************************************************************/
+void sendFrame(int socketFD, int op, int flags, const char *payload, uint64_t length)
+{
+	unsigned char header[FRAME_HEADER_SIZE];
+	struct iovec vec[2];
+
+	encodeFrameHeader(header, op, flags, length);
+	vec[0].iov_base = header;
+	vec[0].iov_len = FRAME_HEADER_SIZE;
+	vec[1].iov_base = (char *)payload;
+	vec[1].iov_len = length;
+
+	if (sendVector(socketFD, vec, 2) < 0)
+		error("ERROR writing to socket\n");
+}
+
+/*****************************************************************************
+Receives a version 2 frame. The payload is allocated once from the length in
+the header and received straight into it. A NUL is appended for convenience.
+*****************************************************************************/
+char *receiveFrame(int socketFD, struct frameHeader *header)
+{
+	unsigned char buffer[FRAME_HEADER_SIZE];
+	char *payload;
+
+	if (recvAll(socketFD, buffer, FRAME_HEADER_SIZE) < 0)
+		error("ERROR reading from socket\n");
+	if (decodeFrameHeader(buffer, header) < 0)
+		error("ERROR received a malformed frame\n");
+	if (debug)
+		fprintf(stderr, "I received frame op %d with %llu bytes\n", header->op, (unsigned long long)header->length);
+	if (header->length >= SIZE_MAX)
+		error("ERROR frame is too large\n");
+
+	payload = malloc(header->length + 1);
+	if (payload == NULL)
+		error("ERROR allocating frame buffer\n");
+	if (recvAll(socketFD, payload, header->length) < 0)
+		error("ERROR reading from socket\n");
+	payload[header->length] = '\0';
+	return payload;
+}
+
+/*****************************************************************************
+Receives a frame that must carry the given op. An ERROR frame from the peer
+is reported as is.
+*****************************************************************************/
+char *receiveFrameOp(int socketFD, int op, uint64_t *length)
+{
+	struct frameHeader header;
+	char *payload = receiveFrame(socketFD, &header);
+
+	//the reason is peer supplied, never use it as a format string
+	if (header.op == OP_ERROR)
+	{
+		fprintf(stderr, "%s\n", payload);
+		error("ERROR request failed\n");
+	}
+	if (header.op != op)
+		error("ERROR received an unexpected frame\n");
+	if (length != NULL)
+		*length = header.length;
+	return payload;
+}
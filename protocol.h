@@ -0,0 +1,148 @@
+/*****************************************************************************
+protocol.h
+
+Description: Wire formats shared by the clients and daemons.
+
+Version 1 (legacy) sends each message as a host order INT length followed
+by the characters, and confirms each message with an ACK.
+
+Version 2 is negotiated during the version 1 handshake: the client sends
+"<CLIENT>/2" and the daemon answers "ACCEPT/2". Every later message is a
+frame made of a fixed 16 byte header followed by the payload:
+
+	magic (4) | version (1) | op (1) | flags (2) | length (8)
+
+All header fields are big endian. Payloads are received directly into
+their final buffer and are never NUL scanned.
+
+A version 2 request is either a TEXT frame and a KEY frame answered by one
+RESULT frame, or a stream: any number of CHUNK frames, each carrying n text
+characters followed by the matching n key characters, answered one RESULT
+frame per chunk, and closed by an END frame in each direction.
+
+Normally the TEXT and KEY frames and the RESULT frame are each confirmed with
+an ACK frame. A TEXT frame flagged NOACK turns those ACKs off for the whole
+request, so a client may send its handshake, TEXT and KEY back to back and
+read ACCEPT/2 followed by a single RESULT or ERROR frame.
+
+Keys can be stored on the daemon: a KEY_UPLOAD frame carrying a key is
+answered with a KEY_ID frame holding its 8 byte ID. A request may then send
+a KEYREF frame of an ID and an 8 byte offset into that key instead of KEY.
+
+Clients on a Unix socket may hand the daemon a shared memory segment: a
+memfd sealed against shrinking, passed with SCM_RIGHTS alongside an empty
+SHM_MAP frame and answered with an ACK. A SHM_REQUEST frame then names the
+text, key and result offsets in the segment and the length to transform;
+the daemon transforms straight from and into the segment, in place if the
+result and text offsets are equal, and answers with an empty SHM_DONE.
+
+Many short records can be sent as one request by replacing the TEXT frame
+with a BATCH frame:
+
+	count (8) | count x (key offset (8) | length (8)) | records
+
+The records follow the entry table back to back. Each is transformed with
+the key characters starting at its key offset in the KEY frame, or in the
+stored key from the KEYREF offset on, and the RESULT frame holds the
+transformed records back to back in the same order.
+
+A client that sends "<CLIENT>/2p" and is answered "ACCEPT/2p" uses version
+2 with packed text: the characters of TEXT, KEY, KEY_UPLOAD, CHUNK and
+RESULT payloads, and the records of a BATCH after its entry table, are sent
+at 5 bits each as laid out by cipherPack(). A CHUNK is packed as a whole,
+text and key together. Frame lengths count the bytes sent, while batch
+entries and KEYREF offsets still count characters.
+
+A client that sends "<CLIENT>/2b" and is answered "ACCEPT/2b" uses version
+2 in binary mode: texts and keys are arbitrary bytes and every transform is
+an XOR with the key, whichever client name was given. Frames are otherwise
+unchanged; binary payloads are never packed.
+*****************************************************************************/
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+// Legacy peers send sizeof(ack) bytes where ack is a char *
+#define ACKSIZE sizeof(char *)
+
+#define FRAME_MAGIC 0x4F545032
+#define FRAME_VERSION 2
+#define FRAME_HEADER_SIZE 16
+#define VERSION_SUFFIX "/2"
+#define ACCEPT_V2 "ACCEPT/2"
+#define VERSION_SUFFIX_PACKED "/2p"
+#define ACCEPT_PACKED "ACCEPT/2p"
+#define VERSION_SUFFIX_BINARY "/2b"
+#define ACCEPT_BINARY "ACCEPT/2b"
+
+// Frame flags
+#define FLAG_NOACK 0x0001
+
+// Largest chunk a daemon accepts and the chunk size clients stream with
+#define MAXCHUNK (1 << 20)
+#define STREAMCHUNK (1 << 16)
+
+// KEYREF payload, key ID then offset
+#define KEYREF_SIZE 16
+
+// SHM_REQUEST payload, text, key and result offsets then the length
+#define SHM_REQUEST_SIZE 32
+
+// BATCH payload, the record count then one entry per record
+#define BATCH_COUNT_SIZE 8
+#define BATCH_ENTRY_SIZE 16
+
+extern int debug;
+
+enum frameOp
+{
+	OP_TEXT = 1,
+	OP_KEY = 2,
+	OP_RESULT = 3,
+	OP_ACK = 4,
+	OP_ERROR = 5,
+	OP_CHUNK = 6,
+	OP_END = 7,
+	OP_KEY_UPLOAD = 8,
+	OP_KEY_ID = 9,
+	OP_KEYREF = 10,
+	OP_SHM_MAP = 11,
+	OP_SHM_REQUEST = 12,
+	OP_SHM_DONE = 13,
+	OP_BATCH = 14
+};
+
+struct frameHeader
+{
+	uint32_t magic;
+	uint8_t version;
+	uint8_t op;
+	uint16_t flags;
+	uint64_t length;
+};
+
+void encodeUint64(unsigned char *buffer, uint64_t value);
+uint64_t decodeUint64(const unsigned char *buffer);
+void encodeFrameHeader(unsigned char *buffer, int op, int flags, uint64_t length);
+int decodeFrameHeader(const unsigned char *buffer, struct frameHeader *header);
+
+int sendAll(int socketFD, const void *buffer, size_t length);
+int recvAll(int socketFD, void *buffer, size_t length);
+int sendVector(int socketFD, struct iovec *vec, int count);
+
+void recvAck(int socketFD);
+void sendAck(int socketFD);
+char *receiveMessage(int socketFD);
+void sendMessage(int socketFD, const char *message, int messageSize);
+char *receiveData(int socketFD);
+void sendData(int socketFD, const char *message, int length);
+
+void sendFrame(int socketFD, int op, int flags, const char *payload, uint64_t length);
+char *receiveFrame(int socketFD, struct frameHeader *header);
+char *receiveFrameOp(int socketFD, int op, uint64_t *length);
+
+#endif
@@ -0,0 +1,277 @@
+/*****************************************************************************
+server.c
+
+Description: Daemon startup shared by every daemon binary. Parses the
+command line, opens the listening socket and runs the selected server mode:
+an epoll event loop (default), an io_uring loop that falls back to epoll on
+kernels without it, a pool of worker processes or threads, or the
+original fork per connection model, which handles up to 5 connections at a
+time. -k enables the key store in the given directory, keeping up to -c
+megabytes of keys mapped. -M serves metrics on a local port or Unix socket.
+Daemons listen on a TCP port, a Unix socket path or an abstract socket name.
+Messages of at least -T kilobytes are transformed by a pool of -p threads.
+Texts, keys, uploaded keys and batches over -L megabytes are refused.
+-d sets how many microseconds a legacy client's result waits after its key
+ACK.
+The daemons only differ in the services they pass in.
+*****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <sys/wait.h>
+
+#include "server.h"
+#include "event_loop.h"
+#include "uring_loop.h"
+#include "worker_pool.h"
+#include "keystore.h"
+#include "metrics.h"
+#include "address.h"
+#include "transform_pool.h"
+
+#define MAXCON 5
+
+void error(const char *msg);
+
+struct pidArray
+{
+	pid_t data[MAXCON];
+	int count;
+};
+
+static struct pidArray backgroundPIDs;
+
+/*****************************************************************************
+Sets the global background PID array to all 0s and count to 0
+*****************************************************************************/
+static void initBackgroundPIDs()
+{
+	int i;
+	for (i = 0; i < MAXCON; i++)
+		backgroundPIDs.data[i] = 0;
+	backgroundPIDs.count = 0;
+}
+
+/*****************************************************************************
+Stops counting a reaped child as a worker, unless it did so itself by
+exiting cleanly
+*****************************************************************************/
+static void childFinished(int childExitMethod)
+{
+	if (!WIFEXITED(childExitMethod) || WEXITSTATUS(childExitMethod) != 0)
+		metricsAdd(METRIC_WORKERS, -1);
+}
+
+/*****************************************************************************
+Loops through all running background processes, reap any zombies
+*****************************************************************************/
+static void reapZombies()
+{
+	int i;
+	for (i = 0; i < backgroundPIDs.count; i++)
+	{
+		int childExitMethod = -5;
+		//if process completed, print data and remove data from array
+		if (waitpid(backgroundPIDs.data[i], &childExitMethod, WNOHANG))
+		{
+			backgroundPIDs.data[i] = backgroundPIDs.data[backgroundPIDs.count - 1];
+			backgroundPIDs.count--;
+			childFinished(childExitMethod);
+			i--;
+		}
+	}
+}
+
+/*****************************************************************************
+Blocks until a connection slot is free when MAXCON children are running
+*****************************************************************************/
+static void waitForSlot()
+{
+	int i;
+	pid_t finished;
+	int childExitMethod = -5;
+
+	while (backgroundPIDs.count >= MAXCON)
+	{
+		finished = waitpid(-1, &childExitMethod, 0);
+		if (finished < 0)
+			error("ERROR waiting for child");
+		for (i = 0; i < backgroundPIDs.count; i++)
+		{
+			if (backgroundPIDs.data[i] == finished)
+			{
+				backgroundPIDs.data[i] = backgroundPIDs.data[backgroundPIDs.count - 1];
+				backgroundPIDs.count--;
+				childFinished(childExitMethod);
+				break;
+			}
+		}
+	}
+}
+
+/*****************************************************************************
+Creates a listening socket on the specified port, Unix socket path or
+abstract name
+Used by parent process to listen for incoming connections
+*****************************************************************************/
+static int createListenSocket(const char *address)
+{
+	int listenSocketFD;
+	struct sockaddr_storage serverAddress;
+	socklen_t addressLength;
+
+	//setup socket struct for server
+	if (parseAddress(address, INADDR_ANY, &serverAddress, &addressLength) < 0)
+		error("ERROR invalid address");
+	removeStaleSocket(&serverAddress);
+
+	// Set up the socket and report error if needed
+	listenSocketFD = socket(serverAddress.ss_family, SOCK_STREAM, 0);
+	if (listenSocketFD < 0)
+		error("ERROR opening socket");
+
+	// Enable the socket to begin listening, queueing as many connections as allowed
+	if (bind(listenSocketFD, (struct sockaddr *)&serverAddress, addressLength) < 0)
+		error("ERROR on binding");
+	listen(listenSocketFD, SOMAXCONN);
+
+	return listenSocketFD;
+}
+
+/*****************************************************************************
+Creates an connection socket for each client. Managed by child processes.
+*****************************************************************************/
+static void processClient(int listenSocketFD, const struct sessionConfig *config)
+{
+	int establishedConnectionFD;
+	socklen_t sizeOfClientInfo;
+	struct sockaddr_storage clientAddress;
+
+	//clean up any finished connections, wait for one if all slots are taken
+	reapZombies();
+	waitForSlot();
+
+	// Accept a connection, blocking if one is not available until one connects
+	sizeOfClientInfo = sizeof(clientAddress);
+	establishedConnectionFD = accept(listenSocketFD, (struct sockaddr *)&clientAddress, &sizeOfClientInfo);
+	if (establishedConnectionFD < 0)
+		error("ERROR on accept");
+
+	pid_t spawnPid = -5;
+	spawnPid = fork();
+	switch (spawnPid)
+	{
+	//error when forking
+	case -1:
+		fprintf(stderr, "MAJOR FORK ERROR, ABORT ABORT! \n");
+		exit(1);
+		break;
+
+	//Child Fork
+	case 0:
+		//serve the client's requests, if client is allowed
+		serveSession(establishedConnectionFD, config);
+		//children are only reaped when the next client arrives, so count down here
+		metricsAdd(METRIC_WORKERS, -1);
+		exit(0);
+		break;
+
+	//Parent fork, store data of current connection for future reaping
+	default:
+		backgroundPIDs.data[backgroundPIDs.count] = spawnPid;
+		backgroundPIDs.count++;
+		metricsAdd(METRIC_WORKERS, 1);
+		close(establishedConnectionFD);
+		break;
+	}
+}
+
+/*****************************************************************************
+Runs a daemon offering the given services. Never returns.
+*****************************************************************************/
+void runDaemon(int argc, char *argv[], const struct sessionService *services, int serviceCount)
+{
+	int listenSocketFD;
+	char *mode = "epoll";
+	int workers = sysconf(_SC_NPROCESSORS_ONLN);
+	char *keyDirectory = NULL;
+	char *metricsAddress = NULL;
+	int keyCache = DEFAULT_KEY_CACHE;
+	int transformThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	int parallelThreshold = DEFAULT_PARALLEL_THRESHOLD;
+	int maxMessage = DEFAULT_MAX_MESSAGE;
+	int badUsage = 0;
+	int opt;
+	struct sessionConfig config = {services, serviceCount, DEFAULT_IDLE_TIMEOUT, 0, DEFAULT_LEGACY_DELAY};
+	initBackgroundPIDs();
+
+	while ((opt = getopt(argc, argv, "m:w:t:k:c:M:p:T:L:d:")) != -1)
+	{
+		if (opt == 'm')
+			mode = optarg;
+		else if (opt == 'w')
+			workers = atoi(optarg);
+		else if (opt == 't')
+			config.idleTimeout = atoi(optarg);
+		else if (opt == 'k')
+			keyDirectory = optarg;
+		else if (opt == 'c')
+			keyCache = atoi(optarg);
+		else if (opt == 'M')
+			metricsAddress = optarg;
+		else if (opt == 'p')
+			transformThreads = atoi(optarg);
+		else if (opt == 'T')
+			parallelThreshold = atoi(optarg);
+		else if (opt == 'L')
+			maxMessage = atoi(optarg);
+		else if (opt == 'd')
+			config.legacyDelay = atoi(optarg);
+		else
+			badUsage = 1;
+	}
+	if (strcmp(mode, "epoll") && strcmp(mode, "uring") && strcmp(mode, "process") && strcmp(mode, "thread") && strcmp(mode, "fork"))
+		badUsage = 1;
+	if (badUsage || workers < 1 || config.idleTimeout < 0 || keyCache < 0 || transformThreads < 0 || parallelThreshold < 1 || maxMessage < 1 || config.legacyDelay < 0 || optind != argc - 1)
+	{
+		fprintf(stderr, "USAGE: %s [-m epoll|uring|process|thread|fork] [-w workers] [-t idle seconds] [-k key directory] [-c key cache MB] [-M metrics address] [-p transform threads] [-T parallel threshold KB] [-L max message MB] [-d legacy delay us] address\n", argv[0]);
+		exit(1);
+	}
+	config.maxMessage = (size_t)maxMessage << 20;
+	transformPoolInit(transformThreads, (size_t)parallelThreshold << 10);
+
+	if (keyDirectory != NULL)
+		keyStoreInit(keyDirectory, (size_t)keyCache << 20);
+
+	//the metrics table is shared, so it must exist before any worker starts
+	if (metricsAddress != NULL)
+	{
+		metricsInit();
+		metricsServe(metricsAddress);
+	}
+
+	listenSocketFD = createListenSocket(argv[optind]);
+
+	//an event loop is the one worker; pools and forked children count themselves
+	if (!strcmp(mode, "epoll") || !strcmp(mode, "uring"))
+		metricsAdd(METRIC_WORKERS, 1);
+	if (!strcmp(mode, "uring") && runUringLoop(listenSocketFD, &config) < 0)
+	{
+		fprintf(stderr, "io_uring is not available, using epoll\n");
+		mode = "epoll";
+	}
+	if (!strcmp(mode, "epoll"))
+		runEventLoop(listenSocketFD, &config);
+	if (strcmp(mode, "fork"))
+		runWorkerPool(listenSocketFD, &config, workers, !strcmp(mode, "thread"));
+	while (1)
+	{
+		processClient(listenSocketFD, &config);
+	}
+}
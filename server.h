@@ -0,0 +1,15 @@
+/*****************************************************************************
+server.h
+
+Description: Common daemon entry point. A daemon is defined by the client
+names it accepts in the handshake and the transform each one selects.
+*****************************************************************************/
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "session.h"
+
+void runDaemon(int argc, char *argv[], const struct sessionService *services, int serviceCount);
+
+#endif
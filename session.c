@@ -0,0 +1,1094 @@
+/*****************************************************************************
+session.c
+
+Description: Implements the daemon side of the OTP protocol as a state
+machine. The client handshake, text, key and final ACK are each read into
+their own buffers, framed either as legacy INT length messages or version 2
+frames; responses are queued and flushed with sendmsg(). Version 2 clients
+may instead stream CHUNK frames, each answered as soon as it is transformed,
+upload keys to the key store and refer to stored keys instead of sending them.
+Clients on a Unix socket may instead pass a shared memory segment and have
+their requests transformed inside it without copying. A BATCH frame carries
+many records in place of the TEXT frame, all answered in one RESULT frame.
+Version 2 connections are kept alive: once a request is answered the
+session waits for the next one, until the client closes the connection.
+Results are written over the received text and sent straight from it, and
+receive buffers are recycled through a small per-thread arena, so steady
+state requests do not touch the heap. Very large texts are transformed by
+the shared transform pool, slice by slice as their key arrives; event loop
+drivers are told when the pool is done instead of waiting for it. Clients may
+negotiate packed text, which is unpacked once received and packed again in
+place before it is sent, or binary mode, which XORs arbitrary bytes.
+sessionPump() performs as much I/O as the socket allows and reports whether
+it is waiting to read, waiting to write, or finished.
+*****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#include "session.h"
+#include "cipher.h"
+#include "keystore.h"
+#include "metrics.h"
+
+/*****************************************************************************
+Protocol phases, named after what the session is waiting for
+*****************************************************************************/
+enum sessionState
+{
+	STATE_HANDSHAKE,
+	STATE_TEXT,
+	STATE_KEY,
+	STATE_LEGACY_KEY_ACK,
+	STATE_TRANSFORM,
+	STATE_RESULT,
+	STATE_RESULT_ACK,
+	STATE_LEGACY_ACK,
+	STATE_STREAM,
+	STATE_FINISHED,
+	STATE_CLOSING
+};
+
+// Buffers each thread keeps between requests, and the largest it keeps
+#define ARENA_SLOTS 4
+#define ARENA_MAX_KEEP (64 << 20)
+
+static const char ackMessage[ACKSIZE] = "ACK";
+
+//each worker thread, or the single event loop thread, has its own arena
+static __thread struct sessionBuffer arena[ARENA_SLOTS];
+
+static enum sessionStatus failRequest(struct session *s, char *reason);
+static void releaseStoredKey(struct session *s);
+
+/*****************************************************************************
+Hands a buffer back to the thread's arena. The largest buffers are kept,
+anything that does not fit is freed.
+*****************************************************************************/
+static void arenaGive(struct sessionBuffer *buffer)
+{
+	struct sessionBuffer *smallest = &arena[0];
+	int i;
+
+	if (buffer->data == NULL)
+		return;
+	for (i = 1; i < ARENA_SLOTS; i++)
+	{
+		if (arena[i].size < smallest->size)
+			smallest = &arena[i];
+	}
+	if (buffer->size <= ARENA_MAX_KEEP && buffer->size > smallest->size)
+	{
+		free(smallest->data);
+		*smallest = *buffer;
+	}
+	else
+	{
+		free(buffer->data);
+	}
+	buffer->data = NULL;
+	buffer->size = 0;
+}
+
+/*****************************************************************************
+Makes buffer hold at least size bytes, swapping in the smallest arena buffer
+that is large enough before falling back to realloc()
+Returns the buffer's memory, or NULL if it could not be allocated
+*****************************************************************************/
+static char *arenaTake(struct sessionBuffer *buffer, size_t size)
+{
+	struct sessionBuffer *best = NULL;
+	struct sessionBuffer swap;
+	char *data;
+	int i;
+
+	if (buffer->size >= size)
+		return buffer->data;
+	for (i = 0; i < ARENA_SLOTS; i++)
+	{
+		if (arena[i].size >= size && (best == NULL || arena[i].size < best->size))
+			best = &arena[i];
+	}
+	if (best != NULL)
+	{
+		swap = *best;
+		*best = *buffer;
+		*buffer = swap;
+		return buffer->data;
+	}
+
+	//nothing in the old contents is needed, so free rather than copy it
+	free(buffer->data);
+	buffer->data = NULL;
+	buffer->size = 0;
+	data = malloc(size);
+	if (data == NULL)
+		return NULL;
+	buffer->data = data;
+	buffer->size = size;
+	return data;
+}
+
+/*****************************************************************************
+Points the session at the next block of bytes it must receive
+*****************************************************************************/
+static void expectInput(struct session *s, char *buffer, size_t length)
+{
+	s->inBuf = buffer;
+	s->inWant = length;
+	s->inHave = 0;
+}
+
+/*****************************************************************************
+Begins receiving the next message, starting with its INT length prefix or
+its frame header depending on the protocol version
+*****************************************************************************/
+static void expectMessage(struct session *s, int state)
+{
+	s->state = state;
+	s->haveLength = 0;
+	if (s->version == FRAME_VERSION)
+		expectInput(s, (char *)s->inHeader, FRAME_HEADER_SIZE);
+	else
+		expectInput(s, (char *)&s->legacyLength, sizeof(int));
+}
+
+/*****************************************************************************
+Checks a version 2 frame is one the client may send in the given state
+A request starts with either a TEXT frame or the first frame of a stream
+*****************************************************************************/
+static int frameAllowed(int state, int packed, const struct frameHeader *header)
+{
+	//a packed chunk is only known to split evenly once unpacked
+	if (header->op == OP_CHUNK)
+		return (state == STATE_TEXT || state == STATE_STREAM) && (packed || header->length % 2 == 0);
+	if (header->op == OP_END)
+		return (state == STATE_TEXT || state == STATE_STREAM) && header->length == 0;
+	if (state == STATE_TEXT && header->op == OP_SHM_MAP)
+		return header->length == 0;
+	if (state == STATE_TEXT && header->op == OP_SHM_REQUEST)
+		return header->length == SHM_REQUEST_SIZE;
+	if (state == STATE_TEXT && header->op == OP_BATCH)
+		return header->length >= BATCH_COUNT_SIZE;
+	if (state == STATE_TEXT)
+		return header->op == OP_TEXT || header->op == OP_KEY_UPLOAD;
+	if (state == STATE_KEY)
+		return header->op == OP_KEY || (header->op == OP_KEYREF && header->length == KEYREF_SIZE);
+	return state == STATE_RESULT_ACK && header->op == OP_ACK;
+}
+
+/*****************************************************************************
+Returns 1 if the payload of a frame with the given op carries packed text
+*****************************************************************************/
+static int opPacked(int op)
+{
+	return op == OP_TEXT || op == OP_KEY || op == OP_KEY_UPLOAD || op == OP_CHUNK || op == OP_BATCH;
+}
+
+/*****************************************************************************
+Returns 1 if the frame just announced is larger than the daemon accepts.
+Texts, keys, uploaded keys and batches are held to the message size limit,
+stream chunks to MAXCHUNK characters of text and key each. Packed payloads
+are measured by what they unpack to.
+*****************************************************************************/
+static int frameTooLarge(struct session *s, const struct frameHeader *header)
+{
+	size_t limit;
+
+	if (header->op == OP_CHUNK)
+		limit = 2 * MAXCHUNK;
+	else if (header->op == OP_TEXT || header->op == OP_KEY || header->op == OP_KEY_UPLOAD || header->op == OP_BATCH)
+		limit = s->config->maxMessage;
+	else
+		return 0;
+	if (s->packedMessage)
+		limit = cipherPackedLength(limit);
+	return header->length > limit;
+}
+
+/*****************************************************************************
+Once the length of a message is known, sizes its buffer and receives the
+payload straight into it. A key goes to the key buffer, everything else to
+the text buffer, and packed payloads to the packed buffer.
+*****************************************************************************/
+static enum sessionStatus receivedLength(struct session *s)
+{
+	struct frameHeader header;
+	struct sessionBuffer *buffer;
+
+	if (s->version == FRAME_VERSION)
+	{
+		if (decodeFrameHeader(s->inHeader, &header) < 0 || !frameAllowed(s->state, s->packed, &header) || header.length >= SIZE_MAX)
+			return SESSION_ERROR;
+		s->messageSize = header.length;
+		s->messageOp = header.op;
+		s->messageFlags = header.flags;
+		s->packedMessage = s->packed && opPacked(header.op);
+		if (frameTooLarge(s, &header))
+			return failRequest(s, "ERROR message is too large");
+	}
+	else
+	{
+		if (s->legacyLength < 0 || (s->state == STATE_HANDSHAKE && s->legacyLength > MAXHANDSHAKE)
+			|| (size_t)s->legacyLength > s->config->maxMessage)
+			return SESSION_ERROR;
+		s->messageSize = s->legacyLength;
+	}
+	if (debug)
+		fprintf(stderr, "SERVER: I received this from the client: \"%zu\"\n", s->messageSize);
+
+	if (s->packedMessage)
+		buffer = &s->packedBuffer;
+	else
+		buffer = s->state == STATE_KEY ? &s->keyBuffer : &s->textBuffer;
+	s->message = arenaTake(buffer, s->messageSize + 1);
+	if (s->message == NULL)
+		return SESSION_ERROR;
+	s->message[s->messageSize] = '\0';
+
+	//a large text is transformed by the pool as its key comes in, see sessionReceived();
+	//legacy requests are only transformed once their key ACK is out, see sessionAdvance()
+	if (s->state == STATE_KEY && !s->batch && !s->packedMessage && s->version == FRAME_VERSION && s->messageOp == OP_KEY
+		&& s->messageSize >= s->textLength && transformPoolWanted(s->textLength))
+	{
+		transformJobStart(&s->job, s->transform, s->text, s->text, s->message);
+		s->parallel = 1;
+	}
+	s->haveLength = 1;
+	expectInput(s, s->message, s->messageSize);
+	return SESSION_CONTINUE;
+}
+
+/*****************************************************************************
+Unpacks a received packed payload into the buffer it would otherwise have
+been received into. The entry table of a BATCH is copied as it is.
+Returns NULL, or the reason the payload was rejected
+*****************************************************************************/
+static char *unpackMessage(struct session *s)
+{
+	const unsigned char *packed = (const unsigned char *)s->message;
+	size_t table = 0;
+	uint64_t count;
+	size_t length;
+	char *out;
+
+	if (s->messageOp == OP_BATCH)
+	{
+		count = decodeUint64(packed);
+		if (count > (s->messageSize - BATCH_COUNT_SIZE) / BATCH_ENTRY_SIZE)
+			return "ERROR malformed batch";
+		table = BATCH_COUNT_SIZE + count * BATCH_ENTRY_SIZE;
+	}
+
+	s->packedMessage = 0;
+	out = arenaTake(s->state == STATE_KEY ? &s->keyBuffer : &s->textBuffer, table + (s->messageSize - table) * 8 / 5 + 1);
+	if (out == NULL)
+		return "ERROR out of memory";
+	memcpy(out, packed, table);
+	length = cipherUnpack(out + table, packed + table, s->messageSize - table);
+	if (length == (size_t)-1)
+		return "ERROR malformed packed message";
+	s->message = out;
+	s->messageSize = table + length;
+	out[s->messageSize] = '\0';
+	return NULL;
+}
+
+/*****************************************************************************
+Returns the fully received message, which stays in its session buffer
+*****************************************************************************/
+static char *takeMessage(struct session *s)
+{
+	char *message = s->message;
+	s->message = NULL;
+	if (debug)
+		fprintf(stderr, "SERVER: I received this from the client: \"%s\"\n", message);
+	return message;
+}
+
+/*****************************************************************************
+Queues a message to be sent with its INT length prefix
+*****************************************************************************/
+static void queueMessage(struct session *s, char *message, int length)
+{
+	s->outLength = length;
+	s->outVec[0].iov_base = &s->outLength;
+	s->outVec[0].iov_len = sizeof(int);
+	s->outVec[1].iov_base = message;
+	s->outVec[1].iov_len = length;
+	s->outCount = 2;
+	s->outIndex = 0;
+}
+
+/*****************************************************************************
+Queues a version 2 frame
+*****************************************************************************/
+static void queueFrame(struct session *s, int op, char *payload, size_t length)
+{
+	encodeFrameHeader(s->outHeader, op, 0, length);
+	s->outVec[0].iov_base = s->outHeader;
+	s->outVec[0].iov_len = FRAME_HEADER_SIZE;
+	s->outVec[1].iov_base = payload;
+	s->outVec[1].iov_len = length;
+	s->outCount = 2;
+	s->outIndex = 0;
+}
+
+/*****************************************************************************
+Queues an ACK, indicates successful receipt of packet
+*****************************************************************************/
+static void queueAck(struct session *s)
+{
+	if (s->version == FRAME_VERSION)
+	{
+		queueFrame(s, OP_ACK, NULL, 0);
+		return;
+	}
+	s->outVec[0].iov_base = (char *)ackMessage;
+	s->outVec[0].iov_len = ACKSIZE;
+	s->outCount = 1;
+	s->outIndex = 0;
+}
+
+/*****************************************************************************
+Rejects the current request. Version 2 clients are sent the reason in an
+ERROR frame before the connection closes; legacy clients are disconnected.
+*****************************************************************************/
+static enum sessionStatus failRequest(struct session *s, char *reason)
+{
+	metricsAdd(METRIC_REQUEST_ERRORS, 1);
+	releaseStoredKey(s);
+	if (s->version != FRAME_VERSION)
+		return SESSION_ERROR;
+	queueFrame(s, OP_ERROR, reason, strlen(reason));
+	expectInput(s, NULL, 0);
+	s->state = STATE_CLOSING;
+	return SESSION_CONTINUE;
+}
+
+/*****************************************************************************
+Hands back the stored key the current request was using, if any
+*****************************************************************************/
+static void releaseStoredKey(struct session *s)
+{
+	if (s->keyMapping != NULL)
+		keyStoreRelease(s->keyMapping);
+	s->keyMapping = NULL;
+}
+
+/*****************************************************************************
+Waits for the reply to the current request to be flushed, after which the
+connection is ready for another request
+*****************************************************************************/
+static void finishRequest(struct session *s)
+{
+	metricsAdd(METRIC_REQUESTS, 1);
+	s->phaseStart = 0;
+	expectInput(s, NULL, 0);
+	s->state = STATE_FINISHED;
+}
+
+/*****************************************************************************
+Finds the service matching the client name and picks the protocol version
+it asked for
+Returns 0 if the client is not allowed
+*****************************************************************************/
+static int verifyClient(struct session *s, const char *client)
+{
+	const struct sessionService *service;
+	size_t nameLength;
+	int i;
+
+	for (i = 0; i < s->config->serviceCount; i++)
+	{
+		service = &s->config->services[i];
+		nameLength = strlen(service->clientName);
+		if (strncmp(client, service->clientName, nameLength))
+			continue;
+		if (client[nameLength] == '\0')
+			s->version = 1;
+		else if (!strcmp(client + nameLength, VERSION_SUFFIX))
+			s->version = FRAME_VERSION;
+		else if (!strcmp(client + nameLength, VERSION_SUFFIX_PACKED))
+		{
+			s->version = FRAME_VERSION;
+			s->packed = 1;
+		}
+		else if (!strcmp(client + nameLength, VERSION_SUFFIX_BINARY))
+		{
+			s->version = FRAME_VERSION;
+			s->binary = 1;
+		}
+		else
+			continue;
+		s->service = service;
+		s->transform = s->binary ? cipherXor : service->transform;
+		return 1;
+	}
+	return 0;
+}
+
+/*****************************************************************************
+Transforms one received stream chunk in place and queues its result straight
+away, so only the current chunk is ever held in memory
+*****************************************************************************/
+static enum sessionStatus streamChunk(struct session *s)
+{
+	char *chunk = takeMessage(s);
+	size_t length = s->messageSize / 2;
+	size_t resultLength = length;
+	uint64_t started;
+
+	if (s->messageOp == OP_END)
+	{
+		queueFrame(s, OP_END, NULL, 0);
+		finishRequest(s);
+		return SESSION_CONTINUE;
+	}
+	if (s->messageSize % 2)
+		return failRequest(s, "ERROR malformed chunk");
+
+	//the chunk holds length text characters followed by their key, the
+	//result replaces the text and is sent before the next chunk is read
+	started = metricsNow();
+	s->transform(chunk, chunk, chunk + length, length);
+	if (s->packed)
+		resultLength = cipherPack((unsigned char *)chunk, chunk, length);
+	metricsRecord(PHASE_TRANSFORM, started);
+
+	queueFrame(s, OP_RESULT, chunk, resultLength);
+	expectMessage(s, STATE_STREAM);
+	return SESSION_CONTINUE;
+}
+
+/*****************************************************************************
+Stores an uploaded key and answers with its ID
+*****************************************************************************/
+static enum sessionStatus storeKey(struct session *s)
+{
+	uint64_t id;
+
+	s->key = takeMessage(s);
+	if (keyStoreUpload(s->key, s->messageSize, &id) < 0)
+		return failRequest(s, "ERROR key could not be stored");
+
+	encodeUint64(s->keyID, id);
+	queueFrame(s, OP_KEY_ID, (char *)s->keyID, sizeof(uint64_t));
+	finishRequest(s);
+	return SESSION_CONTINUE;
+}
+
+/*****************************************************************************
+Maps the shared memory segment passed with an SHM_MAP frame, replacing any
+earlier one. Only memfds sealed against shrinking are accepted, so the
+client cannot truncate the segment under the daemon.
+*****************************************************************************/
+static enum sessionStatus mapSegment(struct session *s)
+{
+	struct stat info;
+	int seals;
+	char *segment;
+
+	takeMessage(s);
+	if (s->passedFD < 0)
+		return failRequest(s, "ERROR no shared memory segment was passed");
+	seals = fcntl(s->passedFD, F_GET_SEALS);
+	if (seals < 0 || !(seals & F_SEAL_SHRINK) || fstat(s->passedFD, &info) < 0 || info.st_size <= 0)
+		return failRequest(s, "ERROR shared memory must be a memfd sealed against shrinking");
+
+	segment = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, s->passedFD, 0);
+	close(s->passedFD);
+	s->passedFD = -1;
+	if (segment == MAP_FAILED)
+		return failRequest(s, "ERROR shared memory could not be mapped");
+	if (s->shm != NULL)
+		munmap(s->shm, s->shmLength);
+	s->shm = segment;
+	s->shmLength = info.st_size;
+
+	queueFrame(s, OP_ACK, NULL, 0);
+	finishRequest(s);
+	return SESSION_CONTINUE;
+}
+
+/*****************************************************************************
+Finishes a request once its text is transformed: confirms the key and moves
+on to the result, or reports that a shared memory result is in place. Legacy
+keys have been confirmed already, and their result waits for the delay.
+*****************************************************************************/
+static enum sessionStatus requestTransformed(struct session *s)
+{
+	releaseStoredKey(s);
+	if (s->version == FRAME_VERSION && s->messageOp == OP_SHM_REQUEST)
+	{
+		queueFrame(s, OP_SHM_DONE, NULL, 0);
+		finishRequest(s);
+		return SESSION_CONTINUE;
+	}
+
+	if (s->version == FRAME_VERSION && !s->noAck)
+		queueAck(s);
+	s->state = STATE_RESULT;
+	if (s->version != FRAME_VERSION && s->config->legacyDelay > 0)
+		return SESSION_WANT_DELAY;
+	return SESSION_CONTINUE;
+}
+
+/*****************************************************************************
+Transforms length bytes of message with key into out, in parallel if there
+are enough of them. With a transformFD the pool's job is left to finish on
+its own and the driver waits for it, instead of the session blocking.
+*****************************************************************************/
+static enum sessionStatus startTransform(struct session *s, char *out, const char *message, const char *key, size_t length)
+{
+	s->transformStart = metricsNow();
+	if (s->transformFD >= 0 && !s->parallel && transformPoolWanted(length))
+	{
+		transformJobStart(&s->job, s->transform, out, message, key);
+		s->parallel = 1;
+	}
+
+	if (s->transformFD >= 0 && s->parallel)
+	{
+		if (transformJobFinishAsync(&s->job, length, s->transformFD))
+		{
+			s->state = STATE_TRANSFORM;
+			return SESSION_WANT_TRANSFORM;
+		}
+	}
+	else if (s->parallel)
+	{
+		transformJobFinish(&s->job, length);
+	}
+	else
+	{
+		parallelTransform(s->transform, out, message, key, length);
+	}
+	s->parallel = 0;
+	metricsRecord(PHASE_TRANSFORM, s->transformStart);
+	return requestTransformed(s);
+}
+
+/*****************************************************************************
+Returns 1 if length bytes from offset lie inside the shared segment
+*****************************************************************************/
+static int segmentHolds(struct session *s, uint64_t offset, uint64_t length)
+{
+	return offset <= s->shmLength && length <= s->shmLength - offset;
+}
+
+/*****************************************************************************
+Transforms text in the shared segment, writing the result back into it
+*****************************************************************************/
+static enum sessionStatus transformSegment(struct session *s)
+{
+	unsigned char *request = (unsigned char *)takeMessage(s);
+	uint64_t textOffset = decodeUint64(request);
+	uint64_t keyOffset = decodeUint64(request + 8);
+	uint64_t resultOffset = decodeUint64(request + 16);
+	uint64_t length = decodeUint64(request + 24);
+
+	if (s->shm == NULL)
+		return failRequest(s, "ERROR no shared memory segment is mapped");
+	if (!segmentHolds(s, textOffset, length) || !segmentHolds(s, keyOffset, length) || !segmentHolds(s, resultOffset, length))
+		return failRequest(s, "ERROR request lies outside the shared memory segment");
+
+	metricsRecord(PHASE_RECEIVE, s->phaseStart);
+	return startTransform(s, s->shm + resultOffset, s->shm + textOffset, s->shm + keyOffset, length);
+}
+
+/*****************************************************************************
+Transforms every record of a BATCH in place with the part of the key its
+entry names, leaving the results back to back where the records were
+Returns NULL, or the reason the batch was rejected
+*****************************************************************************/
+static char *transformBatch(struct session *s, const char *key, size_t keyLength)
+{
+	const unsigned char *entry = (const unsigned char *)s->text + BATCH_COUNT_SIZE;
+	uint64_t count = decodeUint64((const unsigned char *)s->text);
+	char *records;
+	size_t recordsLength;
+	uint64_t offset, length, i;
+	size_t done = 0;
+	uint64_t started;
+
+	if (count > (s->textLength - BATCH_COUNT_SIZE) / BATCH_ENTRY_SIZE)
+		return "ERROR malformed batch";
+	records = s->text + BATCH_COUNT_SIZE + count * BATCH_ENTRY_SIZE;
+	recordsLength = s->text + s->textLength - records;
+
+	started = metricsNow();
+	for (i = 0; i < count; i++, entry += BATCH_ENTRY_SIZE)
+	{
+		offset = decodeUint64(entry);
+		length = decodeUint64(entry + 8);
+		if (length > recordsLength - done)
+			return "ERROR malformed batch";
+		if (offset > keyLength || length > keyLength - offset)
+			return "ERROR key is too short for the message";
+		s->transform(records + done, records + done, key + offset, length);
+		done += length;
+	}
+	metricsRecord(PHASE_TRANSFORM, started);
+	if (done != recordsLength)
+		return "ERROR malformed batch";
+	s->result = records;
+	s->resultLength = done;
+	return NULL;
+}
+
+/*****************************************************************************
+Transforms the received text in place with the given key, then confirms the
+key. Legacy keys have been confirmed already.
+*****************************************************************************/
+static enum sessionStatus transformText(struct session *s, const char *key, size_t keyLength)
+{
+	char *reason;
+
+	//the whole request has arrived
+	metricsRecord(PHASE_RECEIVE, s->phaseStart);
+	if (s->batch)
+	{
+		reason = transformBatch(s, key, keyLength);
+		if (reason != NULL)
+			return failRequest(s, reason);
+		return requestTransformed(s);
+	}
+
+	if (keyLength < s->textLength)
+		return failRequest(s, "ERROR key is too short for the message");
+	s->result = s->text;
+	s->resultLength = s->textLength;
+	return startTransform(s, s->text, s->text, key, s->textLength);
+}
+
+/*****************************************************************************
+Transforms the received text with part of a stored key
+*****************************************************************************/
+static enum sessionStatus transformWithKeyRef(struct session *s)
+{
+	unsigned char *reference = (unsigned char *)takeMessage(s);
+	uint64_t id = decodeUint64(reference);
+	uint64_t offset = decodeUint64(reference + 8);
+	struct keyMapping *mapping;
+
+	mapping = keyStoreAcquire(id);
+	if (mapping == NULL)
+		return failRequest(s, "ERROR unknown key id");
+
+	//kept until the transform is done, which may be after this returns
+	s->keyMapping = mapping;
+	if (offset > mapping->length)
+		return failRequest(s, "ERROR key is too short for the message");
+	return transformText(s, mapping->data + offset, mapping->length - offset);
+}
+
+/*****************************************************************************
+Called whenever the pending input has arrived and all output has been sent.
+Moves the session to its next phase.
+*****************************************************************************/
+static enum sessionStatus sessionAdvance(struct session *s)
+{
+	char *client;
+	char *status;
+	char *reason;
+
+	//the length or header of a message has arrived, now read its payload
+	if (s->state <= STATE_KEY || s->state == STATE_RESULT_ACK || s->state == STATE_STREAM)
+	{
+		if (!s->haveLength)
+			return receivedLength(s);
+		if (s->packedMessage && (reason = unpackMessage(s)) != NULL)
+			return failRequest(s, reason);
+	}
+
+	switch (s->state)
+	{
+	case STATE_HANDSHAKE:
+		//respond with whether client is accepted or not, always in version 1
+		client = takeMessage(s);
+		metricsRecord(PHASE_HANDSHAKE, s->phaseStart);
+		s->phaseStart = 0;
+		if (!verifyClient(s, client))
+		{
+			metricsAdd(METRIC_CLIENTS_REJECTED, 1);
+			queueMessage(s, "REJECT", strlen("REJECT"));
+			s->state = STATE_CLOSING;
+			return SESSION_CONTINUE;
+		}
+		metricsAdd(METRIC_CLIENTS_ACCEPTED, 1);
+
+		if (s->binary)
+			status = ACCEPT_BINARY;
+		else if (s->packed)
+			status = ACCEPT_PACKED;
+		else
+			status = s->version == FRAME_VERSION ? ACCEPT_V2 : "ACCEPT";
+		queueMessage(s, status, strlen(status));
+		expectMessage(s, STATE_TEXT);
+		return SESSION_CONTINUE;
+
+	case STATE_TEXT:
+	case STATE_STREAM:
+		if (s->version == FRAME_VERSION && s->messageOp == OP_KEY_UPLOAD)
+			return storeKey(s);
+		if (s->version == FRAME_VERSION && s->messageOp == OP_SHM_MAP)
+			return mapSegment(s);
+		if (s->version == FRAME_VERSION && s->messageOp == OP_SHM_REQUEST)
+			return transformSegment(s);
+		if (s->version == FRAME_VERSION && s->messageOp != OP_TEXT && s->messageOp != OP_BATCH)
+			return streamChunk(s);
+
+		s->textLength = s->messageSize;
+		s->text = takeMessage(s);
+		s->batch = s->version == FRAME_VERSION && s->messageOp == OP_BATCH;
+		s->noAck = s->version == FRAME_VERSION && (s->messageFlags & FLAG_NOACK);
+		if (!s->noAck)
+			queueAck(s);
+		expectMessage(s, STATE_KEY);
+		return SESSION_CONTINUE;
+
+	case STATE_KEY:
+		if (s->version == FRAME_VERSION && s->messageOp == OP_KEYREF)
+			return transformWithKeyRef(s);
+		s->keyLength = s->messageSize;
+		s->key = takeMessage(s);
+		if (s->version == FRAME_VERSION)
+			return transformText(s, s->key, s->keyLength);
+
+		//legacy clients read the key ACK with a single recv() that also takes
+		//the start of the result if both are waiting, so as in the original
+		//daemon the ACK goes out on its own and the transform happens after
+		queueAck(s);
+		s->state = STATE_LEGACY_KEY_ACK;
+		return SESSION_CONTINUE;
+
+	case STATE_LEGACY_KEY_ACK:
+		//the original daemon was slow enough that the client was back in
+		//recv() before the result followed; the driver now waits instead
+		return transformText(s, s->key, s->keyLength);
+
+	case STATE_TRANSFORM:
+		//the pool wrote to transformFD, though perhaps for another session
+		if (!transformJobDone(&s->job))
+			return SESSION_WANT_TRANSFORM;
+		s->parallel = 0;
+		metricsRecord(PHASE_TRANSFORM, s->transformStart);
+		return requestTransformed(s);
+
+	case STATE_RESULT:
+		//the key ACK has been flushed, now send back the result
+		s->sendStart = metricsNow();
+		if (s->version == FRAME_VERSION)
+		{
+			if (s->packed)
+				s->resultLength = cipherPack((unsigned char *)s->result, s->result, s->resultLength);
+			queueFrame(s, OP_RESULT, s->result, s->resultLength);
+			if (s->noAck)
+				finishRequest(s);
+			else
+				expectMessage(s, STATE_RESULT_ACK);
+		}
+		else
+		{
+			queueMessage(s, s->result, s->resultLength);
+			s->state = STATE_LEGACY_ACK;
+			expectInput(s, s->ack, ACKSIZE);
+		}
+		return SESSION_CONTINUE;
+
+	case STATE_RESULT_ACK:
+		takeMessage(s);
+		finishRequest(s);
+		return SESSION_CONTINUE;
+
+	case STATE_FINISHED:
+		//the reply is out, hand the buffers back and wait for the next request
+		arenaGive(&s->textBuffer);
+		arenaGive(&s->keyBuffer);
+		arenaGive(&s->packedBuffer);
+		s->text = s->key = s->result = NULL;
+		expectMessage(s, STATE_TEXT);
+		return SESSION_CONTINUE;
+
+	case STATE_LEGACY_ACK:
+		if (debug)
+			fprintf(stderr, "SERVER: I received this from the client: \"%s\"\n", s->ack);
+		if (strncmp(s->ack, ackMessage, sizeof("ACK")))
+			return SESSION_ERROR;
+		metricsAdd(METRIC_REQUESTS, 1);
+		return SESSION_DONE;
+
+	case STATE_CLOSING:
+	default:
+		return SESSION_DONE;
+	}
+}
+
+/*****************************************************************************
+Returns 1 if a version 2 session is between requests, where the client may
+close the connection cleanly
+*****************************************************************************/
+static int sessionIdle(struct session *s)
+{
+	return s->version == FRAME_VERSION && s->state == STATE_TEXT && !s->haveLength && s->inHave == 0;
+}
+
+/*****************************************************************************
+Prepares a session for a newly accepted connection
+*****************************************************************************/
+void sessionInit(struct session *s, int socketFD, const struct sessionConfig *config)
+{
+	memset(s, '\0', sizeof(*s));
+	s->fd = socketFD;
+	s->config = config;
+	s->passedFD = -1;
+	s->transformFD = -1;
+	s->phaseStart = metricsNow();
+	metricsAdd(METRIC_CONNECTIONS, 1);
+	metricsAdd(METRIC_ACTIVE_SESSIONS, 1);
+	expectMessage(s, STATE_HANDSHAKE);
+}
+
+/*****************************************************************************
+Releases all buffers owned by a session. Does not close the socket.
+*****************************************************************************/
+void sessionFree(struct session *s)
+{
+	//pool threads may still be working in the buffers
+	if (s->parallel)
+		transformJobCancel(&s->job);
+	s->parallel = 0;
+	releaseStoredKey(s);
+	arenaGive(&s->textBuffer);
+	arenaGive(&s->keyBuffer);
+	arenaGive(&s->packedBuffer);
+	s->message = s->text = s->key = s->result = NULL;
+	if (s->passedFD >= 0)
+		close(s->passedFD);
+	if (s->shm != NULL)
+		munmap(s->shm, s->shmLength);
+	s->passedFD = -1;
+	s->shm = NULL;
+	metricsAdd(METRIC_ACTIVE_SESSIONS, -1);
+}
+
+/*****************************************************************************
+Keeps a descriptor the client passed with SCM_RIGHTS for the frame that
+needs it. Only one is kept at a time, any others are closed.
+*****************************************************************************/
+static void keepPassedFD(struct session *s, struct msghdr *msg)
+{
+	struct cmsghdr *control;
+	int *fds;
+	size_t count, i;
+
+	for (control = CMSG_FIRSTHDR(msg); control != NULL; control = CMSG_NXTHDR(msg, control))
+	{
+		if (control->cmsg_level != SOL_SOCKET || control->cmsg_type != SCM_RIGHTS)
+			continue;
+		fds = (int *)CMSG_DATA(control);
+		count = (control->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i = 0; i < count; i++)
+		{
+			if (s->passedFD >= 0)
+				close(s->passedFD);
+			s->passedFD = fds[i];
+		}
+	}
+}
+
+/*****************************************************************************
+Counts a failed session, returns SESSION_ERROR for the caller to pass on
+*****************************************************************************/
+enum sessionStatus sessionError(struct session *s)
+{
+	metricsAdd(METRIC_REQUEST_ERRORS, 1);
+	return SESSION_ERROR;
+}
+
+/*****************************************************************************
+Moves the session on until it needs I/O. Returns SESSION_WANT_WRITE while
+output is queued, SESSION_WANT_READ while input is expected,
+SESSION_WANT_DELAY while a legacy result is held back,
+SESSION_WANT_TRANSFORM while the pool finishes a job, or the final status
+once the session is over.
+*****************************************************************************/
+enum sessionStatus sessionStep(struct session *s)
+{
+	enum sessionStatus status;
+
+	while (s->outIndex >= s->outCount && s->inHave >= s->inWant)
+	{
+		status = sessionAdvance(s);
+		if (status == SESSION_ERROR)
+			return sessionError(s);
+		if (status != SESSION_CONTINUE)
+			return status;
+	}
+	return s->outIndex < s->outCount ? SESSION_WANT_WRITE : SESSION_WANT_READ;
+}
+
+/*****************************************************************************
+Describes the queued output as a message for sendmsg()
+*****************************************************************************/
+void sessionPrepareWrite(struct session *s, struct sessionIO *io)
+{
+	memset(&io->msg, '\0', sizeof(io->msg));
+	io->msg.msg_iov = &s->outVec[s->outIndex];
+	io->msg.msg_iovlen = s->outCount - s->outIndex;
+}
+
+/*****************************************************************************
+Describes the expected input as a message for recvmsg(), with room for a
+descriptor passed alongside it
+*****************************************************************************/
+void sessionPrepareRead(struct session *s, struct sessionIO *io)
+{
+	memset(&io->msg, '\0', sizeof(io->msg));
+	io->vec.iov_base = s->inBuf + s->inHave;
+	io->vec.iov_len = s->inWant - s->inHave;
+	io->msg.msg_iov = &io->vec;
+	io->msg.msg_iovlen = 1;
+	io->msg.msg_control = io->control.buffer;
+	io->msg.msg_controllen = sizeof(io->control.buffer);
+}
+
+/*****************************************************************************
+Drops count bytes that were written from the front of the output queue
+*****************************************************************************/
+void sessionSent(struct session *s, size_t count)
+{
+	metricsAdd(METRIC_BYTES_SENT, count);
+	while (s->outIndex < s->outCount && count >= s->outVec[s->outIndex].iov_len)
+		count -= s->outVec[s->outIndex++].iov_len;
+	if (s->outIndex < s->outCount)
+	{
+		s->outVec[s->outIndex].iov_base = (char *)s->outVec[s->outIndex].iov_base + count;
+		s->outVec[s->outIndex].iov_len -= count;
+	}
+	else if (s->sendStart)
+	{
+		metricsRecord(PHASE_SEND, s->sendStart);
+		s->sendStart = 0;
+	}
+}
+
+/*****************************************************************************
+Accounts for count bytes received with the message sessionPrepareRead()
+described
+*****************************************************************************/
+void sessionReceived(struct session *s, size_t count, struct sessionIO *io)
+{
+	if (io->msg.msg_controllen > 0)
+		keepPassedFD(s, &io->msg);
+
+	//a request is timed from its first byte, not from when the connection
+	//went idle
+	if (s->state == STATE_TEXT && s->phaseStart == 0)
+		s->phaseStart = metricsNow();
+	metricsAdd(METRIC_BYTES_RECEIVED, count);
+	s->inHave += count;
+
+	//hand the pool each slice whose key has now arrived
+	if (s->parallel && s->state == STATE_KEY)
+		transformJobSubmit(&s->job, s->inHave < s->textLength ? s->inHave : s->textLength);
+}
+
+/*****************************************************************************
+Called when the client closes the connection. That is only clean between
+version 2 requests.
+*****************************************************************************/
+enum sessionStatus sessionClosed(struct session *s)
+{
+	return sessionIdle(s) ? SESSION_DONE : sessionError(s);
+}
+
+/*****************************************************************************
+Sends queued output and receives pending input until the socket would block,
+the session asks for a delay or to wait for the pool, or it finishes. Works on blocking and
+non-blocking sockets alike.
+*****************************************************************************/
+enum sessionStatus sessionPump(struct session *s)
+{
+	struct sessionIO io;
+	enum sessionStatus status;
+	ssize_t count;
+
+	while (1)
+	{
+		status = sessionStep(s);
+		if (status == SESSION_WANT_WRITE)
+		{
+			sessionPrepareWrite(s, &io);
+			count = sendmsg(s->fd, &io.msg, MSG_NOSIGNAL);
+			if (count < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					return SESSION_WANT_WRITE;
+				return sessionError(s);
+			}
+			sessionSent(s, count);
+		}
+		else if (status == SESSION_WANT_READ)
+		{
+			//recvmsg() rather than recv() so a passed descriptor is not lost
+			sessionPrepareRead(s, &io);
+			count = recvmsg(s->fd, &io.msg, MSG_CMSG_CLOEXEC);
+			if (count == 0)
+				return sessionClosed(s);
+			if (count < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					return SESSION_WANT_READ;
+				return sessionError(s);
+			}
+			sessionReceived(s, count, &io);
+		}
+		else
+		{
+			return status;
+		}
+	}
+}
+
+/*****************************************************************************
+Runs a whole session on a blocking socket, then closes the connection.
+Used by workers that handle one client at a time. The idle timeout is
+enforced with socket timeouts, which make a stalled recv or send fail.
+*****************************************************************************/
+void serveSession(int socketFD, const struct sessionConfig *config)
+{
+	struct session s;
+	struct timeval timeout = { config->idleTimeout, 0 };
+
+	if (config->idleTimeout > 0)
+	{
+		setsockopt(socketFD, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(socketFD, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	}
+
+	//on a blocking socket the pump only returns once the session is over,
+	//once a timeout expires and it reports that it would block, or for a delay
+	sessionInit(&s, socketFD, config);
+	while (sessionPump(&s) == SESSION_WANT_DELAY)
+		usleep(config->legacyDelay);
+
+	sessionFree(&s);
+	close(socketFD);
+}
@@ -0,0 +1,191 @@
+/*****************************************************************************
+session.h
+
+Description: Per-connection protocol state machine shared by the daemons.
+A session never blocks on its own; it only records which bytes it is waiting
+to read or write, so the same code can be driven by an event loop
+(non-blocking sockets), by a worker that simply blocks on the socket, or by
+a completion based backend that submits the reads and writes itself. The
+one pause a session needs, before a legacy result, is likewise left to its
+driver, and a driver that gives the session an eventfd is also left to wait
+for the transform pool instead of the session blocking on it.
+*****************************************************************************/
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+#include "protocol.h"
+#include "transform_pool.h"
+
+#define MAXHANDSHAKE 64
+#define DEFAULT_IDLE_TIMEOUT 30
+#define DEFAULT_MAX_MESSAGE 1024
+
+// Default microseconds a legacy session waits between its key ACK and the
+// result, so the client's recv() of the ACK does not take part of the result
+#define DEFAULT_LEGACY_DELAY 1000
+
+/*****************************************************************************
+A client name accepted in the handshake and the transform it selects
+*****************************************************************************/
+struct sessionService
+{
+	const char *clientName;
+	void (*transform)(char *out, const char *message, const char *key, size_t length);
+};
+
+/*****************************************************************************
+Daemon specific behaviour used by a session
+*****************************************************************************/
+struct sessionConfig
+{
+	const struct sessionService *services;
+	int serviceCount;
+	//seconds a connection may sit without traffic before it is closed, 0 for none
+	int idleTimeout;
+	//largest text, key, uploaded key or batch a client may send, in bytes once unpacked
+	size_t maxMessage;
+	//microseconds between a legacy key ACK and its result, 0 for no pause
+	int legacyDelay;
+};
+
+/*****************************************************************************
+A receive buffer and how many bytes it can hold
+*****************************************************************************/
+struct sessionBuffer
+{
+	char *data;
+	size_t size;
+};
+
+enum sessionStatus
+{
+	SESSION_CONTINUE,
+	SESSION_WANT_READ,
+	SESSION_WANT_WRITE,
+	//call again once the config's legacyDelay has passed
+	SESSION_WANT_DELAY,
+	//call again once the pool has written to the session's transformFD
+	SESSION_WANT_TRANSFORM,
+	SESSION_DONE,
+	SESSION_ERROR
+};
+
+struct keyMapping;
+
+struct session
+{
+	int fd;
+	int state;
+	int version;
+	const struct sessionConfig *config;
+	const struct sessionService *service;
+
+	//the service's transform, or XOR once the client picked binary mode
+	void (*transform)(char *out, const char *message, const char *key, size_t length);
+	int binary;
+
+	//bytes still expected from the client are read into inBuf
+	char *inBuf;
+	size_t inWant;
+	size_t inHave;
+
+	//the text and key of a request are received into these and transformed
+	//in place; between requests they go back to the thread's arena
+	struct sessionBuffer textBuffer;
+	struct sessionBuffer keyBuffer;
+
+	//set when the client negotiated packed text; packed payloads are
+	//received here first and unpacked into the text or key buffer
+	int packed;
+	int packedMessage;
+	struct sessionBuffer packedBuffer;
+
+	//message or frame currently being received, in one of the buffers
+	char *message;
+	size_t messageSize;
+	int messageOp;
+	int messageFlags;
+	int legacyLength;
+	unsigned char inHeader[FRAME_HEADER_SIZE];
+	int haveLength;
+
+	//bytes queued for the client, flushed in order
+	struct iovec outVec[2];
+	int outCount;
+	int outIndex;
+	int outLength;
+	unsigned char outHeader[FRAME_HEADER_SIZE];
+
+	//set when the client asked for a request without ACKs
+	int noAck;
+
+	//set when the text is a BATCH of records rather than a single TEXT
+	int batch;
+
+	//set while the pool holds a job in the session's buffers, which may be
+	//handed to it as the key arrives
+	int parallel;
+	struct transformJob job;
+
+	//eventfd the pool signals when a job finishes, set by drivers that would
+	//rather wait for it than block; -1 to block. The stored key in use is
+	//held until the job is done.
+	int transformFD;
+	struct keyMapping *keyMapping;
+
+	//descriptor passed with SCM_RIGHTS, and the client's shared segment
+	int passedFD;
+	char *shm;
+	size_t shmLength;
+
+	//metricsNow() stamps of the phase being timed, of the transform and of
+	//the result being sent, 0 when not timing
+	uint64_t phaseStart;
+	uint64_t transformStart;
+	uint64_t sendStart;
+
+	char *text;
+	size_t textLength;
+	char *key;
+	size_t keyLength;
+	char *result;
+	size_t resultLength;
+	unsigned char keyID[sizeof(uint64_t)];
+	char ack[ACKSIZE + 1];
+};
+
+/*****************************************************************************
+One sendmsg() or recvmsg() for a session, with room for a passed descriptor
+*****************************************************************************/
+struct sessionIO
+{
+	struct msghdr msg;
+	struct iovec vec;
+	union
+	{
+		char buffer[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+};
+
+void sessionInit(struct session *s, int socketFD, const struct sessionConfig *config);
+void sessionFree(struct session *s);
+enum sessionStatus sessionPump(struct session *s);
+
+//for I/O backends that issue the reads and writes themselves
+enum sessionStatus sessionStep(struct session *s);
+void sessionPrepareWrite(struct session *s, struct sessionIO *io);
+void sessionPrepareRead(struct session *s, struct sessionIO *io);
+void sessionSent(struct session *s, size_t count);
+void sessionReceived(struct session *s, size_t count, struct sessionIO *io);
+enum sessionStatus sessionClosed(struct session *s);
+enum sessionStatus sessionError(struct session *s);
+void serveSession(int socketFD, const struct sessionConfig *config);
+
+#endif
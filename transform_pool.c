@@ -0,0 +1,345 @@
+/*****************************************************************************
+transform_pool.c
+
+Description: Jobs with slices left to run wait in one queue shared by the
+pool threads, so whichever thread is free takes the next slice and a job is
+spread over every idle core. The queue is a list of jobs rather than of
+slices, so it never fills up, and each thread takes a slice from the job at
+its front and then moves that job to the back, so concurrent jobs share the
+threads evenly. The thread that owns a job helps with the queue while it
+waits for the job to finish, or leaves the job to finish on its own and is
+told through an eventfd. The threads are started on first use, so each
+worker process of a daemon gets its own pool after it forks.
+*****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "transform_pool.h"
+
+// Bytes in a slice, sized to stay in a core's L2 cache with its key
+#define SLICE_SIZE (256 << 10)
+
+/*****************************************************************************
+Part of a job taken by a thread
+*****************************************************************************/
+struct transformSlice
+{
+	struct transformJob *job;
+	size_t offset;
+	size_t length;
+};
+
+static int poolThreads = 0;
+static int startedThreads = 0;
+static size_t poolThreshold = (size_t)DEFAULT_PARALLEL_THRESHOLD << 10;
+static pthread_once_t poolStarted = PTHREAD_ONCE_INIT;
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sliceQueued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t sliceFinished = PTHREAD_COND_INITIALIZER;
+
+//jobs with unclaimed bytes, guarded by poolLock
+static struct transformJob *queueHead = NULL;
+static struct transformJob *queueTail = NULL;
+
+/*****************************************************************************
+Sets the number of pool threads, 0 to transform every message on the thread
+that received it, and the size in bytes from which messages are split up
+*****************************************************************************/
+void transformPoolInit(int threads, size_t threshold)
+{
+	poolThreads = threads;
+	poolThreshold = threshold;
+}
+
+/*****************************************************************************
+Returns 1 if a message of length bytes should be transformed in parallel
+*****************************************************************************/
+int transformPoolWanted(size_t length)
+{
+	return poolThreads > 0 && length >= poolThreshold;
+}
+
+/*****************************************************************************
+Returns 1 if every byte handed over of a job has been transformed. Called
+with poolLock held.
+*****************************************************************************/
+static int jobDone(struct transformJob *job)
+{
+	return job->claimed == job->submitted && job->running == 0;
+}
+
+/*****************************************************************************
+Appends a job to the queue unless it is there already. Called with poolLock
+held.
+*****************************************************************************/
+static void queueJob(struct transformJob *job)
+{
+	if (job->queued)
+		return;
+	job->next = NULL;
+	if (queueTail != NULL)
+		queueTail->next = job;
+	else
+		queueHead = job;
+	queueTail = job;
+	job->queued = 1;
+}
+
+/*****************************************************************************
+Removes the job at the front of the queue. Called with poolLock held.
+*****************************************************************************/
+static void dequeueHead()
+{
+	struct transformJob *job = queueHead;
+
+	queueHead = job->next;
+	if (queueHead == NULL)
+		queueTail = NULL;
+	job->queued = 0;
+}
+
+/*****************************************************************************
+Takes the next slice of the job at the front of the queue, which then goes
+to the back if it has more. Called with poolLock held.
+Returns 0 if no job has bytes left to claim
+*****************************************************************************/
+static int claimSlice(struct transformSlice *slice)
+{
+	struct transformJob *job = queueHead;
+
+	if (job == NULL)
+		return 0;
+	slice->job = job;
+	slice->offset = job->claimed;
+	slice->length = job->submitted - job->claimed < SLICE_SIZE ? job->submitted - job->claimed : SLICE_SIZE;
+	job->claimed += slice->length;
+	job->running++;
+
+	dequeueHead();
+	if (job->claimed < job->submitted)
+		queueJob(job);
+	return 1;
+}
+
+/*****************************************************************************
+Transforms one slice, then wakes the job's owner if it was the last one
+*****************************************************************************/
+static void runSlice(struct transformSlice *slice)
+{
+	struct transformJob *job = slice->job;
+	uint64_t one = 1;
+
+	job->transform(job->out + slice->offset, job->message + slice->offset, job->key + slice->offset, slice->length);
+
+	//the job may be gone as soon as the lock is released
+	pthread_mutex_lock(&poolLock);
+	job->running--;
+	if (jobDone(job))
+	{
+		pthread_cond_broadcast(&sliceFinished);
+		if (job->doneFD >= 0 && write(job->doneFD, &one, sizeof(one)) < 0)
+			perror("ERROR signalling a finished transform");
+	}
+	pthread_mutex_unlock(&poolLock);
+}
+
+/*****************************************************************************
+Takes slices off the queue and runs them, forever
+*****************************************************************************/
+static void *poolMain(void *arg)
+{
+	struct transformSlice slice;
+
+	pthread_mutex_lock(&poolLock);
+	while (1)
+	{
+		while (!claimSlice(&slice))
+			pthread_cond_wait(&sliceQueued, &poolLock);
+		pthread_mutex_unlock(&poolLock);
+		runSlice(&slice);
+		pthread_mutex_lock(&poolLock);
+	}
+	return NULL;
+}
+
+/*****************************************************************************
+Starts the pool threads. Owners run queued slices while they wait, so jobs
+still finish if fewer threads could be started, or none.
+*****************************************************************************/
+static void startPool()
+{
+	pthread_t thread;
+	int i;
+
+	for (i = 0; i < poolThreads; i++)
+	{
+		if (pthread_create(&thread, NULL, poolMain, NULL))
+			break;
+		pthread_detach(thread);
+	}
+	startedThreads = i;
+}
+
+/*****************************************************************************
+Hands a job's bytes up to length to the pool. Called with poolLock held.
+*****************************************************************************/
+static void handOver(struct transformJob *job, size_t length)
+{
+	if (length <= job->submitted)
+		return;
+	job->submitted = length;
+	queueJob(job);
+	pthread_cond_broadcast(&sliceQueued);
+}
+
+/*****************************************************************************
+Prepares a job that transforms message with key into out. Nothing is
+transformed until it is submitted.
+*****************************************************************************/
+void transformJobStart(struct transformJob *job, void (*transform)(char *, const char *, const char *, size_t), char *out, const char *message, const char *key)
+{
+	pthread_once(&poolStarted, startPool);
+	job->transform = transform;
+	job->out = out;
+	job->message = message;
+	job->key = key;
+	job->submitted = 0;
+	job->claimed = 0;
+	job->running = 0;
+	job->doneFD = -1;
+	job->next = NULL;
+	job->queued = 0;
+}
+
+/*****************************************************************************
+Hands over every whole slice of the first length bytes, once their message
+and key have arrived
+*****************************************************************************/
+void transformJobSubmit(struct transformJob *job, size_t length)
+{
+	pthread_mutex_lock(&poolLock);
+	if (length > job->submitted)
+		handOver(job, job->submitted + (length - job->submitted) / SLICE_SIZE * SLICE_SIZE);
+	pthread_mutex_unlock(&poolLock);
+}
+
+/*****************************************************************************
+Hands over the rest of a length byte job and waits for all of it
+*****************************************************************************/
+void transformJobFinish(struct transformJob *job, size_t length)
+{
+	pthread_mutex_lock(&poolLock);
+	handOver(job, length);
+	pthread_mutex_unlock(&poolLock);
+	transformJobWait(job);
+}
+
+/*****************************************************************************
+Hands over the rest of a length byte job without waiting for it. The pool
+writes to doneFD once the job is done, after which transformJobDone() is
+true; until then the job and its buffers must be left alone.
+Returns 1 if the job is still running, or 0 if it was finished here because
+it already was done or no pool thread could be started
+*****************************************************************************/
+int transformJobFinishAsync(struct transformJob *job, size_t length, int doneFD)
+{
+	pthread_mutex_lock(&poolLock);
+	handOver(job, length);
+	if (startedThreads > 0 && !jobDone(job))
+	{
+		job->doneFD = doneFD;
+		pthread_mutex_unlock(&poolLock);
+		return 1;
+	}
+	pthread_mutex_unlock(&poolLock);
+	transformJobWait(job);
+	return 0;
+}
+
+/*****************************************************************************
+Returns 1 once every byte handed over of a job has been transformed
+*****************************************************************************/
+int transformJobDone(struct transformJob *job)
+{
+	int done;
+
+	pthread_mutex_lock(&poolLock);
+	done = jobDone(job);
+	pthread_mutex_unlock(&poolLock);
+	return done;
+}
+
+/*****************************************************************************
+Waits until every submitted slice of a job is finished, running queued
+slices in the meantime
+*****************************************************************************/
+void transformJobWait(struct transformJob *job)
+{
+	struct transformSlice slice;
+
+	pthread_mutex_lock(&poolLock);
+	while (!jobDone(job))
+	{
+		if (!claimSlice(&slice))
+		{
+			pthread_cond_wait(&sliceFinished, &poolLock);
+			continue;
+		}
+		pthread_mutex_unlock(&poolLock);
+		runSlice(&slice);
+		pthread_mutex_lock(&poolLock);
+	}
+	pthread_mutex_unlock(&poolLock);
+}
+
+/*****************************************************************************
+Abandons a job whose result is no longer wanted. Bytes no thread has taken
+yet are dropped, so this only waits for the slices already running.
+*****************************************************************************/
+void transformJobCancel(struct transformJob *job)
+{
+	struct transformJob *previous = NULL;
+	struct transformJob *other;
+
+	pthread_mutex_lock(&poolLock);
+	job->doneFD = -1;
+	job->submitted = job->claimed;
+	if (job->queued)
+	{
+		for (other = queueHead; other != job; other = other->next)
+			previous = other;
+		if (previous != NULL)
+			previous->next = job->next;
+		else
+			queueHead = job->next;
+		if (queueTail == job)
+			queueTail = previous;
+		job->queued = 0;
+	}
+	while (job->running > 0)
+		pthread_cond_wait(&sliceFinished, &poolLock);
+	pthread_mutex_unlock(&poolLock);
+}
+
+/*****************************************************************************
+Transforms a message whose key is already at hand, in parallel if it is
+large enough
+*****************************************************************************/
+void parallelTransform(void (*transform)(char *, const char *, const char *, size_t), char *out, const char *message, const char *key, size_t length)
+{
+	struct transformJob job;
+
+	if (!transformPoolWanted(length))
+	{
+		transform(out, message, key, length);
+		return;
+	}
+	transformJobStart(&job, transform, out, message, key);
+	transformJobFinish(&job, length);
+}
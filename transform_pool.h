@@ -0,0 +1,52 @@
+/*****************************************************************************
+transform_pool.h
+
+Description: Shared pool of threads that transform very large messages in
+parallel. A message is cut into cache sized slices which any idle pool
+thread may pick up, and slices can be handed over while the rest of the
+message is still arriving. An owner that must not block, such as an event
+loop, can leave a job to finish on its own and be told through an eventfd.
+*****************************************************************************/
+
+#ifndef TRANSFORM_POOL_H
+#define TRANSFORM_POOL_H
+
+#include <stddef.h>
+
+// Kilobytes a message must reach before it is transformed in parallel
+#define DEFAULT_PARALLEL_THRESHOLD 1024
+
+/*****************************************************************************
+One message being transformed by the pool. submitted bytes from the start
+have been handed over, claimed bytes of them taken by a thread, and running
+slices are not finished yet. Everything after the key is guarded by the
+pool's lock.
+*****************************************************************************/
+struct transformJob
+{
+	void (*transform)(char *out, const char *message, const char *key, size_t length);
+	char *out;
+	const char *message;
+	const char *key;
+	size_t submitted;
+	size_t claimed;
+	int running;
+	//eventfd written once a job left to finish on its own is done, else -1
+	int doneFD;
+	//next job with unclaimed bytes, while this one is queued
+	struct transformJob *next;
+	int queued;
+};
+
+void transformPoolInit(int threads, size_t threshold);
+int transformPoolWanted(size_t length);
+void transformJobStart(struct transformJob *job, void (*transform)(char *, const char *, const char *, size_t), char *out, const char *message, const char *key);
+void transformJobSubmit(struct transformJob *job, size_t length);
+void transformJobFinish(struct transformJob *job, size_t length);
+int transformJobFinishAsync(struct transformJob *job, size_t length, int doneFD);
+int transformJobDone(struct transformJob *job);
+void transformJobWait(struct transformJob *job);
+void transformJobCancel(struct transformJob *job);
+void parallelTransform(void (*transform)(char *, const char *, const char *, size_t), char *out, const char *message, const char *key, size_t length);
+
+#endif
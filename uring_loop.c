@@ -0,0 +1,486 @@
+/*****************************************************************************
+uring_loop.c
+
+Description: io_uring based event loop for the daemons, using the raw system
+calls. Instead of waiting for readiness and then calling recvmsg() or
+sendmsg(), every accept, read and write is placed on the submission ring
+and its result collected from the completion ring, so a single
+io_uring_enter() both submits new work and waits for finished work. A
+session is always either waiting for input or flushing output, so each
+connection has exactly one operation in flight. Accepts are multishot where
+the kernel supports it. Idle connections are found with the same activity
+list as the epoll loop, using a one second ring timeout. A session that asks
+for a delay gets a ring timeout of its own as its operation in flight. Large
+transforms are left to the transform pool, which writes to an eventfd that
+the ring always has a read queued on, so a finished job arrives as one more
+completion and the sessions waiting for the pool carry on from there.
+*****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+#include "uring_loop.h"
+
+#define RING_ENTRIES 1024
+
+//user_data of the operations that have no connection attached
+#define ACCEPT_TAG 1
+#define TIMEOUT_TAG 2
+#define TRANSFORM_TAG 3
+
+void error(const char *msg);
+
+/*****************************************************************************
+The submission and completion rings shared with the kernel
+*****************************************************************************/
+struct ring
+{
+	int fd;
+	unsigned *sqHead;
+	unsigned *sqTail;
+	unsigned *sqMask;
+	unsigned *sqArray;
+	unsigned sqEntries;
+	unsigned sqLocalTail;
+	unsigned sqPending;
+	struct io_uring_sqe *sqes;
+	unsigned *cqHead;
+	unsigned *cqTail;
+	unsigned *cqMask;
+	struct io_uring_cqe *cqes;
+};
+
+/*****************************************************************************
+A connection tracked by the loop, with the message of its pending operation
+*****************************************************************************/
+struct connection
+{
+	struct session session;
+	struct sessionIO io;
+	struct __kernel_timespec delay;
+	int writing;
+	int waiting;
+	int listed;
+	time_t lastActive;
+	struct connection *prev;
+	struct connection *next;
+	//next connection waiting for the transform pool, which has no
+	//operation in flight meanwhile
+	struct connection *nextTransforming;
+};
+
+//connections ordered from least to most recently active
+static struct connection *idleHead = NULL;
+static struct connection *idleTail = NULL;
+
+//connections waiting for the transform pool, which signals transformFD
+static struct connection *transformingHead = NULL;
+static int transformFD = -1;
+static uint64_t transformCount;
+
+/*****************************************************************************
+Returns the current monotonic time in seconds
+*****************************************************************************/
+static time_t now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/*****************************************************************************
+Removes a connection from the activity list
+*****************************************************************************/
+static void unlinkConnection(struct connection *conn)
+{
+	if (!conn->listed)
+		return;
+	if (conn->prev != NULL)
+		conn->prev->next = conn->next;
+	else
+		idleHead = conn->next;
+	if (conn->next != NULL)
+		conn->next->prev = conn->prev;
+	else
+		idleTail = conn->prev;
+	conn->listed = 0;
+}
+
+/*****************************************************************************
+Marks a connection as just active by moving it to the back of the list
+*****************************************************************************/
+static void touchConnection(struct connection *conn)
+{
+	unlinkConnection(conn);
+	conn->prev = idleTail;
+	conn->next = NULL;
+	if (idleTail != NULL)
+		idleTail->next = conn;
+	else
+		idleHead = conn;
+	idleTail = conn;
+	conn->listed = 1;
+	conn->lastActive = now();
+}
+
+/*****************************************************************************
+Closes a finished connection and releases its state
+*****************************************************************************/
+static void closeConnection(struct connection *conn)
+{
+	unlinkConnection(conn);
+	close(conn->session.fd);
+	sessionFree(&conn->session);
+	free(conn);
+}
+
+/*****************************************************************************
+Creates the rings and maps them into the process
+Returns -1 if the kernel does not allow io_uring
+*****************************************************************************/
+static int ringInit(struct ring *ring)
+{
+	struct io_uring_params params;
+	char *sq, *cq;
+
+	//only this thread submits, so completion work can wait for io_uring_enter()
+	memset(&params, '\0', sizeof(params));
+	params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+	ring->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+	if (ring->fd < 0 && errno == EINVAL)
+	{
+		memset(&params, '\0', sizeof(params));
+		ring->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+	}
+	if (ring->fd < 0)
+		return -1;
+
+	sq = mmap(NULL, params.sq_off.array + params.sq_entries * sizeof(unsigned), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	cq = mmap(NULL, params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (sq == MAP_FAILED || cq == MAP_FAILED || ring->sqes == MAP_FAILED)
+	{
+		close(ring->fd);
+		return -1;
+	}
+
+	ring->sqHead = (unsigned *)(sq + params.sq_off.head);
+	ring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+	ring->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+	ring->sqArray = (unsigned *)(sq + params.sq_off.array);
+	ring->sqEntries = params.sq_entries;
+	ring->sqLocalTail = *ring->sqTail;
+	ring->sqPending = 0;
+	ring->cqHead = (unsigned *)(cq + params.cq_off.head);
+	ring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+	ring->cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	return 0;
+}
+
+/*****************************************************************************
+Submits everything queued so far and, if minComplete is set, waits until
+that many operations have completed
+Returns -1 on error with errno set
+*****************************************************************************/
+static int ringEnter(struct ring *ring, unsigned minComplete)
+{
+	int submitted;
+
+	__atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+	submitted = syscall(__NR_io_uring_enter, ring->fd, ring->sqPending, minComplete,
+		minComplete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	if (submitted < 0)
+		return -1;
+	ring->sqPending -= submitted;
+	return 0;
+}
+
+/*****************************************************************************
+Returns a cleared submission entry, submitting queued ones if the ring is
+full
+*****************************************************************************/
+static struct io_uring_sqe *ringQueue(struct ring *ring, uint64_t userData)
+{
+	struct io_uring_sqe *sqe;
+	unsigned index;
+
+	while (ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >= ring->sqEntries)
+	{
+		if (ringEnter(ring, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			error("ERROR on io_uring_enter");
+	}
+
+	index = ring->sqLocalTail & *ring->sqMask;
+	sqe = &ring->sqes[index];
+	memset(sqe, '\0', sizeof(*sqe));
+	sqe->user_data = userData;
+	ring->sqArray[index] = index;
+	ring->sqLocalTail++;
+	ring->sqPending++;
+	return sqe;
+}
+
+/*****************************************************************************
+Queues an accept on the listening socket, one that keeps accepting if
+multishot is set
+*****************************************************************************/
+static void queueAccept(struct ring *ring, int listenSocketFD, int multishot)
+{
+	struct io_uring_sqe *sqe = ringQueue(ring, ACCEPT_TAG);
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = listenSocketFD;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	if (multishot)
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+/*****************************************************************************
+Queues a timeout that completes after the given time
+*****************************************************************************/
+static void queueTimeout(struct ring *ring, struct __kernel_timespec *timeout, uint64_t userData)
+{
+	struct io_uring_sqe *sqe = ringQueue(ring, userData);
+
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr = (uint64_t)(uintptr_t)timeout;
+	sqe->len = 1;
+}
+
+/*****************************************************************************
+Queues a read of the eventfd the transform pool signals
+*****************************************************************************/
+static void queueTransformRead(struct ring *ring)
+{
+	struct io_uring_sqe *sqe = ringQueue(ring, TRANSFORM_TAG);
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = transformFD;
+	sqe->addr = (uint64_t)(uintptr_t)&transformCount;
+	sqe->len = sizeof(transformCount);
+}
+
+/*****************************************************************************
+Steps a connection's session and queues the read or write it needs next
+*****************************************************************************/
+static void serviceConnection(struct ring *ring, struct connection *conn)
+{
+	struct io_uring_sqe *sqe;
+
+	switch (sessionStep(&conn->session))
+	{
+	case SESSION_WANT_READ:
+		sessionPrepareRead(&conn->session, &conn->io);
+		sqe = ringQueue(ring, (uint64_t)(uintptr_t)conn);
+		sqe->opcode = IORING_OP_RECVMSG;
+		sqe->msg_flags = MSG_CMSG_CLOEXEC;
+		conn->writing = 0;
+		break;
+	case SESSION_WANT_WRITE:
+		sessionPrepareWrite(&conn->session, &conn->io);
+		sqe = ringQueue(ring, (uint64_t)(uintptr_t)conn);
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->msg_flags = MSG_NOSIGNAL;
+		conn->writing = 1;
+		break;
+	case SESSION_WANT_DELAY:
+		conn->delay.tv_sec = conn->session.config->legacyDelay / 1000000;
+		conn->delay.tv_nsec = conn->session.config->legacyDelay % 1000000 * 1000;
+		queueTimeout(ring, &conn->delay, (uint64_t)(uintptr_t)conn);
+		conn->waiting = 1;
+		return;
+	case SESSION_WANT_TRANSFORM:
+		//nothing is in flight, so it must not be expired meanwhile
+		unlinkConnection(conn);
+		conn->nextTransforming = transformingHead;
+		transformingHead = conn;
+		return;
+	default:
+		closeConnection(conn);
+		return;
+	}
+	sqe->fd = conn->session.fd;
+	sqe->addr = (uint64_t)(uintptr_t)&conn->io.msg;
+	sqe->len = 1;
+}
+
+/*****************************************************************************
+Hands the result of a connection's read or write to its session
+*****************************************************************************/
+static void completeConnection(struct ring *ring, struct connection *conn, int result)
+{
+	touchConnection(conn);
+	if (conn->waiting)
+	{
+		//the delay expired, the session carries on where it stopped
+		conn->waiting = 0;
+	}
+	else if (result == -EINTR || result == -EAGAIN)
+	{
+		//nothing happened, queue the same operation again
+	}
+	else if (result < 0)
+	{
+		sessionError(&conn->session);
+		closeConnection(conn);
+		return;
+	}
+	else if (conn->writing)
+	{
+		sessionSent(&conn->session, result);
+	}
+	else if (result == 0)
+	{
+		sessionClosed(&conn->session);
+		closeConnection(conn);
+		return;
+	}
+	else
+	{
+		sessionReceived(&conn->session, result, &conn->io);
+	}
+	serviceConnection(ring, conn);
+}
+
+/*****************************************************************************
+Starts a session for a newly accepted connection
+*****************************************************************************/
+static void acceptConnection(struct ring *ring, int establishedConnectionFD, const struct sessionConfig *config)
+{
+	struct connection *conn = malloc(sizeof(struct connection));
+
+	if (conn == NULL)
+	{
+		close(establishedConnectionFD);
+		return;
+	}
+	sessionInit(&conn->session, establishedConnectionFD, config);
+	conn->session.transformFD = transformFD;
+	conn->waiting = 0;
+	conn->listed = 0;
+	touchConnection(conn);
+	serviceConnection(ring, conn);
+}
+
+/*****************************************************************************
+Resumes the connections waiting for the transform pool once it has signalled.
+Those whose job is not done yet wait again.
+*****************************************************************************/
+static void resumeTransforms(struct ring *ring)
+{
+	struct connection *conn;
+	struct connection *next;
+
+	conn = transformingHead;
+	transformingHead = NULL;
+	for (; conn != NULL; conn = next)
+	{
+		next = conn->nextTransforming;
+		touchConnection(conn);
+		serviceConnection(ring, conn);
+	}
+}
+
+/*****************************************************************************
+Shuts down every connection that has been idle for the configured timeout.
+Their pending operations then complete and close them as usual.
+*****************************************************************************/
+static void expireConnections(const struct sessionConfig *config)
+{
+	time_t cutoff = now() - config->idleTimeout;
+	struct connection *conn;
+
+	while (idleHead != NULL && idleHead->lastActive <= cutoff)
+	{
+		conn = idleHead;
+		unlinkConnection(conn);
+		shutdown(conn->session.fd, SHUT_RDWR);
+	}
+}
+
+/*****************************************************************************
+Runs the daemon as a single process multiplexing all clients through
+io_uring. Never returns once the ring is set up.
+Returns -1 if io_uring is unavailable, so the caller can fall back to epoll
+*****************************************************************************/
+int runUringLoop(int listenSocketFD, const struct sessionConfig *config)
+{
+	struct ring ring;
+	struct io_uring_cqe *cqe;
+	struct __kernel_timespec tick = { 1, 0 };
+	uint64_t userData;
+	unsigned head;
+	int multishot = 1;
+	int result;
+	unsigned flags;
+
+	if (ringInit(&ring) < 0)
+		return -1;
+	transformFD = eventfd(0, EFD_CLOEXEC);
+	if (transformFD < 0)
+		error("ERROR creating transform eventfd");
+
+	queueAccept(&ring, listenSocketFD, multishot);
+	queueTransformRead(&ring);
+	if (config->idleTimeout > 0)
+		queueTimeout(&ring, &tick, TIMEOUT_TAG);
+
+	while (1)
+	{
+		if (ringEnter(&ring, 1) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			error("ERROR on io_uring_enter");
+
+		head = *ring.cqHead;
+		while (head != __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE))
+		{
+			//copy the completion out and hand its slot back before acting on it
+			cqe = &ring.cqes[head & *ring.cqMask];
+			userData = cqe->user_data;
+			result = cqe->res;
+			flags = cqe->flags;
+			__atomic_store_n(ring.cqHead, ++head, __ATOMIC_RELEASE);
+
+			if (userData == ACCEPT_TAG)
+			{
+				//kernels before multishot accept reject the flag, accept one at a time there
+				if (result == -EINVAL && multishot)
+					multishot = 0;
+				else if (result >= 0)
+					acceptConnection(&ring, result, config);
+				else if (result != -EINTR && result != -ECONNABORTED)
+					fprintf(stderr, "ERROR on accept: %s\n", strerror(-result));
+				if (!(flags & IORING_CQE_F_MORE))
+					queueAccept(&ring, listenSocketFD, multishot);
+			}
+			else if (userData == TIMEOUT_TAG)
+			{
+				expireConnections(config);
+				queueTimeout(&ring, &tick, TIMEOUT_TAG);
+			}
+			else if (userData == TRANSFORM_TAG)
+			{
+				resumeTransforms(&ring);
+				queueTransformRead(&ring);
+			}
+			else
+			{
+				completeConnection(&ring, (struct connection *)(uintptr_t)userData, result);
+			}
+		}
+	}
+}
@@ -0,0 +1,16 @@
+/*****************************************************************************
+uring_loop.h
+
+Description: Single process server mode driven by io_uring. Accepts, reads
+and writes are submitted to the kernel and completed asynchronously, so one
+thread serves every connection with few system calls.
+*****************************************************************************/
+
+#ifndef URING_LOOP_H
+#define URING_LOOP_H
+
+#include "session.h"
+
+int runUringLoop(int listenSocketFD, const struct sessionConfig *config);
+
+#endif
@@ -0,0 +1,646 @@
+/*****************************************************************************
+v2_test.c
+
+Description: Runs otp_daemon in every server mode on a Unix socket and
+checks each part of version 2 of the protocol against the cipher code:
+requests confirmed with ACKs, requests pipelined with NOACK on a kept alive
+connection that the daemon closes once it has been idle, CHUNK streams,
+uploaded keys used through KEYREF, shared memory segments, BATCH requests,
+packed text and binary mode. Texts run from one character to a few MB, so
+large requests go through the transform pool. Frames larger than the daemon
+accepts must be answered with an ERROR frame.
+Exits 0 if every check passed, 1 otherwise.
+
+Intended Usage:
+v2_test [path to otp_daemon]
+*****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "protocol.h"
+#include "cipher.h"
+#include "address.h"
+
+// Requests sent back to back on one connection, and seconds a reply may take
+#define PIPELINED 3
+#define REPLY_TIMEOUT 5
+
+// Idle seconds after which the daemon under test closes a connection
+#define IDLE_TIMEOUT "1"
+
+/*****************************************************************************
+Global Variables + Function Prototypes
+*****************************************************************************/
+static pid_t daemonPid = -1;
+
+void error(const char *msg)
+{
+	fprintf(stderr, "%s", msg);
+	if (daemonPid > 0)
+		kill(daemonPid, SIGTERM);
+	exit(1);
+} // Error function used for reporting issues, stops the daemon under test
+
+int debug = 0;
+
+static const char *modes[] = {"epoll", "uring", "process", "thread", "fork"};
+static const size_t lengths[] = {1, 1000, 65536, 3000001};
+
+static const char *currentMode;
+static int failures = 0;
+
+/*****************************************************************************
+Counts a failed check and reports it
+*****************************************************************************/
+static void check(int passed, const char *what)
+{
+	if (passed)
+		return;
+	failures++;
+	fprintf(stderr, "%s: %s failed\n", currentMode, what);
+}
+
+/*****************************************************************************
+Starts the daemon in the given mode on address, storing keys in directory
+*****************************************************************************/
+static void startDaemon(const char *path, const char *mode, const char *directory, const char *address)
+{
+	daemonPid = fork();
+	if (daemonPid < 0)
+		error("ERROR forking the daemon\n");
+	if (daemonPid == 0)
+	{
+		execl(path, path, "-m", mode, "-k", directory, "-t", IDLE_TIMEOUT, address, (char *)NULL);
+		perror("ERROR starting the daemon");
+		_exit(1);
+	}
+}
+
+/*****************************************************************************
+Stops the daemon and waits for it to exit
+*****************************************************************************/
+static void stopDaemon()
+{
+	kill(daemonPid, SIGTERM);
+	waitpid(daemonPid, NULL, 0);
+	daemonPid = -1;
+}
+
+/*****************************************************************************
+Connects to the daemon, retrying while it is still starting up
+*****************************************************************************/
+static int connectDaemon(const char *address)
+{
+	struct sockaddr_storage serverAddress;
+	socklen_t addressLength;
+	struct timeval timeout = { REPLY_TIMEOUT, 0 };
+	struct timespec retry = { 0, 10 * 1000 * 1000 };
+	int socketFD;
+	int tries;
+
+	if (parseAddress(address, INADDR_LOOPBACK, &serverAddress, &addressLength) < 0)
+		error("ERROR invalid address\n");
+	for (tries = 0; tries < 300; tries++)
+	{
+		socketFD = socket(serverAddress.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (socketFD < 0)
+			error("ERROR opening socket\n");
+		if (connect(socketFD, (struct sockaddr *)&serverAddress, addressLength) == 0)
+		{
+			//a daemon that stops answering fails the test instead of hanging it
+			setsockopt(socketFD, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+			return socketFD;
+		}
+		close(socketFD);
+		nanosleep(&retry, NULL);
+	}
+	error("ERROR connecting to the daemon\n");
+	return -1;
+}
+
+/*****************************************************************************
+Sends the version 2 handshake for client, with the suffix picking plain,
+packed or binary mode
+*****************************************************************************/
+static void sendHandshake(int socketFD, const char *client, const char *suffix)
+{
+	char handshake[64];
+
+	snprintf(handshake, sizeof(handshake), "%s%s", client, suffix);
+	sendMessage(socketFD, handshake, strlen(handshake));
+}
+
+/*****************************************************************************
+Receives the daemon's answer to a handshake
+Returns 1 if it is the expected one
+*****************************************************************************/
+static int acceptedAs(int socketFD, const char *expected)
+{
+	char *status = receiveMessage(socketFD);
+	int passed = !strcmp(status, expected);
+
+	free(status);
+	return passed;
+}
+
+/*****************************************************************************
+Connects and completes the handshake
+*****************************************************************************/
+static int openSession(const char *address, const char *client, const char *suffix, const char *accept)
+{
+	int socketFD = connectDaemon(address);
+
+	sendHandshake(socketFD, client, suffix);
+	if (!acceptedAs(socketFD, accept))
+		error("ERROR daemon did not accept the client\n");
+	return socketFD;
+}
+
+/*****************************************************************************
+Receives a frame that should carry op, with the length it should have
+Returns its payload, or NULL if a different frame or length arrived
+*****************************************************************************/
+static char *expectFrame(int socketFD, int op, uint64_t length)
+{
+	struct frameHeader header;
+	char *payload = receiveFrame(socketFD, &header);
+
+	if (header.op == OP_ERROR)
+		fprintf(stderr, "%s: daemon answered %s\n", currentMode, payload);
+	if (header.op != op || header.length != length)
+	{
+		free(payload);
+		return NULL;
+	}
+	return payload;
+}
+
+/*****************************************************************************
+Receives a frame that should carry op and length bytes equal to expected
+Returns 1 if it did
+*****************************************************************************/
+static int expectPayload(int socketFD, int op, const char *expected, uint64_t length)
+{
+	char *payload = expectFrame(socketFD, op, length);
+	int passed = payload != NULL && !memcmp(payload, expected, length);
+
+	free(payload);
+	return passed;
+}
+
+/*****************************************************************************
+Fills a buffer with random characters of the alphabet
+*****************************************************************************/
+static void randomText(char *text, size_t length)
+{
+	size_t i;
+
+	for (i = 0; i < length; i++)
+		text[i] = cipherIntToChar(rand() % MAXCIPHER);
+}
+
+/*****************************************************************************
+Fills a buffer with random bytes
+*****************************************************************************/
+static void randomBytes(char *data, size_t length)
+{
+	size_t i;
+
+	for (i = 0; i < length; i++)
+		data[i] = rand();
+}
+
+/*****************************************************************************
+Sends a TEXT and KEY request confirmed with ACKs and checks the result, for
+both the encryption and decryption client
+*****************************************************************************/
+static void testAcked(const char *address, const char *text, const char *key, const char *encrypted, size_t length)
+{
+	const char *clients[] = {"OTP_ENC", "OTP_DEC"};
+	const char *messages[] = {text, encrypted};
+	const char *results[] = {encrypted, text};
+	int socketFD;
+	char *ack;
+	int passed;
+	int i;
+
+	for (i = 0; i < 2; i++)
+	{
+		socketFD = openSession(address, clients[i], VERSION_SUFFIX, ACCEPT_V2);
+		sendFrame(socketFD, OP_TEXT, 0, messages[i], length);
+		ack = expectFrame(socketFD, OP_ACK, 0);
+		passed = ack != NULL;
+		free(ack);
+		if (passed)
+		{
+			sendFrame(socketFD, OP_KEY, 0, key, length);
+			ack = expectFrame(socketFD, OP_ACK, 0);
+			passed = ack != NULL && expectPayload(socketFD, OP_RESULT, results[i], length);
+			free(ack);
+			sendFrame(socketFD, OP_ACK, 0, NULL, 0);
+		}
+		check(passed, i ? "acked decryption" : "acked encryption");
+		close(socketFD);
+	}
+}
+
+/*****************************************************************************
+Sends the handshake and several NOACK requests without waiting, then reads
+every answer. The connection is used again after a pause, then left idle
+until the daemon closes it.
+*****************************************************************************/
+static void testPipelined(const char *address, const char *text, const char *key, const char *encrypted, size_t length)
+{
+	struct timespec pause = { 0, 300 * 1000 * 1000 };
+	int socketFD = connectDaemon(address);
+	int passed = 1;
+	char byte;
+	int i;
+
+	sendHandshake(socketFD, "OTP_ENC", VERSION_SUFFIX);
+	for (i = 0; i < PIPELINED; i++)
+	{
+		sendFrame(socketFD, OP_TEXT, FLAG_NOACK, text, length);
+		sendFrame(socketFD, OP_KEY, 0, key, length);
+	}
+	check(acceptedAs(socketFD, ACCEPT_V2), "pipelined handshake");
+	for (i = 0; i < PIPELINED; i++)
+		passed = expectPayload(socketFD, OP_RESULT, encrypted, length) && passed;
+	check(passed, "pipelined requests");
+
+	//still open after a pause shorter than the idle timeout
+	nanosleep(&pause, NULL);
+	sendFrame(socketFD, OP_TEXT, FLAG_NOACK, text, length);
+	sendFrame(socketFD, OP_KEY, 0, key, length);
+	check(expectPayload(socketFD, OP_RESULT, encrypted, length), "kept alive request");
+
+	//then closed once idle, well before the reply timeout
+	check(recv(socketFD, &byte, 1, 0) == 0, "idle timeout");
+	close(socketFD);
+}
+
+/*****************************************************************************
+Streams the text in chunks of growing size, up to the largest the daemon
+accepts, and checks every result
+*****************************************************************************/
+static void testStream(const char *address, const char *text, const char *key, const char *encrypted, size_t length)
+{
+	int socketFD = openSession(address, "OTP_ENC", VERSION_SUFFIX, ACCEPT_V2);
+	char *chunk = malloc(2 * MAXCHUNK);
+	char *end;
+	size_t offset = 0;
+	size_t size = 1;
+	int passed = 1;
+
+	if (chunk == NULL)
+		error("ERROR allocating a chunk\n");
+	while (offset < length)
+	{
+		if (size > length - offset)
+			size = length - offset;
+		memcpy(chunk, text + offset, size);
+		memcpy(chunk + size, key + offset, size);
+		sendFrame(socketFD, OP_CHUNK, 0, chunk, 2 * size);
+		passed = expectPayload(socketFD, OP_RESULT, encrypted + offset, size) && passed;
+		offset += size;
+		size = size * 16 < MAXCHUNK ? size * 16 : MAXCHUNK;
+	}
+	sendFrame(socketFD, OP_END, 0, NULL, 0);
+	end = expectFrame(socketFD, OP_END, 0);
+	check(passed && end != NULL, "stream");
+	free(end);
+	free(chunk);
+	close(socketFD);
+}
+
+/*****************************************************************************
+Uploads the key, then encrypts with it from an offset through KEYREF
+*****************************************************************************/
+static void testStoredKey(const char *address, const char *text, const char *key, size_t length)
+{
+	int socketFD = openSession(address, "OTP_ENC", VERSION_SUFFIX, ACCEPT_V2);
+	unsigned char reference[KEYREF_SIZE];
+	size_t offset = length > 7 ? 7 : 0;
+	char *expected = malloc(length);
+	char *id;
+
+	if (expected == NULL)
+		error("ERROR allocating a result\n");
+	sendFrame(socketFD, OP_KEY_UPLOAD, 0, key, length);
+	id = expectFrame(socketFD, OP_KEY_ID, sizeof(uint64_t));
+	check(id != NULL, "key upload");
+	if (id != NULL)
+	{
+		memcpy(reference, id, sizeof(uint64_t));
+		encodeUint64(reference + 8, offset);
+		cipherEncrypt(expected, text, key + offset, length - offset);
+		sendFrame(socketFD, OP_TEXT, FLAG_NOACK, text, length - offset);
+		sendFrame(socketFD, OP_KEYREF, 0, (char *)reference, KEYREF_SIZE);
+		check(expectPayload(socketFD, OP_RESULT, expected, length - offset), "stored key");
+	}
+	free(id);
+	free(expected);
+	close(socketFD);
+}
+
+/*****************************************************************************
+Sends an SHM_MAP frame with a descriptor attached
+*****************************************************************************/
+static void sendSegment(int socketFD, int segmentFD)
+{
+	unsigned char header[FRAME_HEADER_SIZE];
+	struct iovec vec = { header, FRAME_HEADER_SIZE };
+	struct msghdr msg;
+	struct cmsghdr *control;
+	union
+	{
+		char buffer[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} controlBuffer;
+
+	encodeFrameHeader(header, OP_SHM_MAP, 0, 0);
+	memset(&msg, '\0', sizeof(msg));
+	msg.msg_iov = &vec;
+	msg.msg_iovlen = 1;
+	msg.msg_control = controlBuffer.buffer;
+	msg.msg_controllen = sizeof(controlBuffer.buffer);
+	control = CMSG_FIRSTHDR(&msg);
+	control->cmsg_level = SOL_SOCKET;
+	control->cmsg_type = SCM_RIGHTS;
+	control->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(control), &segmentFD, sizeof(int));
+	if (sendmsg(socketFD, &msg, MSG_NOSIGNAL) != FRAME_HEADER_SIZE)
+		error("ERROR writing to socket\n");
+}
+
+/*****************************************************************************
+Hands the daemon a shared segment holding the text and key, and has it
+write the result into a third part of the segment
+*****************************************************************************/
+static void testSharedMemory(const char *address, const char *text, const char *key, const char *encrypted, size_t length)
+{
+	int socketFD = openSession(address, "OTP_ENC", VERSION_SUFFIX, ACCEPT_V2);
+	unsigned char request[SHM_REQUEST_SIZE];
+	int segmentFD;
+	char *segment;
+	char *reply;
+	int passed;
+
+	segmentFD = memfd_create("v2_test", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (segmentFD < 0 || ftruncate(segmentFD, 3 * length) < 0 || fcntl(segmentFD, F_ADD_SEALS, F_SEAL_SHRINK) < 0)
+		error("ERROR creating a shared segment\n");
+	segment = mmap(NULL, 3 * length, PROT_READ | PROT_WRITE, MAP_SHARED, segmentFD, 0);
+	if (segment == MAP_FAILED)
+		error("ERROR mapping a shared segment\n");
+	memcpy(segment, text, length);
+	memcpy(segment + length, key, length);
+
+	sendSegment(socketFD, segmentFD);
+	reply = expectFrame(socketFD, OP_ACK, 0);
+	passed = reply != NULL;
+	free(reply);
+	if (passed)
+	{
+		encodeUint64(request, 0);
+		encodeUint64(request + 8, length);
+		encodeUint64(request + 16, 2 * length);
+		encodeUint64(request + 24, length);
+		sendFrame(socketFD, OP_SHM_REQUEST, 0, (char *)request, SHM_REQUEST_SIZE);
+		reply = expectFrame(socketFD, OP_SHM_DONE, 0);
+		passed = reply != NULL && !memcmp(segment + 2 * length, encrypted, length);
+		free(reply);
+	}
+	check(passed, "shared memory");
+
+	munmap(segment, 3 * length);
+	close(segmentFD);
+	close(socketFD);
+}
+
+/*****************************************************************************
+Splits the text into a batch of records of different lengths, each using
+the key from a different offset
+*****************************************************************************/
+static void testBatch(const char *address, const char *text, const char *key, size_t length)
+{
+	int socketFD = openSession(address, "OTP_ENC", VERSION_SUFFIX, ACCEPT_V2);
+	size_t count = length < 3 ? length : 3;
+	size_t tableLength = BATCH_COUNT_SIZE + count * BATCH_ENTRY_SIZE;
+	char *batch = malloc(tableLength + length);
+	char *expected = malloc(length);
+	size_t offset = 0;
+	size_t recordLength;
+	size_t i;
+
+	if (batch == NULL || expected == NULL)
+		error("ERROR allocating a batch\n");
+	encodeUint64((unsigned char *)batch, count);
+	for (i = 0; i < count; i++)
+	{
+		//records are laid out back to back, keys are used back to front
+		recordLength = i < count - 1 ? length / count : length - offset;
+		encodeUint64((unsigned char *)batch + BATCH_COUNT_SIZE + i * BATCH_ENTRY_SIZE, length - offset - recordLength);
+		encodeUint64((unsigned char *)batch + BATCH_COUNT_SIZE + i * BATCH_ENTRY_SIZE + 8, recordLength);
+		cipherEncrypt(expected + offset, text + offset, key + length - offset - recordLength, recordLength);
+		offset += recordLength;
+	}
+	memcpy(batch + tableLength, text, length);
+
+	sendFrame(socketFD, OP_BATCH, FLAG_NOACK, batch, tableLength + length);
+	sendFrame(socketFD, OP_KEY, 0, key, length);
+	check(expectPayload(socketFD, OP_RESULT, expected, length), "batch");
+
+	free(batch);
+	free(expected);
+	close(socketFD);
+}
+
+/*****************************************************************************
+Sends a packed request and a packed chunk, and unpacks the results
+*****************************************************************************/
+static void testPacked(const char *address, const char *text, const char *key, const char *encrypted, size_t length)
+{
+	int socketFD = openSession(address, "OTP_ENC", VERSION_SUFFIX_PACKED, ACCEPT_PACKED);
+	size_t chunkLength = length < MAXCHUNK ? length : MAXCHUNK;
+	unsigned char *packed = malloc(cipherPackedLength(2 * chunkLength > length ? 2 * chunkLength : length));
+	char *unpacked = malloc(2 * chunkLength > length ? 2 * chunkLength : length);
+	char *payload;
+	size_t packedLength;
+	uint64_t resultLength;
+	struct frameHeader header;
+
+	if (packed == NULL || unpacked == NULL)
+		error("ERROR allocating packed text\n");
+
+	packedLength = cipherPack(packed, text, length);
+	sendFrame(socketFD, OP_TEXT, FLAG_NOACK, (char *)packed, packedLength);
+	packedLength = cipherPack(packed, key, length);
+	sendFrame(socketFD, OP_KEY, 0, (char *)packed, packedLength);
+	payload = receiveFrame(socketFD, &header);
+	resultLength = header.op == OP_RESULT ? cipherUnpack(unpacked, (unsigned char *)payload, header.length) : 0;
+	check(resultLength == length && !memcmp(unpacked, encrypted, length), "packed request");
+	free(payload);
+
+	//a chunk is packed as a whole, text and key together
+	memcpy(unpacked, text, chunkLength);
+	memcpy(unpacked + chunkLength, key, chunkLength);
+	packedLength = cipherPack(packed, unpacked, 2 * chunkLength);
+	sendFrame(socketFD, OP_CHUNK, 0, (char *)packed, packedLength);
+	payload = receiveFrame(socketFD, &header);
+	resultLength = header.op == OP_RESULT ? cipherUnpack(unpacked, (unsigned char *)payload, header.length) : 0;
+	check(resultLength == chunkLength && !memcmp(unpacked, encrypted, chunkLength), "packed chunk");
+	free(payload);
+
+	free(packed);
+	free(unpacked);
+	close(socketFD);
+}
+
+/*****************************************************************************
+XORs arbitrary bytes, including NULs and newlines, in binary mode
+*****************************************************************************/
+static void testBinary(const char *address, size_t length)
+{
+	int socketFD = openSession(address, "OTP_ENC", VERSION_SUFFIX_BINARY, ACCEPT_BINARY);
+	char *data = malloc(length);
+	char *key = malloc(length);
+	char *expected = malloc(length);
+
+	if (data == NULL || key == NULL || expected == NULL)
+		error("ERROR allocating binary data\n");
+	randomBytes(data, length);
+	randomBytes(key, length);
+	data[0] = '\0';
+	cipherXor(expected, data, key, length);
+
+	sendFrame(socketFD, OP_TEXT, FLAG_NOACK, data, length);
+	sendFrame(socketFD, OP_KEY, 0, key, length);
+	check(expectPayload(socketFD, OP_RESULT, expected, length), "binary request");
+
+	free(data);
+	free(key);
+	free(expected);
+	close(socketFD);
+}
+
+/*****************************************************************************
+Announces a frame of op that is length bytes long and checks that the
+daemon refuses it with an ERROR frame before any payload is sent
+*****************************************************************************/
+static void testOversize(const char *address, int op, uint64_t length, const char *what)
+{
+	int socketFD = openSession(address, "OTP_ENC", VERSION_SUFFIX, ACCEPT_V2);
+	unsigned char header[FRAME_HEADER_SIZE];
+	struct frameHeader reply;
+	char *payload;
+
+	encodeFrameHeader(header, op, FLAG_NOACK, length);
+	if (sendAll(socketFD, header, FRAME_HEADER_SIZE) < 0)
+		error("ERROR writing to socket\n");
+	payload = receiveFrame(socketFD, &reply);
+	check(reply.op == OP_ERROR, what);
+	free(payload);
+	close(socketFD);
+}
+
+/*****************************************************************************
+Removes the key directory and everything the daemon left in it
+*****************************************************************************/
+static void removeDirectory(const char *directory)
+{
+	struct dirent *entry;
+	DIR *dir = opendir(directory);
+
+	if (dir == NULL)
+		return;
+	while ((entry = readdir(dir)) != NULL)
+	{
+		if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, ".."))
+			unlinkat(dirfd(dir), entry->d_name, 0);
+	}
+	closedir(dir);
+	rmdir(directory);
+}
+
+/*****************************************************************************
+Runs every check against the daemon in one mode
+Returns the number of checks that failed
+*****************************************************************************/
+static int testMode(const char *path, const char *mode, char *text, char *key, char *encrypted)
+{
+	char directory[] = "/tmp/v2_test.XXXXXX";
+	char address[64];
+	size_t i;
+
+	if (mkdtemp(directory) == NULL)
+		error("ERROR creating a key directory\n");
+	snprintf(address, sizeof(address), "%s/socket", directory);
+	currentMode = mode;
+	failures = 0;
+
+	startDaemon(path, mode, directory, address);
+	for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++)
+	{
+		randomText(text, lengths[i]);
+		randomText(key, lengths[i]);
+		cipherEncrypt(encrypted, text, key, lengths[i]);
+
+		testAcked(address, text, key, encrypted, lengths[i]);
+		testStream(address, text, key, encrypted, lengths[i]);
+		testStoredKey(address, text, key, lengths[i]);
+		testSharedMemory(address, text, key, encrypted, lengths[i]);
+		testBatch(address, text, key, lengths[i]);
+		testPacked(address, text, key, encrypted, lengths[i]);
+		testBinary(address, lengths[i]);
+	}
+	testPipelined(address, text, key, encrypted, lengths[1]);
+	testOversize(address, OP_TEXT, (uint64_t)1 << 40, "oversize text");
+	testOversize(address, OP_KEY_UPLOAD, (uint64_t)1 << 40, "oversize key upload");
+	testOversize(address, OP_CHUNK, 2 * MAXCHUNK + 2, "oversize chunk");
+	stopDaemon();
+	removeDirectory(directory);
+
+	printf("%-8s %s\n", mode, failures ? "FAILED" : "ok");
+	return failures;
+}
+
+/*****************************************************************************
+Main Driver
+*****************************************************************************/
+int main(int argc, char *argv[])
+{
+	const char *path = argc > 1 ? argv[1] : "./otp_daemon";
+	size_t largest = lengths[sizeof(lengths) / sizeof(lengths[0]) - 1];
+	char *text = malloc(largest);
+	char *key = malloc(largest);
+	char *encrypted = malloc(largest);
+	int totalFailures = 0;
+	size_t i;
+
+	if (text == NULL || key == NULL || encrypted == NULL)
+		error("ERROR allocating buffers\n");
+	signal(SIGPIPE, SIG_IGN);
+	srand(1);
+
+	for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+		totalFailures += testMode(path, modes[i], text, key, encrypted);
+
+	free(text);
+	free(key);
+	free(encrypted);
+	return totalFailures ? 1 : 0;
+}
@@ -0,0 +1,131 @@
+/*****************************************************************************
+worker_pool.c
+
+Description: Starts a fixed number of workers which all accept from the same
+listening socket. Process workers that die are replaced by the parent;
+thread workers share the daemon's address space and run until it exits.
+*****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "worker_pool.h"
+#include "metrics.h"
+
+void error(const char *msg);
+
+/*****************************************************************************
+What every worker needs to know
+*****************************************************************************/
+struct workerArgs
+{
+	int listenSocketFD;
+	const struct sessionConfig *config;
+};
+
+/*****************************************************************************
+Accepts connections from the shared listening socket forever, serving each
+one to completion before accepting the next
+*****************************************************************************/
+static void *workerMain(void *arg)
+{
+	struct workerArgs *args = arg;
+	int establishedConnectionFD;
+
+	while (1)
+	{
+		establishedConnectionFD = accept4(args->listenSocketFD, NULL, NULL, SOCK_CLOEXEC);
+		if (establishedConnectionFD < 0)
+		{
+			if (errno != EINTR && errno != ECONNABORTED)
+				perror("ERROR on accept");
+			continue;
+		}
+		serveSession(establishedConnectionFD, args->config);
+	}
+	return NULL;
+}
+
+/*****************************************************************************
+Forks a single worker process, returns its PID to the parent
+*****************************************************************************/
+static pid_t spawnWorker(struct workerArgs *args)
+{
+	pid_t spawnPid = fork();
+	if (spawnPid < 0)
+		error("ERROR forking worker");
+	if (spawnPid == 0)
+	{
+		//workers go away with the daemon instead of holding its port open
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		workerMain(args);
+		exit(0);
+	}
+	metricsAdd(METRIC_WORKERS, 1);
+	return spawnPid;
+}
+
+/*****************************************************************************
+Runs the daemon with a fixed pool of workers. Never returns.
+*****************************************************************************/
+void runWorkerPool(int listenSocketFD, const struct sessionConfig *config, int workers, int useThreads)
+{
+	struct workerArgs args;
+	pthread_t thread;
+	pid_t *workerPIDs;
+	pid_t finished;
+	int childExitMethod = -5;
+	int i;
+
+	args.listenSocketFD = listenSocketFD;
+	args.config = config;
+
+	if (useThreads)
+	{
+		//the main thread becomes the last worker
+		for (i = 1; i < workers; i++)
+		{
+			if (pthread_create(&thread, NULL, workerMain, &args))
+				error("ERROR creating worker thread");
+			pthread_detach(thread);
+		}
+		metricsAdd(METRIC_WORKERS, workers);
+		workerMain(&args);
+	}
+
+	workerPIDs = malloc(sizeof(pid_t) * workers);
+	if (workerPIDs == NULL)
+		error("ERROR allocating worker pool");
+	for (i = 0; i < workers; i++)
+		workerPIDs[i] = spawnWorker(&args);
+
+	//replace any worker that exits so the pool stays at full size
+	while (1)
+	{
+		finished = waitpid(-1, &childExitMethod, 0);
+		if (finished < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			error("ERROR waiting for worker");
+		}
+		for (i = 0; i < workers; i++)
+		{
+			if (workerPIDs[i] == finished)
+			{
+				metricsAdd(METRIC_WORKERS, -1);
+				workerPIDs[i] = spawnWorker(&args);
+			}
+		}
+	}
+}
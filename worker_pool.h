@@ -0,0 +1,16 @@
+/*****************************************************************************
+worker_pool.h
+
+Description: Pre-spawned pool of worker processes or threads. Every worker
+blocks in accept() on the shared listening socket, so the kernel hands each
+new connection to an idle worker and no process is created per client.
+*****************************************************************************/
+
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include "session.h"
+
+void runWorkerPool(int listenSocketFD, const struct sessionConfig *config, int workers, int useThreads);
+
+#endif